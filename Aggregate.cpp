@@ -3,29 +3,100 @@
 #include <stdint.h>
 #include <malloc.h>
 #include <assert.h>
+#include <math.h>
 // C++
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <map>
+#include <unordered_map>
+#include <queue>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <regex>
 #include <chrono>
 #include <sstream>
-#include <locale>
-#include <codecvt>
 
 // fmtlib
 #include <fmt/format.h>
 
 #ifdef _WIN32
 #include <windows.h>
+#include <io.h>
 #else
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#endif
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <signal.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define AGGREGATE_X86 1
+#if defined(__GNUC__)
+#define AGGREGATE_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define AGGREGATE_TARGET_AVX2
+#endif
 #endif
 
 #include "TbbLogger.h"
+#include "TbbReader.h"
 
 using tbb::serialization::data_type;
 using tbb::serialization::message;
+using tbb::serialization::perf_counter;
+using tbb::serialization::perf_sample;
+using tbb::serialization::PERF_MULTIPLEXED;
+using tbb::serialization::metric_kind;
+using tbb::serialization::metric_sample;
+using tbb::serialization::metric_histogram_buckets;
+using tbb::serialization::flow_phase;
+using tbb::serialization::flow_marker;
+
+using tbb::reader::mapped_file;
+using tbb::reader::map_file;
+using tbb::reader::unmap_file;
+using tbb::reader::next_message;
+using tbb::reader::scan_messages;
+using tbb::reader::load_unaligned;
+using tbb::reader::string_length;
+using tbb::reader::log_site;
+using tbb::reader::locate_site;
+typedef tbb::reader::param_string fmt_string;
+typedef tbb::reader::param_array fmt_array;
+typedef tbb::reader::param fmt_param;
+
+const char* const FLOW_PHASE_NAMES[] =
+{
+    "context",
+    "begin",
+    "step",
+    "end",
+};
+
+constexpr size_t PERF_COUNTER_COUNT = (size_t)perf_counter::count;
+const char* const PERF_COUNTER_NAMES[PERF_COUNTER_COUNT] =
+{
+    "instructions",
+    "cycles",
+    "cache-misses",
+    "context-switches",
+    "page-faults",
+    "task-clock",
+};
 
 typedef enum
 {
@@ -34,17 +105,512 @@ typedef enum
     OPTIONS_HIDE_CHILDID = 2,
     OPTIONS_HIDE_THREADID = 4,
     OPTIONS_HIDE_LOGSITE = 8,
+    OPTIONS_PERF_SUMMARY = 16,
+    OPTIONS_METRICS_CSV = 32,
+    OPTIONS_FLOWS = 64,
+    OPTIONS_STREAM = 128,
+    OPTIONS_FOLLOW = 256,
+    OPTIONS_BUILD_INDEX = 512,
+    OPTIONS_COLUMNAR = 1024,
+    OPTIONS_STATS = 2048,
+    OPTIONS_BENCHMARK = 4096,
+    OPTIONS_DIFF = 8192,
+    OPTIONS_LATENCY = 16384,
+    OPTIONS_REPACK = 32768,
 } aggregate_options_t;
 
+// accumulated scope durations and performance counters of a single log site
+struct perf_site_stats
+{
+    uint64_t count;
+    uint64_t total_duration;
+    // samples whose counters were multiplexed and scaled
+    uint64_t multiplexed;
+    uint64_t counter_samples[PERF_COUNTER_COUNT];
+    uint64_t counter_totals[PERF_COUNTER_COUNT];
+};
+typedef std::map<std::string, perf_site_stats> perf_summary_t;
+// running totals of counter metrics across all threads and processes
+typedef std::map<std::string, int64_t> metric_totals_t;
+
+// formatted log entries belonging to a single flow, in timestamp order
+struct flow_entry
+{
+    uint64_t timestamp;
+    uint32_t process_id;
+    uint32_t thread_id;
+    flow_phase phase;
+    std::string text;
+};
+typedef std::map<uint64_t, std::vector<flow_entry>> flows_t;
+
+// a substring or regular expression matched against a log site field
+struct string_filter
+{
+    std::string pattern;
+    bool is_regex;
+    std::regex regex;
+};
+
+// messages are printed only if they pass every given filter, where a filter
+// given more than once matches any of its values; filters are evaluated on
+// the message header and log site before any arguments are decoded
+struct message_filter
+{
+    // nanoseconds since the first message, as printed
+    bool has_since;
+    uint64_t since;
+    bool has_until;
+    uint64_t until;
+    std::vector<uint32_t> process_ids;
+    std::vector<uint32_t> thread_ids;
+    std::vector<string_filter> functions;
+    std::vector<string_filter> files;
+    std::vector<string_filter> format_strings;
+};
+
+class output_writer;
+
 struct print_config
 {
     aggregate_options_t options;
     uint32_t filename_offset;
     uint64_t begin_timestamp;
     FILE* out_file;
+    perf_summary_t* perf_summary;
+    metric_totals_t* metric_totals;
+    flows_t* flows;
+    // entries are appended here, on the main thread this is writer's buffer
+    // and on -j workers the buffer of the chunk being formatted
+    std::string* out_buffer;
+    output_writer* writer;
+    // null when no filters were given
+    const message_filter* filter;
+};
+
+// an input file in --stream or --latency mode, the mapping before released has
+// already been consumed and dropped, and release_checked is the read offset when that
+// was last attempted
+struct stream_release
+{
+    size_t released;
+    size_t release_checked;
+};
+
+const size_t DEFAULT_REORDER_WINDOW = 65536;
+const uint32_t DEFAULT_LATENCY_WINDOW_MS = 250;
+// how far a stream reads past the last release before dropping printed pages
+const size_t STREAM_RELEASE_BYTES = 8 * 1024 * 1024;
+
+void stream_messages(print_config& config, const std::vector<mapped_file>& mapped_logs, size_t reorder_window, size_t jobs);
+bool follow_logs(print_config& config, const std::vector<std::string>& directories, uint32_t latency_window_ms, size_t jobs);
+
+bool parse_filter_option(const std::string& arg, message_filter& filter, bool& has_filter);
+bool compile_pattern(string_filter& pattern);
+bool compile_filters(message_filter& filter, bool use_regex);
+bool filter_accepts_site(const message_filter& filter, const char* function, const char* file, const char* format_string);
+bool filter_accepts(const message_filter& filter, uint64_t begin_timestamp, const message* msg);
+
+// sidecar index of a log file, saved next to it as <file>.idx so repeated
+// filtered queries only read the records which can match
+const size_t INDEX_BLOCK_RECORDS = 1024;
+
+// a run of consecutive records and the range of their timestamps, records
+// are only nearly time ordered so blocks may overlap
+struct index_block
+{
+    uint64_t offset;
+    uint32_t count;
+    uint64_t min_timestamp;
+    uint64_t max_timestamp;
+};
+
+// a log site and the offsets of every record it logged
+struct index_site
+{
+    std::string function;
+    std::string file;
+    uint32_t line;
+    std::string format_string;
+    std::vector<uint64_t> offsets;
+};
+
+// the offsets and timestamps spanned by one thread's records
+struct index_thread
+{
+    uint64_t count;
+    uint64_t first_offset;
+    uint64_t last_offset;
+    uint64_t min_timestamp;
+    uint64_t max_timestamp;
+};
+
+struct log_index
+{
+    // the log's bytes covered by the index, it's brought up to date when the log grows
+    uint64_t indexed_bytes;
+    uint64_t record_count;
+    // records skipped because their params overrun their length
+    uint64_t malformed_count;
+    // header of the log's first record, a mismatch means the log was replaced
+    uint8_t fingerprint[sizeof(message)];
+    uint64_t min_timestamp;
+    uint64_t max_timestamp;
+    std::vector<index_block> blocks;
+    std::vector<index_site> sites;
+    std::map<std::pair<uint32_t, uint32_t>, index_thread> threads;
+};
+
+bool update_index(const std::string& log_path, const mapped_file& mapped, log_index& index, bool& changed);
+bool load_index(const std::string& log_path, const mapped_file& mapped, log_index& index);
+bool save_index(const std::string& log_path, const log_index& index);
+void select_indexed(const log_index& index, const mapped_file& mapped, const message_filter& filter,
+                    uint64_t begin_timestamp, std::vector<const message*>& messages);
+
+// one input file's messages in timestamp order, runs are read and sorted on a
+// thread per core and then merged
+struct sorted_run
+{
+    std::vector<const message*> messages;
+    // set when the run comes from the file's sidecar index
+    std::unique_ptr<log_index> index;
+    uint64_t begin_timestamp;
+    // bytes after the last complete record
+    size_t trailing_bytes;
+    // records skipped because their params overrun their length
+    size_t malformed_records;
+};
+
+void ingest_runs(const print_config& config, const std::vector<std::string>& log_bins,
+                 const std::vector<mapped_file>& mapped_logs, std::vector<sorted_run>& runs);
+void sort_runs(const print_config& config, const std::vector<mapped_file>& mapped_logs, std::vector<sorted_run>& runs);
+void merge_runs(std::vector<sorted_run>& runs, std::vector<const message*>& messages);
+
+// --format=columnar writes rows in groups, each group storing every column in
+// its own chunk so a reader only touches the columns it scans
+const size_t COLUMNAR_GROUP_ROWS = 65536;
+
+void write_columnar(const print_config& config, const std::vector<const message*>& messages);
+
+// --stats reports each log site's share of the logs without formatting anything
+const size_t DEFAULT_STATS_BUCKETS = 10;
+
+void print_stats(const print_config& config, const std::vector<const message*>& messages, size_t rate_buckets);
+
+// --benchmark times each stage of aggregating the logs and reports it on stderr
+void benchmark_stages(print_config& config, const std::vector<std::string>& log_bins,
+                      const std::vector<mapped_file>& mapped_logs, uint64_t map_nanoseconds);
+
+// --diff compares two captures site by site, sites are matched by function,
+// file and format string since line numbers move between builds
+const size_t DEFAULT_DIFF_TOP = 20;
+
+bool diff_captures(print_config& config, const std::string& capture_a, const std::string& capture_b, size_t top);
+
+// --latency pairs each message whose format string matches begin with the
+// next one matching end, streaming so only open pairs are held in memory
+struct latency_query
+{
+    string_filter begin;
+    string_filter end;
+    // pairs are matched on this format argument's value, across threads and
+    // processes, rather than per thread
+    bool has_key;
+    uint32_t key_argument;
 };
 
+void print_latency(print_config& config, const std::vector<mapped_file>& mapped_logs, size_t reorder_window,
+                   const latency_query& query, size_t top);
+
+// --repack merges the (sorted, filtered) messages into one compact archive,
+// see tbb::reader::ARCHIVE_MAGIC for its layout
+bool write_archive(const print_config& config, const std::vector<const message*>& messages, const std::string& path);
+
 void print_msg(const print_config& config, const message* msg);
+// "Parent" or "Child<id>", as messages are labelled by print_msg
+void append_process_name(std::string& out, uint32_t childid);
+std::string process_name(uint32_t childid);
+// identifies a log site in hash maps, without its line when sites are matched across builds
+void assign_site_key(std::string& key, const log_site& site, bool with_line = true);
+void print_perf_summary(const print_config& config);
+void print_flows(const print_config& config);
+void print_metric_csv(const print_config& config, const message* msg, const char* function, const char* filename, uint32_t line, const char* name, const metric_sample& metric);
+
+// collects formatted output and hands it to the OS in large write calls
+// rather than going through stdio a message at a time
+class output_writer
+{
+public:
+    static constexpr size_t FLUSH_BYTES = 4 * 1024 * 1024;
+
+    explicit output_writer(FILE* file)
+    : file(file)
+#ifdef _WIN32
+    , fd(_fileno(file))
+#else
+    , fd(fileno(file))
+#endif
+    , failed(false)
+    {
+        pending.reserve(FLUSH_BYTES + 64 * 1024);
+    }
+
+    ~output_writer()
+    {
+        flush();
+    }
+
+    std::string& buffer()
+    {
+        return pending;
+    }
+
+    void maybe_flush()
+    {
+        if (pending.size() >= FLUSH_BYTES) {
+            flush();
+        }
+    }
+
+    // small writes are batched, anything large goes straight out
+    void write(const char* data, size_t size)
+    {
+        if (pending.size() + size < FLUSH_BYTES) {
+            pending.append(data, size);
+            return;
+        }
+        flush();
+        write_all(data, size);
+    }
+
+    void flush()
+    {
+        // anything already written through stdio goes first
+        fflush(file);
+        write_all(pending.data(), pending.size());
+        pending.clear();
+    }
+
+    bool has_failed() const
+    {
+        return failed;
+    }
+
+private:
+    void write_all(const char* data, size_t size)
+    {
+        while (size > 0 && !failed)
+        {
+#ifdef _WIN32
+            const int written = _write(fd, data, (unsigned int)std::min<size_t>(size, 1u << 30));
+#else
+            const ssize_t written = ::write(fd, data, size);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+#endif
+            if (written <= 0) {
+                failed = true;
+                break;
+            }
+            data += written;
+            size -= written;
+        }
+    }
+
+    FILE* file;
+    int fd;
+    bool failed;
+    std::string pending;
+};
+
+// prints messages in the order they are pushed; with more than one job the
+// messages are batched into chunks which worker threads format into their own
+// buffers, and finished chunks are written out (and their perf summaries and
+// flows merged) strictly in submission order
+class format_pipeline
+{
+public:
+    format_pipeline(const print_config& config, size_t jobs)
+    : config(config)
+    , max_in_flight(jobs * 4)
+    , exiting(false)
+    {
+        if (jobs > 1) {
+            current.reset(new chunk());
+            current->messages.reserve(CHUNK_MESSAGES);
+            for(size_t k = 0; k < jobs; ++k) {
+                workers.emplace_back([this]() { worker_func(); });
+            }
+        }
+    }
+
+    ~format_pipeline()
+    {
+        finish();
+    }
+
+    void push(const message* msg)
+    {
+        if (workers.empty()) {
+            print_msg(config, msg);
+            config.writer->maybe_flush();
+            return;
+        }
+        current->messages.push_back(msg);
+        if (current->messages.size() == CHUNK_MESSAGES) {
+            submit();
+        }
+    }
+
+    // writes out everything pushed so far, after which none of the pushed
+    // messages are referenced anymore
+    void flush()
+    {
+        if (workers.empty()) {
+            return;
+        }
+        if (!current->messages.empty()) {
+            submit();
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        retire_chunks(lock, 0);
+    }
+
+    // flushes and stops the workers
+    void finish()
+    {
+        if (workers.empty()) {
+            return;
+        }
+        flush();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        exiting = true;
+        work_ready.notify_all();
+        lock.unlock();
+
+        for(auto& worker : workers) {
+            worker.join();
+        }
+        workers.clear();
+    }
+
+private:
+    static constexpr size_t CHUNK_MESSAGES = 4096;
+
+    struct chunk
+    {
+        std::vector<const message*> messages;
+        std::string text;
+        perf_summary_t perf_summary;
+        flows_t flows;
+        bool done = false;
+    };
+
+    void submit()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        pending.push_back(current.get());
+        in_flight.push_back(std::move(current));
+        work_ready.notify_one();
+        lock.unlock();
+
+        current.reset(new chunk());
+        current->messages.reserve(CHUNK_MESSAGES);
+
+        lock.lock();
+        retire_chunks(lock, max_in_flight - 1);
+    }
+
+    // writes out finished chunks in order, waiting on the oldest while more
+    // than max_remaining are still in flight
+    void retire_chunks(std::unique_lock<std::mutex>& lock, size_t max_remaining)
+    {
+        while (!in_flight.empty())
+        {
+            if (!in_flight.front()->done) {
+                if (in_flight.size() <= max_remaining) {
+                    break;
+                }
+                chunk_done.wait(lock);
+                continue;
+            }
+
+            std::unique_ptr<chunk> finished = std::move(in_flight.front());
+            in_flight.pop_front();
+            lock.unlock();
+            retire(*finished);
+            lock.lock();
+        }
+    }
+
+    void retire(chunk& finished)
+    {
+        config.writer->write(finished.text.data(), finished.text.size());
+
+        if (config.perf_summary) {
+            for(const auto& site : finished.perf_summary) {
+                auto& stats = (*config.perf_summary)[site.first];
+                stats.count += site.second.count;
+                stats.total_duration += site.second.total_duration;
+                stats.multiplexed += site.second.multiplexed;
+                for(size_t k = 0; k < PERF_COUNTER_COUNT; ++k) {
+                    stats.counter_samples[k] += site.second.counter_samples[k];
+                    stats.counter_totals[k] += site.second.counter_totals[k];
+                }
+            }
+        }
+
+        if (config.flows) {
+            for(auto& flow : finished.flows) {
+                auto& entries = (*config.flows)[flow.first];
+                std::move(flow.second.begin(), flow.second.end(), std::back_inserter(entries));
+            }
+        }
+    }
+
+    void worker_func()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            work_ready.wait(lock, [this]() { return exiting || !pending.empty(); });
+            if (pending.empty()) {
+                return;
+            }
+            chunk* work = pending.front();
+            pending.pop_front();
+            lock.unlock();
+
+            print_config chunk_config = config;
+            chunk_config.out_buffer = &work->text;
+            chunk_config.perf_summary = config.perf_summary ? &work->perf_summary : nullptr;
+            chunk_config.flows = config.flows ? &work->flows : nullptr;
+            for(auto msg : work->messages) {
+                print_msg(chunk_config, msg);
+            }
+
+            lock.lock();
+            work->done = true;
+            chunk_done.notify_all();
+        }
+    }
+
+    const print_config& config;
+    const size_t max_in_flight;
+
+    std::unique_ptr<chunk> current;
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable chunk_done;
+    std::deque<std::unique_ptr<chunk>> in_flight;
+    std::deque<chunk*> pending;
+    bool exiting;
+};
 
 void print_help() {
     printf(
@@ -55,7 +621,55 @@ void print_help() {
         " --hide-timestamp       Do not print log entry's timestamp\n"
         " --hide-childid         Do not print log entry's child id\n"
         " --hide-threadid        Do not print log entry's thread id\n"
-        " --hide-logsite         Do not print log entry's log site\n");
+        " --hide-logsite         Do not print log entry's log site\n"
+        " --perf-summary         Print per log site scope durations and performance counters\n"
+        " --metrics-csv          Print only metric snapshots (TBB_COUNTER, TBB_GAUGE,\n"
+        "                        TBB_HISTOGRAM) as a CSV time series\n"
+        " --flows                Group log entries by flow id, with each flow's latency\n"
+        "                        and critical path across threads and processes\n"
+        " --stream               Merge files as they are read instead of loading and\n"
+        "                        sorting every message first, uses bounded memory\n"
+        " --reorder-window=N     Messages per file buffered to restore timestamp order\n"
+        "                        in --stream mode (default 65536)\n"
+        " --stats                Print per log site message counts, bytes, rates over\n"
+        "                        time, inter-arrival times and per process/thread counts\n"
+        "                        instead of the messages\n"
+        " --stats-buckets=N      Time buckets in --stats rates (default 10)\n"
+        " --benchmark            Time each stage (ingest, sort, decode, format, write)\n"
+        "                        and print their throughput to stderr\n"
+        " --diff A B             Compare two captures (directories of logs or single\n"
+        "                        logs) by log site: counts, rates, intervals and the\n"
+        "                        time to each thread's next site, biggest change first\n"
+        " --latency BEGIN END    Pair messages whose format strings match BEGIN and END\n"
+        "                        on each thread and print latency percentiles, a\n"
+        "                        histogram and the slowest pairs, streaming the logs\n"
+        " --latency-key=N        Pair on the Nth format argument (from 0) instead, across\n"
+        "                        threads and processes\n"
+        " --top=N                Sites and transitions listed by --diff, slowest pairs\n"
+        "                        listed by --latency (default 20, 0 for all)\n"
+        " --format=FORMAT        Output 'text' (default) or 'columnar', a compressed\n"
+        "                        column oriented file for analysis scripts\n"
+        " --repack ARCHIVE       Merge the logs into one sorted and compressed archive,\n"
+        "                        which later runs take as input without sorting\n"
+        " --build-index          Write or update an index next to each log file, later\n"
+        "                        queries with filters then only read matching records\n"
+        " --follow [DIR]...      Watch log directories (default: the logger's directory)\n"
+        "                        and print messages as they are written, until ^C\n"
+        " --latency-window=MS    How long --follow holds messages back to merge them\n"
+        "                        in timestamp order across files (default 250)\n"
+        "Filters (repeat one to match any of its values):\n"
+        " --since=SECONDS        Only messages at or after this timestamp\n"
+        " --until=SECONDS        Only messages at or before this timestamp\n"
+        " --process=ID           Only messages from this child id ('parent' for 0)\n"
+        " --thread=ID            Only messages from this thread id\n"
+        " --function=PATTERN     Only messages logged from a matching function\n"
+        " --file=PATTERN         Only messages logged from a matching file\n"
+        " --format-string=PATTERN\n"
+        "                        Only messages whose format string matches\n"
+        " --regex                Treat PATTERNs as regular expressions rather than\n"
+        "                        substrings\n"
+        " -j N                   Format messages on N threads, 0 for one per core\n"
+        "                        (default 1, --metrics-csv always uses 1)\n");
 }
 
 int main(int argc, char** argv)
@@ -78,11 +692,31 @@ int main(int argc, char** argv)
         0u,
         0ull,
         nullptr,
+        nullptr,
+        nullptr,
+        nullptr,
+        nullptr,
+        nullptr,
+        nullptr,
     };
+    perf_summary_t perf_summary;
+    metric_totals_t metric_totals;
+    flows_t flows;
 
     // parse options, get filenames
     std::vector<std::string> log_bins;
     std::string output_filename = "";
+    size_t reorder_window = DEFAULT_REORDER_WINDOW;
+    size_t jobs = 1;
+    uint32_t latency_window_ms = DEFAULT_LATENCY_WINDOW_MS;
+    size_t stats_buckets = DEFAULT_STATS_BUCKETS;
+    std::string diff_paths[2];
+    size_t top = DEFAULT_DIFF_TOP;
+    latency_query latency = {};
+    std::string archive_path;
+    message_filter filter = {};
+    bool has_filter = false;
+    bool use_regex = false;
     for(size_t k = 0; k < args.size(); ++k)
     {
         auto& current_arg = args[k];
@@ -97,6 +731,117 @@ int main(int argc, char** argv)
             config.options = aggregate_options_t(config.options | OPTIONS_HIDE_THREADID);
         } else if (current_arg == "--hide-logsite") {
             config.options = aggregate_options_t(config.options | OPTIONS_HIDE_LOGSITE);
+        } else if (current_arg == "--perf-summary") {
+            config.options = aggregate_options_t(config.options | OPTIONS_PERF_SUMMARY);
+            config.perf_summary = &perf_summary;
+        } else if (current_arg == "--metrics-csv") {
+            config.options = aggregate_options_t(config.options | OPTIONS_METRICS_CSV);
+            config.metric_totals = &metric_totals;
+        } else if (current_arg == "--flows") {
+            config.options = aggregate_options_t(config.options | OPTIONS_FLOWS);
+            config.flows = &flows;
+        } else if (current_arg == "--stats") {
+            config.options = aggregate_options_t(config.options | OPTIONS_STATS);
+        } else if (current_arg.find("--stats-buckets=", 0) == 0) {
+            int32_t buckets = 0;
+            if (sscanf(current_arg.c_str(), "--stats-buckets=%i", &buckets) != 1 || buckets < 1) {
+                printf("Error parsing %s\n", current_arg.c_str());
+                return -1;
+            }
+            stats_buckets = buckets;
+        } else if (current_arg == "--benchmark") {
+            config.options = aggregate_options_t(config.options | OPTIONS_BENCHMARK);
+        } else if (current_arg == "--diff") {
+            if (k + 2 >= args.size()) {
+                printf("Missing captures for --diff option\n");
+                return -1;
+            }
+            config.options = aggregate_options_t(config.options | OPTIONS_DIFF);
+            diff_paths[0] = args[++k];
+            diff_paths[1] = args[++k];
+        } else if (current_arg == "--latency") {
+            if (k + 2 >= args.size()) {
+                printf("Missing patterns for --latency option\n");
+                return -1;
+            }
+            config.options = aggregate_options_t(config.options | OPTIONS_LATENCY);
+            latency.begin.pattern = args[++k];
+            latency.end.pattern = args[++k];
+        } else if (current_arg.find("--latency-key=", 0) == 0) {
+            int32_t argument = 0;
+            if (sscanf(current_arg.c_str(), "--latency-key=%i", &argument) != 1 || argument < 0) {
+                printf("Error parsing %s\n", current_arg.c_str());
+                return -1;
+            }
+            latency.has_key = true;
+            latency.key_argument = argument;
+        } else if (current_arg.find("--top=", 0) == 0) {
+            int32_t count = 0;
+            if (sscanf(current_arg.c_str(), "--top=%i", &count) != 1 || count < 0) {
+                printf("Error parsing %s\n", current_arg.c_str());
+                return -1;
+            }
+            top = count;
+        } else if (current_arg == "--stream") {
+            config.options = aggregate_options_t(config.options | OPTIONS_STREAM);
+        } else if (current_arg == "--regex") {
+            use_regex = true;
+        } else if (parse_filter_option(current_arg, filter, has_filter)) {
+            if (!has_filter) {
+                printf("Error parsing %s\n", current_arg.c_str());
+                return -1;
+            }
+        } else if (current_arg.find("--format=", 0) == 0) {
+            const std::string format = current_arg.substr(9);
+            if (format == "columnar") {
+                config.options = aggregate_options_t(config.options | OPTIONS_COLUMNAR);
+            } else if (format == "text") {
+                config.options = aggregate_options_t(config.options & ~OPTIONS_COLUMNAR);
+            } else {
+                printf("Unknown output format: '%s'\n", format.c_str());
+                return -1;
+            }
+        } else if (current_arg == "--repack") {
+            if (++k == args.size()) {
+                printf("Missing name for --repack option\n");
+                return -1;
+            }
+            config.options = aggregate_options_t(config.options | OPTIONS_REPACK);
+            archive_path = args[k];
+        } else if (current_arg == "--build-index") {
+            config.options = aggregate_options_t(config.options | OPTIONS_BUILD_INDEX);
+        } else if (current_arg == "--follow") {
+            config.options = aggregate_options_t(config.options | OPTIONS_FOLLOW);
+        } else if (current_arg.find("--latency-window=", 0) == 0) {
+            int32_t window = 0;
+            if (sscanf(current_arg.c_str(), "--latency-window=%i", &window) != 1 || window < 0) {
+                printf("Error parsing %s\n", current_arg.c_str());
+                return -1;
+            }
+            latency_window_ms = window;
+        } else if (current_arg.find("--reorder-window=", 0) == 0) {
+            int32_t window = 0;
+            if (sscanf(current_arg.c_str(), "--reorder-window=%i", &window) != 1 || window < 1) {
+                printf("Error parsing %s\n", current_arg.c_str());
+                return -1;
+            }
+            reorder_window = window;
+        } else if (current_arg.find("-j", 0) == 0) {
+            // either -j N or -jN
+            std::string count = current_arg.substr(2);
+            if (count.empty()) {
+                if (++k == args.size()) {
+                    printf("Missing count for -j option\n");
+                    return -1;
+                }
+                count = args[k];
+            }
+            int32_t job_count = 0;
+            if (sscanf(count.c_str(), "%i", &job_count) != 1 || job_count < 0) {
+                printf("Error parsing -j %s\n", count.c_str());
+                return -1;
+            }
+            jobs = job_count;
         } else if (current_arg.find("--filename-offset=", 0) == 0) {
             int32_t filename_offset = 0;
             if (sscanf(current_arg.c_str(), "--filename-offset=%i", &filename_offset) != 1 || filename_offset < 0) {
@@ -133,346 +878,4145 @@ int main(int argc, char** argv)
         }
     }
 
-    // bring logs in from disk
-    std::vector<message*> messages;
-    for (auto& current_log : log_bins)
-    {
-        FILE* log_file = fopen(current_log.c_str(), "rb");
-        if (log_file) {
-            while(true)
-            {
-                fpos_t fpos;
-                fgetpos(log_file, &fpos);
+    // follow mode doesn't map its directories up front, so there's nothing to index
+    if ((config.options & OPTIONS_BUILD_INDEX) && (config.options & OPTIONS_FOLLOW)) {
+        printf("--build-index can't be combined with --follow\n");
+        return -1;
+    }
+    if ((config.options & OPTIONS_COLUMNAR) &&
+        (config.options & (OPTIONS_STREAM | OPTIONS_FOLLOW | OPTIONS_METRICS_CSV | OPTIONS_FLOWS | OPTIONS_PERF_SUMMARY))) {
+        printf("--format=columnar can't be combined with --stream, --follow, --metrics-csv, --flows or --perf-summary\n");
+        return -1;
+    }
+    if ((config.options & OPTIONS_STATS) &&
+        (config.options & (OPTIONS_STREAM | OPTIONS_FOLLOW | OPTIONS_COLUMNAR | OPTIONS_METRICS_CSV | OPTIONS_FLOWS | OPTIONS_PERF_SUMMARY))) {
+        printf("--stats can't be combined with --stream, --follow, --format=columnar, --metrics-csv, --flows or --perf-summary\n");
+        return -1;
+    }
+    if ((config.options & OPTIONS_BENCHMARK) &&
+        (config.options & (OPTIONS_STREAM | OPTIONS_FOLLOW | OPTIONS_COLUMNAR | OPTIONS_STATS | OPTIONS_METRICS_CSV | OPTIONS_FLOWS))) {
+        printf("--benchmark can't be combined with --stream, --follow, --format=columnar, --stats, --metrics-csv or --flows\n");
+        return -1;
+    }
+    if ((config.options & OPTIONS_DIFF) &&
+        ((config.options & (OPTIONS_STREAM | OPTIONS_FOLLOW | OPTIONS_BUILD_INDEX | OPTIONS_COLUMNAR | OPTIONS_STATS |
+                            OPTIONS_BENCHMARK | OPTIONS_METRICS_CSV | OPTIONS_FLOWS | OPTIONS_PERF_SUMMARY)) ||
+         !log_bins.empty())) {
+        printf("--diff can't be combined with log files, --stream, --follow, --build-index, --format=columnar, --stats, --benchmark, --metrics-csv, --flows or --perf-summary\n");
+        return -1;
+    }
 
-                uint32_t len;
-                if(fread(&len, sizeof(len), 1, log_file) != 1)
-                {
-                    break;
-                }
+    if ((config.options & OPTIONS_LATENCY) &&
+        (config.options & (OPTIONS_FOLLOW | OPTIONS_BUILD_INDEX | OPTIONS_COLUMNAR | OPTIONS_STATS | OPTIONS_BENCHMARK |
+                           OPTIONS_DIFF | OPTIONS_METRICS_CSV | OPTIONS_FLOWS | OPTIONS_PERF_SUMMARY))) {
+        printf("--latency can't be combined with --follow, --build-index, --format=columnar, --stats, --benchmark, --diff, --metrics-csv, --flows or --perf-summary\n");
+        return -1;
+    }
+    if ((config.options & OPTIONS_REPACK) &&
+        (config.options & (OPTIONS_STREAM | OPTIONS_FOLLOW | OPTIONS_BUILD_INDEX | OPTIONS_COLUMNAR | OPTIONS_STATS |
+                           OPTIONS_BENCHMARK | OPTIONS_DIFF | OPTIONS_LATENCY | OPTIONS_METRICS_CSV | OPTIONS_FLOWS |
+                           OPTIONS_PERF_SUMMARY))) {
+        printf("--repack can't be combined with --stream, --follow, --build-index, --format=columnar, --stats, --benchmark, --diff, --latency, --metrics-csv, --flows or --perf-summary\n");
+        return -1;
+    }
+    if (use_regex && (config.options & OPTIONS_LATENCY)) {
+        if (!compile_pattern(latency.begin) || !compile_pattern(latency.end)) {
+            return -1;
+        }
+    }
 
-                fsetpos(log_file, &fpos);
-                message* msg = (message*)malloc(len);
-                if(fread(msg, 1, len, log_file) != len)
-                {
-                    free(msg);
-                    break;
-                }
-                messages.push_back(msg);
-            }
-            fclose(log_file);
-        } else {
-            printf("Error opening log file: '%s'\n", current_log.c_str());
+    if (has_filter) {
+        if (!compile_filters(filter, use_regex)) {
             return -1;
         }
+        config.filter = &filter;
+    }
+
+    // in follow mode the arguments are directories, defaulting to where the logger writes
+    if ((config.options & OPTIONS_FOLLOW) && log_bins.empty()) {
+        char log_dir[1024];
+        tbb::internal::get_log_directory(log_dir, sizeof(log_dir));
+        log_bins.push_back(log_dir);
     }
 
-    // stable sort by timestamp
-    // messages from the same thread with the same timestamp will appear in correct
-    // order sine it's a stable sort
-    std::stable_sort (messages.begin(), messages.end(), [](message* a, message* b)
+    // map logs in from disk, messages point directly into the mappings
+    const uint64_t map_begin = tbb::internal::get_timestamp();
+    std::vector<mapped_file> mapped_logs;
+    for (auto& current_log : log_bins)
     {
-        return (a->timestamp) < (b->timestamp);
-    });
+        if (config.options & OPTIONS_FOLLOW) {
+            break;
+        }
+        mapped_file mapped;
+        if (map_file(current_log.c_str(), mapped)) {
+            mapped_logs.push_back(mapped);
+        } else {
+            printf("Error opening log file: '%s'\n", current_log.c_str());
+            return -1;
+        }
+    }
 
-    config.begin_timestamp = messages.front()->timestamp;
+    const uint64_t map_nanoseconds = tbb::internal::get_timestamp() - map_begin;
 
-    for(auto msg : messages)
-    {
-        print_msg(config, msg);
+    if (config.options & OPTIONS_BUILD_INDEX) {
+        for (size_t k = 0; k < log_bins.size(); ++k)
+        {
+            log_index index;
+            bool changed = false;
+            if (!update_index(log_bins[k], mapped_logs[k], index, changed) ||
+                (changed && !save_index(log_bins[k], index))) {
+                printf("Error writing index for '%s'\n", log_bins[k].c_str());
+                return -1;
+            }
+            printf("%s: %llu records, %zu sites, %zu threads%s\n",
+                log_bins[k].c_str(),
+                (unsigned long long)index.record_count,
+                index.sites.size(),
+                index.threads.size(),
+                changed ? "" : " (up to date)");
+        }
+        return 0;
     }
 
-    fflush(config.out_file);
+    output_writer writer(config.out_file);
+    config.writer = &writer;
+    config.out_buffer = &writer.buffer();
+
+    if (config.options & OPTIONS_METRICS_CSV) {
+        writer.buffer() += "timestamp,childid,threadid,function,filename,line,name,kind,value,total,count,min,max\n";
+        // counter totals are running sums, so rows have to be produced in order
+        jobs = 1;
+    } else if (jobs == 0) {
+        jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    if (config.options & OPTIONS_FOLLOW) {
+        if (!follow_logs(config, log_bins, latency_window_ms, jobs)) {
+            return -1;
+        }
+    } else if (config.options & OPTIONS_LATENCY) {
+        print_latency(config, mapped_logs, reorder_window, latency, top);
+    } else if (config.options & OPTIONS_STREAM) {
+        stream_messages(config, mapped_logs, reorder_window, jobs);
+    } else if (config.options & OPTIONS_BENCHMARK) {
+        benchmark_stages(config, log_bins, mapped_logs, map_nanoseconds);
+    } else if (config.options & OPTIONS_DIFF) {
+        if (!diff_captures(config, diff_paths[0], diff_paths[1], top)) {
+            return -1;
+        }
+    } else {
+        std::vector<sorted_run> runs;
+        ingest_runs(config, log_bins, mapped_logs, runs);
+
+        // timestamps are relative to the first message in any log
+        uint64_t begin_timestamp = UINT64_MAX;
+        for (const auto& run : runs)
+        {
+            begin_timestamp = std::min(begin_timestamp, run.begin_timestamp);
+        }
+        if (begin_timestamp != UINT64_MAX) {
+            config.begin_timestamp = begin_timestamp;
+        }
+
+        sort_runs(config, mapped_logs, runs);
+        std::vector<const message*> messages;
+        merge_runs(runs, messages);
+
+        if (config.options & OPTIONS_REPACK) {
+            if (!write_archive(config, messages, archive_path)) {
+                printf("Error writing archive: '%s'\n", archive_path.c_str());
+                return -1;
+            }
+        } else if (config.options & OPTIONS_COLUMNAR) {
+            write_columnar(config, messages);
+        } else if (config.options & OPTIONS_STATS) {
+            print_stats(config, messages, stats_buckets);
+        } else {
+            format_pipeline pipeline(config, jobs);
+            for(auto msg : messages)
+            {
+                pipeline.push(msg);
+            }
+            pipeline.finish();
+        }
+    }
+
+    // the reports below are written through stdio
+    writer.flush();
+
+    if (config.options & OPTIONS_FLOWS) {
+        print_flows(config);
+    }
+
+    if (config.options & OPTIONS_PERF_SUMMARY) {
+        print_perf_summary(config);
+    }
+
+    fflush(config.out_file);
+
+    if (writer.has_failed() || ferror(config.out_file)) {
+        printf("Error writing output file: '%s'\n", output_filename == "" ? "stdout" : output_filename.c_str());
+        return -1;
+    }
+
+    for (auto& mapped : mapped_logs)
+    {
+        unmap_file(mapped);
+    }
 
     return 0;
 }
 
-template<typename CharType>
-constexpr size_t string_length(const CharType* str)
+// drops the pages of the mapping which only hold consumed messages so resident
+// memory stays bounded on logs larger than RAM, flush_pending is called first
+// to finish with anything else still pointing into those pages
+template<typename Flush>
+static void release_consumed(const tbb::reader::merged_reader& reader, size_t file, const mapped_file& mapped,
+                             stream_release& release, Flush flush_pending)
+{
+#ifndef _WIN32
+    const size_t offset = reader.read_offset(file);
+    if (offset - release.release_checked < STREAM_RELEASE_BYTES) {
+        return;
+    }
+    release.release_checked = offset;
+    flush_pending();
+
+    size_t lowest = reader.consumed_offset(file);
+    const size_t page_size = size_t(sysconf(_SC_PAGESIZE));
+    lowest -= lowest % page_size;
+    if (lowest > release.released) {
+        madvise((void*)(mapped.data + release.released), lowest - release.released, MADV_DONTNEED);
+        release.released = lowest;
+    }
+#else
+    (void)reader;
+    (void)file;
+    (void)mapped;
+    (void)release;
+    (void)flush_pending;
+#endif
+}
+
+// a merged read stops at a truncated record or a damaged archive block, which
+// is only found once the read gets there
+static void report_unread(const tbb::reader::merged_reader& reader, const std::vector<mapped_file>& mapped_logs)
+{
+    size_t unread = 0;
+    for (size_t k = 0; k < mapped_logs.size(); ++k)
+    {
+        unread += mapped_logs[k].size - reader.read_offset(k);
+    }
+    if (unread != 0) {
+        fprintf(stderr, "Ignoring %zu bytes after the last complete records\n", unread);
+    }
+}
+
+// merges the input files as they're read, see tbb::reader::merged_reader
+void stream_messages(print_config& config, const std::vector<mapped_file>& mapped_logs, size_t reorder_window, size_t jobs)
+{
+    tbb::reader::merged_reader reader(mapped_logs, reorder_window);
+    std::vector<stream_release> releases(mapped_logs.size(), stream_release{0, 0});
+
+    if (reader.peek() == nullptr) {
+        return;
+    }
+    config.begin_timestamp = reader.peek()->timestamp;
+    format_pipeline pipeline(config, jobs);
+
+    size_t file = 0;
+    while (const message* msg = reader.next(&file))
+    {
+        pipeline.push(msg);
+        // messages still queued for formatting point into the mapping too
+        release_consumed(reader, file, mapped_logs[file], releases[file], [&]() { pipeline.flush(); });
+    }
+    pipeline.finish();
+
+    if (reader.malformed() != 0) {
+        fprintf(stderr, "Skipped %zu malformed records\n", reader.malformed());
+    }
+    report_unread(reader, mapped_logs);
+    const size_t out_of_order = reader.out_of_order();
+    if (out_of_order != 0) {
+        fprintf(stderr, "%zu messages were out of order by more than the reorder window, "
+                        "try a larger --reorder-window\n", out_of_order);
+    }
+}
+
+// runs func(k) for k in [0, count) on up to one thread per core
+template<typename Func>
+static void parallel_for(size_t count, Func func)
+{
+    const size_t threads = std::min<size_t>(count, std::max(1u, std::thread::hardware_concurrency()));
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t k = next++; k < count; k = next++)
+        {
+            func(k);
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t k = 1; k < threads; ++k)
+    {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : pool)
+    {
+        thread.join();
+    }
+}
+
+// reads every log concurrently: with filters, logs which have an index only
+// take their first timestamp from it, the rest are scanned for their records
+// and checked for a clean end
+void ingest_runs(const print_config& config, const std::vector<std::string>& log_bins,
+                 const std::vector<mapped_file>& mapped_logs, std::vector<sorted_run>& runs)
+{
+    runs.resize(mapped_logs.size());
+    parallel_for(mapped_logs.size(), [&](size_t k) {
+        auto& run = runs[k];
+        run.begin_timestamp = UINT64_MAX;
+        run.trailing_bytes = 0;
+        run.malformed_records = 0;
+        if (config.filter) {
+            run.index.reset(new log_index());
+            if (load_index(log_bins[k], mapped_logs[k], *run.index)) {
+                if (run.index->record_count != 0) {
+                    run.begin_timestamp = run.index->min_timestamp;
+                }
+                // the index was brought up to date, so it ends where a scan would
+                run.trailing_bytes = mapped_logs[k].size - run.index->indexed_bytes;
+                run.malformed_records = run.index->malformed_count;
+                return;
+            }
+            run.index.reset();
+        }
+        run.trailing_bytes = mapped_logs[k].size - scan_messages(mapped_logs[k], run.messages, &run.malformed_records);
+        for (auto msg : run.messages)
+        {
+            run.begin_timestamp = std::min<uint64_t>(run.begin_timestamp, msg->timestamp);
+        }
+    });
+
+    for (size_t k = 0; k < runs.size(); ++k)
+    {
+        if (runs[k].malformed_records != 0) {
+            fprintf(stderr, "Skipped %zu malformed records in '%s'\n",
+                runs[k].malformed_records, log_bins[k].c_str());
+        }
+        if (runs[k].trailing_bytes != 0) {
+            fprintf(stderr, "Ignoring %zu bytes after the last complete record of '%s'\n",
+                runs[k].trailing_bytes, log_bins[k].c_str());
+        }
+    }
+}
+
+// a message's sort key, the message is found again from its offset in the
+// run's file so sorting never touches the messages themselves
+struct sort_key
+{
+    uint64_t timestamp;
+    uint64_t offset;
+};
+
+// stable LSD radix sort on the timestamp, a byte at a time over only the
+// bytes in which the timestamps differ
+static void radix_sort(std::vector<sort_key>& keys)
+{
+    const size_t count = keys.size();
+    uint64_t low = UINT64_MAX;
+    uint64_t high = 0;
+    bool sorted = true;
+    for (size_t k = 0; k < count; ++k)
+    {
+        low = std::min(low, keys[k].timestamp);
+        high = std::max(high, keys[k].timestamp);
+        sorted = sorted && (k == 0 || keys[k - 1].timestamp <= keys[k].timestamp);
+    }
+    if (sorted) {
+        return;
+    }
+
+    size_t digits = 0;
+    for (uint64_t range = high - low; range != 0; range >>= 8)
+    {
+        ++digits;
+    }
+
+    std::vector<size_t> counts(digits * 256, 0);
+    for (const auto& key : keys)
+    {
+        const uint64_t value = key.timestamp - low;
+        for (size_t digit = 0; digit < digits; ++digit)
+        {
+            counts[digit * 256 + ((value >> (digit * 8)) & 0xFF)]++;
+        }
+    }
+
+    std::vector<sort_key> scratch(count);
+    for (size_t digit = 0; digit < digits; ++digit)
+    {
+        size_t* bucket = &counts[digit * 256];
+        const size_t shift = digit * 8;
+        // every key has the same byte here, this pass wouldn't move anything
+        if (bucket[((keys[0].timestamp - low) >> shift) & 0xFF] == count) {
+            continue;
+        }
+        size_t position = 0;
+        for (size_t k = 0; k < 256; ++k)
+        {
+            const size_t bucket_count = bucket[k];
+            bucket[k] = position;
+            position += bucket_count;
+        }
+        for (const auto& key : keys)
+        {
+            scratch[bucket[((key.timestamp - low) >> shift) & 0xFF]++] = key;
+        }
+        keys.swap(scratch);
+    }
+}
+
+// sorts one file's messages by timestamp, messages with the same timestamp
+// keep their order in the file, so a thread's messages stay in the order it
+// logged them
+static void sort_messages(const mapped_file& mapped, std::vector<const message*>& messages)
+{
+    std::vector<sort_key> keys(messages.size());
+    for (size_t k = 0; k < messages.size(); ++k)
+    {
+        keys[k] = {messages[k]->timestamp, uint64_t(reinterpret_cast<const uint8_t*>(messages[k]) - mapped.data)};
+    }
+    radix_sort(keys);
+    for (size_t k = 0; k < keys.size(); ++k)
+    {
+        messages[k] = reinterpret_cast<const message*>(mapped.data + keys[k].offset);
+    }
+}
+
+// sorts each run concurrently, indexed logs select their candidate records
+// first which needs config.begin_timestamp
+void sort_runs(const print_config& config, const std::vector<mapped_file>& mapped_logs, std::vector<sorted_run>& runs)
+{
+    parallel_for(runs.size(), [&](size_t k) {
+        auto& run = runs[k];
+        if (run.index) {
+            select_indexed(*run.index, mapped_logs[k], *config.filter, config.begin_timestamp, run.messages);
+            run.index.reset();
+        }
+        // archives are written in timestamp order
+        if (!mapped_logs[k].archive) {
+            sort_messages(mapped_logs[k], run.messages);
+        }
+    });
+}
+
+// k-way merge of the sorted runs with ties going to the earlier file, which
+// is the order one stable sort of every file's messages would give
+void merge_runs(std::vector<sorted_run>& runs, std::vector<const message*>& messages)
+{
+    size_t total = 0;
+    for (const auto& run : runs)
+    {
+        total += run.messages.size();
+    }
+    messages.reserve(messages.size() + total);
+
+    std::vector<size_t> positions(runs.size(), 0);
+    auto run_after = [&](size_t a, size_t b)
+    {
+        const uint64_t timestamp_a = runs[a].messages[positions[a]]->timestamp;
+        const uint64_t timestamp_b = runs[b].messages[positions[b]]->timestamp;
+        if (timestamp_a != timestamp_b) {
+            return timestamp_a > timestamp_b;
+        }
+        return a > b;
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(run_after)> heads(run_after);
+    for (size_t k = 0; k < runs.size(); ++k)
+    {
+        if (!runs[k].messages.empty()) {
+            heads.push(k);
+        }
+    }
+
+    while (!heads.empty())
+    {
+        const size_t k = heads.top();
+        heads.pop();
+        auto& run = runs[k].messages;
+        // take every message of this run which still sorts before the next run's head
+        const uint64_t limit = heads.empty() ? UINT64_MAX : runs[heads.top()].messages[positions[heads.top()]]->timestamp;
+        const size_t limit_run = heads.empty() ? runs.size() : heads.top();
+        size_t& position = positions[k];
+        do {
+            messages.push_back(run[position++]);
+        } while (position < run.size() &&
+                 (run[position]->timestamp < limit || (run[position]->timestamp == limit && k < limit_run)));
+
+        if (position < run.size()) {
+            heads.push(k);
+        } else {
+            std::vector<const message*>().swap(run);
+        }
+    }
+}
+
+static bool is_log_name(const char* name)
+{
+    const size_t len = strlen(name);
+    return len > 4 && strcmp(name + len - 4, ".bin") == 0;
+}
+
+#ifdef __linux__
+static volatile sig_atomic_t follow_interrupted = 0;
+
+static void follow_signal_handler(int)
+{
+    follow_interrupted = 1;
+}
+
+// a log file being followed, bytes are read as the logger appends them and
+// a record is only taken once all of its bytes have arrived
+struct followed_file
+{
+    std::string path;
+    int fd;
+    // bytes read so far, used to notice the file being truncated by a new
+    // process which reused its name
+    uint64_t offset;
+    std::vector<uint8_t> partial;
+};
+
+// a copy of a complete record waiting for the latency window to pass
+struct followed_message
+{
+    uint64_t timestamp;
+    uint64_t sequence;
+    std::unique_ptr<uint8_t[]> data;
+};
+
+static bool followed_message_after(const followed_message& a, const followed_message& b)
+{
+    if (a.timestamp != b.timestamp) {
+        return a.timestamp > b.timestamp;
+    }
+    return a.sequence > b.sequence;
+}
+
+// reads whatever has been appended to the file and queues its complete records
+static void read_followed(followed_file& file, std::vector<followed_message>& queue, uint64_t& sequence)
+{
+    if (file.fd < 0) {
+        return;
+    }
+
+    struct stat st;
+    if (fstat(file.fd, &st) == 0 && (uint64_t)st.st_size < file.offset) {
+        lseek(file.fd, 0, SEEK_SET);
+        file.offset = 0;
+        file.partial.clear();
+    }
+
+    uint8_t buffer[64 * 1024];
+    while (true)
+    {
+        const ssize_t bytes = read(file.fd, buffer, sizeof(buffer));
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            break;
+        }
+        file.offset += bytes;
+        file.partial.insert(file.partial.end(), buffer, buffer + bytes);
+    }
+
+    size_t consumed = 0;
+    while (file.partial.size() - consumed >= sizeof(message))
+    {
+        const uint8_t* head = file.partial.data() + consumed;
+        const uint32_t len = load_unaligned<uint32_t>(head);
+        if (len < sizeof(message)) {
+            // there's no way to find the next record boundary
+            fprintf(stderr, "Corrupt record in '%s', no longer following it\n", file.path.c_str());
+            close(file.fd);
+            file.fd = -1;
+            file.partial.clear();
+            return;
+        }
+        if (len > file.partial.size() - consumed) {
+            break;
+        }
+        if (!tbb::reader::validate_record(reinterpret_cast<const message*>(head))) {
+            fprintf(stderr, "Skipping a malformed record in '%s'\n", file.path.c_str());
+            consumed += len;
+            continue;
+        }
+
+        followed_message queued;
+        queued.timestamp = reinterpret_cast<const message*>(head)->timestamp;
+        queued.sequence = sequence++;
+        queued.data.reset(new uint8_t[len]);
+        ::memcpy(queued.data.get(), head, len);
+        queue.push_back(std::move(queued));
+        std::push_heap(queue.begin(), queue.end(), followed_message_after);
+        consumed += len;
+    }
+    file.partial.erase(file.partial.begin(), file.partial.begin() + consumed);
+}
+
+// watches the directories with inotify, picking up new log files and appended
+// records, and prints messages once they are older than the latency window so
+// records from all files come out merged in timestamp order
+bool follow_logs(print_config& config, const std::vector<std::string>& directories, uint32_t latency_window_ms, size_t jobs)
+{
+    const int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        printf("Error initializing inotify\n");
+        return false;
+    }
+
+    std::map<int, std::string> watches;
+    for (const auto& directory : directories)
+    {
+        const int wd = inotify_add_watch(inotify_fd, directory.c_str(), IN_CREATE | IN_MODIFY | IN_MOVED_TO | IN_CLOSE_WRITE);
+        if (wd < 0) {
+            printf("Error watching log directory: '%s'\n", directory.c_str());
+            close(inotify_fd);
+            return false;
+        }
+        watches[wd] = directory;
+    }
+
+    std::map<std::string, followed_file> files;
+    std::vector<followed_message> queue;
+    uint64_t sequence = 0;
+
+    auto track = [&](const std::string& path) -> followed_file* {
+        auto it = files.find(path);
+        if (it == files.end()) {
+            followed_file file = {path, open(path.c_str(), O_RDONLY | O_CLOEXEC), 0, {}};
+            if (file.fd < 0) {
+                return nullptr;
+            }
+            it = files.emplace(path, std::move(file)).first;
+        }
+        return &it->second;
+    };
+
+    // logs which already exist are read from the start
+    for (const auto& directory : directories)
+    {
+        if (DIR* dir = opendir(directory.c_str())) {
+            while (dirent* entry = readdir(dir)) {
+                if (is_log_name(entry->d_name)) {
+                    track(directory + "/" + entry->d_name);
+                }
+            }
+            closedir(dir);
+        }
+    }
+
+    follow_interrupted = 0;
+    signal(SIGINT, follow_signal_handler);
+    signal(SIGTERM, follow_signal_handler);
+
+    const uint64_t latency_window = uint64_t(latency_window_ms) * 1000000;
+    const int poll_timeout = (int)std::min<uint32_t>(100, std::max<uint32_t>(10, latency_window_ms / 4));
+
+    format_pipeline pipeline(config, jobs);
+    // printed records are freed once the pipeline is done with them
+    std::vector<followed_message> printed;
+    bool started = false;
+    uint64_t last_timestamp = 0;
+    size_t out_of_order = 0;
+
+    while (true)
+    {
+        const bool draining = follow_interrupted != 0;
+
+        // new files are picked up from events, every file is polled for appends
+        // so an overflowed event queue doesn't lose anything
+        alignas(inotify_event) char events[16 * 1024];
+        ssize_t bytes;
+        while ((bytes = read(inotify_fd, events, sizeof(events))) > 0)
+        {
+            for (char* ptr = events; ptr < events + bytes;) {
+                const inotify_event* event = reinterpret_cast<const inotify_event*>(ptr);
+                if (event->len > 0 && is_log_name(event->name) && watches.count(event->wd)) {
+                    track(watches[event->wd] + "/" + event->name);
+                }
+                ptr += sizeof(inotify_event) + event->len;
+            }
+        }
+        for (auto& file : files)
+        {
+            read_followed(file.second, queue, sequence);
+        }
+
+        // everything older than the window has had time to arrive from every file
+        const uint64_t now = tbb::internal::get_timestamp();
+        const uint64_t watermark = now > latency_window ? now - latency_window : 0;
+        while (!queue.empty() && (draining || queue.front().timestamp <= watermark))
+        {
+            std::pop_heap(queue.begin(), queue.end(), followed_message_after);
+            followed_message next = std::move(queue.back());
+            queue.pop_back();
+
+            if (!started) {
+                config.begin_timestamp = next.timestamp;
+                last_timestamp = next.timestamp;
+                started = true;
+            }
+            if (next.timestamp < last_timestamp) {
+                ++out_of_order;
+            } else {
+                last_timestamp = next.timestamp;
+            }
+            pipeline.push(reinterpret_cast<const message*>(next.data.get()));
+            printed.push_back(std::move(next));
+        }
+        pipeline.flush();
+        printed.clear();
+        config.writer->flush();
+
+        if (draining) {
+            break;
+        }
+
+        pollfd pfd = {inotify_fd, POLLIN, 0};
+        poll(&pfd, 1, poll_timeout);
+    }
+
+    pipeline.finish();
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    for (auto& file : files)
+    {
+        if (file.second.fd >= 0) {
+            close(file.second.fd);
+        }
+    }
+    close(inotify_fd);
+
+    if (out_of_order != 0) {
+        fprintf(stderr, "%zu messages arrived after the latency window, "
+                        "try a larger --latency-window\n", out_of_order);
+    }
+    return true;
+}
+#else
+bool follow_logs(print_config&, const std::vector<std::string>&, uint32_t, size_t)
+{
+    printf("--follow is only supported on Linux\n");
+    return false;
+}
+#endif
+
+// writes a code point as UTF-8, invalid code points become U+FFFD
+inline char* encode_utf8(char* dest, uint32_t cp)
+{
+    if (cp < 0x80) {
+        *dest++ = (char)cp;
+    } else if (cp < 0x800) {
+        *dest++ = (char)(0xC0 | (cp >> 6));
+        *dest++ = (char)(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000 || cp > 0x10FFFF) {
+        if ((cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF) {
+            cp = 0xFFFD;
+        }
+        *dest++ = (char)(0xE0 | (cp >> 12));
+        *dest++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+        *dest++ = (char)(0x80 | (cp & 0x3F));
+    } else {
+        *dest++ = (char)(0xF0 | (cp >> 18));
+        *dest++ = (char)(0x80 | ((cp >> 12) & 0x3F));
+        *dest++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+        *dest++ = (char)(0x80 | (cp & 0x3F));
+    }
+    return dest;
+}
+
+// transcodes the code point starting at unit k, unpaired surrogates become
+// U+FFFD, returns the number of units consumed
+inline size_t encode_utf16_unit(char*& dest, const uint8_t* src, size_t k, size_t length)
+{
+    uint32_t cp = load_unaligned<char16_t>(src + k * sizeof(char16_t));
+    if (cp >= 0xD800 && cp <= 0xDBFF && k + 1 < length) {
+        const uint32_t low = load_unaligned<char16_t>(src + (k + 1) * sizeof(char16_t));
+        if (low >= 0xDC00 && low <= 0xDFFF) {
+            dest = encode_utf8(dest, 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00));
+            return 2;
+        }
+    }
+    dest = encode_utf8(dest, cp);
+    return 1;
+}
+
+// the kernels below return the end of the output, writing at most
+// UTF16_MAX_BYTES or UTF32_MAX_BYTES per input unit; the vector versions copy runs of ASCII a register at a time
+// and hand everything else to the scalar encoder one code point at a time
+typedef char* (*transcode_func)(char* dest, const uint8_t* src, size_t length);
+
+// a UTF-16 unit is at most 3 bytes (a surrogate pair is 2 units for 4 bytes),
+// a UTF-32 unit outside the BMP is 4
+const size_t UTF16_MAX_BYTES = 3;
+const size_t UTF32_MAX_BYTES = 4;
+
+char* utf16_to_utf8_scalar(char* dest, const uint8_t* src, size_t length)
+{
+    for(size_t k = 0; k < length;) {
+        k += encode_utf16_unit(dest, src, k, length);
+    }
+    return dest;
+}
+
+char* utf32_to_utf8_scalar(char* dest, const uint8_t* src, size_t length)
+{
+    for(size_t k = 0; k < length; ++k) {
+        dest = encode_utf8(dest, load_unaligned<char32_t>(src + k * sizeof(char32_t)));
+    }
+    return dest;
+}
+
+#ifdef AGGREGATE_X86
+char* utf16_to_utf8_sse2(char* dest, const uint8_t* src, size_t length)
+{
+    const __m128i non_ascii = _mm_set1_epi16((short)0xFF80);
+    size_t k = 0;
+    while (k < length) {
+        if (k + 8 <= length) {
+            const __m128i units = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + k * sizeof(char16_t)));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, non_ascii), _mm_setzero_si128())) == 0xFFFF) {
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(dest), _mm_packus_epi16(units, units));
+                dest += 8;
+                k += 8;
+                continue;
+            }
+        }
+        k += encode_utf16_unit(dest, src, k, length);
+    }
+    return dest;
+}
+
+char* utf32_to_utf8_sse2(char* dest, const uint8_t* src, size_t length)
+{
+    const __m128i non_ascii = _mm_set1_epi32((int)0xFFFFFF80);
+    size_t k = 0;
+    while (k < length) {
+        if (k + 4 <= length) {
+            const __m128i units = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + k * sizeof(char32_t)));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(units, non_ascii), _mm_setzero_si128())) == 0xFFFF) {
+                const __m128i words = _mm_packs_epi32(units, units);
+                const int bytes = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+                ::memcpy(dest, &bytes, sizeof(bytes));
+                dest += 4;
+                k += 4;
+                continue;
+            }
+        }
+        dest = encode_utf8(dest, load_unaligned<char32_t>(src + k * sizeof(char32_t)));
+        ++k;
+    }
+    return dest;
+}
+
+AGGREGATE_TARGET_AVX2
+char* utf16_to_utf8_avx2(char* dest, const uint8_t* src, size_t length)
+{
+    const __m256i non_ascii = _mm256_set1_epi16((short)0xFF80);
+    size_t k = 0;
+    while (k < length) {
+        if (k + 16 <= length) {
+            const __m256i units = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + k * sizeof(char16_t)));
+            if (_mm256_testz_si256(units, non_ascii)) {
+                // packus works per 128-bit lane, so gather both lanes' results into the low half
+                const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(units, units), 0xD8);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dest), _mm256_castsi256_si128(packed));
+                dest += 16;
+                k += 16;
+                continue;
+            }
+        }
+        k += encode_utf16_unit(dest, src, k, length);
+    }
+    return dest;
+}
+
+AGGREGATE_TARGET_AVX2
+char* utf32_to_utf8_avx2(char* dest, const uint8_t* src, size_t length)
+{
+    const __m256i non_ascii = _mm256_set1_epi32((int)0xFFFFFF80);
+    // after packing within lanes, the low dword of each lane holds 4 bytes
+    const __m256i gather = _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0);
+    size_t k = 0;
+    while (k < length) {
+        if (k + 8 <= length) {
+            const __m256i units = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + k * sizeof(char32_t)));
+            if (_mm256_testz_si256(units, non_ascii)) {
+                const __m256i words = _mm256_packs_epi32(units, units);
+                const __m256i bytes = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(words, words), gather);
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(dest), _mm256_castsi256_si128(bytes));
+                dest += 8;
+                k += 8;
+                continue;
+            }
+        }
+        dest = encode_utf8(dest, load_unaligned<char32_t>(src + k * sizeof(char32_t)));
+        ++k;
+    }
+    return dest;
+}
+#endif
+
+// picks the widest kernel the running CPU supports
+struct transcoders
+{
+    transcode_func utf16;
+    transcode_func utf32;
+
+    transcoders()
+    : utf16(utf16_to_utf8_scalar)
+    , utf32(utf32_to_utf8_scalar)
+    {
+#ifdef AGGREGATE_X86
+        utf16 = utf16_to_utf8_sse2;
+        utf32 = utf32_to_utf8_sse2;
+#if defined(__GNUC__)
+        if (__builtin_cpu_supports("avx2")) {
+            utf16 = utf16_to_utf8_avx2;
+            utf32 = utf32_to_utf8_avx2;
+        }
+#endif
+#endif
+    }
+};
+
+const transcoders& get_transcoders()
+{
+    static const transcoders instance;
+    return instance;
+}
+
+// appends through the output's spare capacity, sized for the kernel's worst
+// case of max_bytes per unit
+inline void append_transcoded(std::string& out, transcode_func func, size_t max_bytes, const fmt_string& str)
+{
+    const size_t begin = out.size();
+    out.resize(begin + str.length * max_bytes);
+    char* end = func(&out[begin], str.data, str.length);
+    out.resize(end - out.data());
+}
+
+void append_utf16(std::string& out, const fmt_string& str)
+{
+    append_transcoded(out, get_transcoders().utf16, UTF16_MAX_BYTES, str);
+}
+
+void append_utf32(std::string& out, const fmt_string& str)
+{
+    append_transcoded(out, get_transcoders().utf32, UTF32_MAX_BYTES, str);
+}
+
+constexpr size_t element_size(data_type type)
+{
+    switch(type)
+    {
+        case data_type::i8:
+        case data_type::u8:
+            return sizeof(uint8_t);
+        case data_type::i16:
+        case data_type::u16:
+            return sizeof(uint16_t);
+        case data_type::i32:
+        case data_type::u32:
+        case data_type::f32:
+            return sizeof(uint32_t);
+        case data_type::i64:
+        case data_type::u64:
+        case data_type::f64:
+            return sizeof(uint64_t);
+        default:
+            return 0;
+    }
+}
+
+// formats each element with the placeholder's format spec, joined with ", "
+template <typename T, typename OutputIt>
+OutputIt format_elements(OutputIt out, const std::string& format_string, const fmt_array& arr)
+{
+    out = fmt::format_to(out, "[");
+    for(uint32_t k = 0; k < arr.count; ++k) {
+        if (k > 0) {
+            out = fmt::format_to(out, ", ");
+        }
+        out = fmt::format_to(out, format_string, load_unaligned<T>(arr.data + k * sizeof(T)));
+    }
+    if (arr.count < arr.total) {
+        out = fmt::format_to(out, "{}... ({} total)", arr.count > 0 ? ", " : "", arr.total);
+    }
+    return fmt::format_to(out, "]");
+}
+
+// space separated hex bytes
+template <typename OutputIt>
+OutputIt format_hexdump(OutputIt out, const fmt_array& blob)
+{
+    for(uint32_t k = 0; k < blob.count; ++k) {
+        out = fmt::format_to(out, k > 0 ? " {:02x}" : "{:02x}", blob.data[k]);
+    }
+    if (blob.count < blob.total) {
+        out = fmt::format_to(out, "{}... ({} bytes)", blob.count > 0 ? " " : "", blob.total);
+    }
+    return out;
+}
+
+// formats a single param with a "{:spec}" format string
+template <typename OutputIt>
+OutputIt format_param(OutputIt ctx_begin, const std::string& format_string, const fmt_param& param)
+{
+    using fmt::format_to;
+    switch(param.type) {
+        // string types
+        case data_type::utf8:
+            return format_to(ctx_begin, format_string, param.value.utf8_);
+            break;
+        case data_type::utf16:
+        case data_type::utf32:
+        {
+            // transcoded into reusable per thread storage
+            thread_local std::string utf8;
+            utf8.clear();
+            if (param.type == data_type::utf16) {
+                append_utf16(utf8, param.value.utf16_);
+            } else {
+                append_utf32(utf8, param.value.utf32_);
+            }
+            return format_to(ctx_begin, format_string, fmt::string_view(utf8.data(), utf8.size()));
+        }
+        // pointer types
+        case data_type::p32:
+            return format_to(ctx_begin, "0x{:08x}", param.value.p32_);
+        case data_type::p64:
+            return format_to(ctx_begin, "0x{:016x}", param.value.p64_);
+        // integer types
+        case data_type::i8:
+            return format_to(ctx_begin, format_string, param.value.i8_);
+        case data_type::u8:
+            return format_to(ctx_begin, format_string, param.value.u8_);
+        case data_type::i16:
+            return format_to(ctx_begin, format_string, param.value.i16_);
+        case data_type::u16:
+            return format_to(ctx_begin, format_string, param.value.u16_);
+        case data_type::i32:
+            return format_to(ctx_begin, format_string, param.value.i32_);
+        case data_type::u32:
+            return format_to(ctx_begin, format_string, param.value.u32_);
+        case data_type::i64:
+            return format_to(ctx_begin, format_string, param.value.i64_);
+        case data_type::u64:
+            return format_to(ctx_begin, format_string, param.value.u64_);
+        // float types
+        case data_type::f32:
+            return format_to(ctx_begin, format_string, param.value.f32_);
+        case data_type::f64:
+            return format_to(ctx_begin, format_string, param.value.f64_);
+        // array types
+        case data_type::array:
+            switch(param.value.array_.element_type) {
+                case data_type::i8:  return format_elements<int8_t>(ctx_begin, format_string, param.value.array_);
+                case data_type::u8:  return format_elements<uint8_t>(ctx_begin, format_string, param.value.array_);
+                case data_type::i16: return format_elements<int16_t>(ctx_begin, format_string, param.value.array_);
+                case data_type::u16: return format_elements<uint16_t>(ctx_begin, format_string, param.value.array_);
+                case data_type::i32: return format_elements<int32_t>(ctx_begin, format_string, param.value.array_);
+                case data_type::u32: return format_elements<uint32_t>(ctx_begin, format_string, param.value.array_);
+                case data_type::i64: return format_elements<int64_t>(ctx_begin, format_string, param.value.array_);
+                case data_type::u64: return format_elements<uint64_t>(ctx_begin, format_string, param.value.array_);
+                case data_type::f32: return format_elements<float>(ctx_begin, format_string, param.value.array_);
+                case data_type::f64: return format_elements<double>(ctx_begin, format_string, param.value.array_);
+                default:
+                    assert(!"Invalid array element type");
+                    return format_to(ctx_begin, "{}", "Invalid array element type");
+            }
+        case data_type::blob:
+            return format_hexdump(ctx_begin, param.value.array_);
+        default:
+            assert(!"Invalid data_type");
+            return format_to(ctx_begin, "{}", "Invalid data_type");
+    }
+}
+
+namespace fmt {
+    template<>
+    struct formatter<fmt_param> {
+        template <typename ParseContext>
+        constexpr auto parse(ParseContext &ctx)
+        {
+            // extract the format string
+            auto it = ctx.begin();
+            while (*it != '}') {
+                ++it;
+            }
+            std::stringstream ss;
+            ss << "{:" << std::string(ctx.begin(), it) << '}';
+            format_string = ss.str();
+            return it;
+        }
+
+        template <typename FormatContext>
+        auto format(const fmt_param &param, FormatContext &ctx)
+        {
+            return format_param(ctx.out(), format_string, param);
+        }
+
+        std::string format_string;
+    };
+
+    // needed implementation of make_arg for fmt_param
+    namespace v5 {
+        namespace internal {
+            template<>
+            fmt::basic_format_arg<fmt::format_context> make_arg<fmt::format_context, fmt_param>(const fmt_param& param) {
+                fmt::basic_format_arg<fmt::format_context> retval;
+                retval.value_ = value<fmt::format_context>(param);
+                retval.type_ = custom_type;
+                return retval;
+            }
+        }
+    }
+}
+
+// a replacement field's spec, [[fill]align][sign][#][0][width][.precision][type],
+// parsed once with the format string
+struct field_spec
+{
+    char fill;
+    // '<', '>', '^', or 0 for the argument type's default
+    char align;
+    // '+', '-' or ' ' as given, 0 when not given
+    char sign;
+    bool alternate;
+    bool zero_pad;
+    size_t width;
+    // -1 when not given
+    int precision;
+    // 0 when not given
+    char type;
+    // whether the spec only uses what format_field handles, anything else
+    // (locales, unicode fills, types like 'c' or 'g') is left to fmt
+    bool native;
+};
+
+field_spec parse_spec(const char* it, const char* end)
+{
+    field_spec field = {' ', 0, 0, false, false, 0, -1, 0, false};
+    auto is_align = [](char c) { return c == '<' || c == '>' || c == '^'; };
+    if (end - it >= 2 && is_align(it[1])) {
+        if ((unsigned char)it[0] >= 0x80) {
+            return field;
+        }
+        field.fill = it[0];
+        field.align = it[1];
+        it += 2;
+    } else if (it != end && is_align(*it)) {
+        field.align = *it++;
+    }
+    if (it != end && (*it == '+' || *it == '-' || *it == ' ')) {
+        field.sign = *it++;
+    }
+    if (it != end && *it == '#') {
+        field.alternate = true;
+        ++it;
+    }
+    if (it != end && *it == '0') {
+        field.zero_pad = true;
+        ++it;
+    }
+    for(; it != end && *it >= '0' && *it <= '9'; ++it) {
+        field.width = field.width * 10 + (*it - '0');
+        if (field.width > 0xFFFF) {
+            return field;
+        }
+    }
+    if (it != end && *it == '.') {
+        if (++it == end || *it < '0' || *it > '9') {
+            return field;
+        }
+        field.precision = 0;
+        for(; it != end && *it >= '0' && *it <= '9'; ++it) {
+            field.precision = field.precision * 10 + (*it - '0');
+            if (field.precision > 0xFFFF) {
+                return field;
+            }
+        }
+    }
+    if (it != end && strchr("dxXbBfFeEs", *it) != nullptr) {
+        field.type = *it++;
+    }
+    // fmt versions disagree on zero padding with an explicit alignment
+    field.native = it == end && !(field.zero_pad && field.align);
+    return field;
+}
+
+// appends prefix and body padded out to the field's width, zero padding goes
+// between the two
+inline void append_padded(std::string& out, const field_spec& field, char default_align,
+                          const char* prefix, size_t prefix_size, const char* body, size_t body_size)
+{
+    const size_t size = prefix_size + body_size;
+    const size_t padding = field.width > size ? field.width - size : 0;
+    if (field.zero_pad) {
+        out.append(prefix, prefix_size);
+        out.append(padding, '0');
+        out.append(body, body_size);
+        return;
+    }
+    const char align = field.align ? field.align : default_align;
+    const size_t left = align == '<' ? 0 : align == '^' ? padding / 2 : padding;
+    out.append(left, field.fill);
+    out.append(prefix, prefix_size);
+    out.append(body, body_size);
+    out.append(padding - left, field.fill);
+}
+
+// false for specs fmt would reject, such as a precision, so fmt reports them
+template <typename T>
+bool append_integer(std::string& out, const field_spec& field, T value)
+{
+    // fmt versions disagree on signs for unsigned arguments
+    if (field.precision >= 0 || (field.sign && !std::is_signed<T>::value)) {
+        return false;
+    }
+    const bool negative = value < 0;
+    uint64_t magnitude = negative ? 0 - uint64_t(int64_t(value)) : uint64_t(value);
+
+    char prefix[3];
+    size_t prefix_size = 0;
+    if (negative || field.sign == '+' || field.sign == ' ') {
+        prefix[prefix_size++] = negative ? '-' : field.sign;
+    }
+    unsigned shift = 0;
+    const char* digits = "0123456789abcdef";
+    switch(field.type) {
+        case 0:
+        case 'd':
+            break;
+        case 'x': shift = 4; break;
+        case 'X': shift = 4; digits = "0123456789ABCDEF"; break;
+        case 'b':
+        case 'B': shift = 1; break;
+        default:
+            return false;
+    }
+    if (field.alternate && shift != 0) {
+        prefix[prefix_size++] = '0';
+        prefix[prefix_size++] = field.type;
+    }
+
+    char buffer[64];
+    char* const end = buffer + sizeof(buffer);
+    char* begin = end;
+    if (shift == 0) {
+        do {
+            *--begin = (char)('0' + magnitude % 10);
+            magnitude /= 10;
+        } while (magnitude != 0);
+    } else {
+        const uint64_t mask = (uint64_t(1) << shift) - 1;
+        do {
+            *--begin = digits[magnitude & mask];
+            magnitude >>= shift;
+        } while (magnitude != 0);
+    }
+    append_padded(out, field, '>', prefix, prefix_size, begin, size_t(end - begin));
+    return true;
+}
+
+// fixed and exponent notation with a precision print the same digits as
+// printf, everything else (shortest round trip, 'g', inf and nan) is fmt's
+inline bool append_float(std::string& out, const field_spec& field, double value)
+{
+    if (!std::isfinite(value) || field.alternate ||
+        (field.type != 'f' && field.type != 'F' && field.type != 'e' && field.type != 'E')) {
+        return false;
+    }
+    const char format[] = {'%', '.', '*', field.type, '\0'};
+    const int precision = field.precision < 0 ? 6 : field.precision;
+    thread_local std::string digits;
+    digits.resize(64);
+    int size = snprintf(&digits[0], digits.size(), format, precision, value);
+    if (size >= (int)digits.size()) {
+        digits.resize(size + 1);
+        size = snprintf(&digits[0], digits.size(), format, precision, value);
+    }
+    const char* body = digits.data();
+    char sign = field.sign == '-' ? 0 : field.sign;
+    if (*body == '-') {
+        sign = *body++;
+        --size;
+    }
+    append_padded(out, field, '>', &sign, sign ? 1 : 0, body, (size_t)size);
+    return true;
+}
+
+// widths and precisions count code points, which for ASCII are bytes
+inline bool append_string(std::string& out, const field_spec& field, const char* data, size_t size)
+{
+    if ((field.type != 0 && field.type != 's') || field.sign || field.alternate || field.zero_pad) {
+        return false;
+    }
+    if (field.width != 0 || field.precision >= 0) {
+        for(size_t k = 0; k < size; ++k) {
+            if ((unsigned char)data[k] >= 0x80) {
+                return false;
+            }
+        }
+        if (field.precision >= 0) {
+            size = std::min(size, (size_t)field.precision);
+        }
+    }
+    append_padded(out, field, '<', nullptr, 0, data, size);
+    return true;
+}
+
+template <typename T>
+bool append_number(std::string& out, const field_spec& field, T value)
+{
+    return append_integer(out, field, value);
+}
+
+inline bool append_number(std::string& out, const field_spec& field, float value)
+{
+    return append_float(out, field, value);
+}
+
+inline bool append_number(std::string& out, const field_spec& field, double value)
+{
+    return append_float(out, field, value);
+}
+
+// the same output as format_elements
+template <typename T>
+bool append_elements(std::string& out, const field_spec& field, const fmt_array& arr)
+{
+    const size_t begin = out.size();
+    out += '[';
+    for(uint32_t k = 0; k < arr.count; ++k) {
+        if (k > 0) {
+            out += ", ";
+        }
+        if (!append_number(out, field, load_unaligned<T>(arr.data + k * sizeof(T)))) {
+            out.resize(begin);
+            return false;
+        }
+    }
+    if (arr.count < arr.total) {
+        out += arr.count > 0 ? ", ... (" : "... (";
+        out += fmt::format_int(arr.total).c_str();
+        out += " total)";
+    }
+    out += ']';
+    return true;
+}
+
+// formats a param with a spec parsed by parse_spec, false (having written
+// nothing) when it's left to format_param instead
+bool format_field(std::string& out, const field_spec& field, const fmt_param& param)
+{
+    switch(param.type) {
+        case data_type::utf8:
+            return append_string(out, field, param.value.utf8_, strlen(param.value.utf8_));
+        case data_type::utf16:
+        case data_type::utf32:
+        {
+            thread_local std::string utf8;
+            utf8.clear();
+            if (param.type == data_type::utf16) {
+                append_utf16(utf8, param.value.utf16_);
+            } else {
+                append_utf32(utf8, param.value.utf32_);
+            }
+            return append_string(out, field, utf8.data(), utf8.size());
+        }
+        case data_type::i8:  return append_integer(out, field, param.value.i8_);
+        case data_type::u8:  return append_integer(out, field, param.value.u8_);
+        case data_type::i16: return append_integer(out, field, param.value.i16_);
+        case data_type::u16: return append_integer(out, field, param.value.u16_);
+        case data_type::i32: return append_integer(out, field, param.value.i32_);
+        case data_type::u32: return append_integer(out, field, param.value.u32_);
+        case data_type::i64: return append_integer(out, field, param.value.i64_);
+        case data_type::u64: return append_integer(out, field, param.value.u64_);
+        case data_type::f32: return append_float(out, field, param.value.f32_);
+        case data_type::f64: return append_float(out, field, param.value.f64_);
+        case data_type::array:
+            switch(param.value.array_.element_type) {
+                case data_type::i8:  return append_elements<int8_t>(out, field, param.value.array_);
+                case data_type::u8:  return append_elements<uint8_t>(out, field, param.value.array_);
+                case data_type::i16: return append_elements<int16_t>(out, field, param.value.array_);
+                case data_type::u16: return append_elements<uint16_t>(out, field, param.value.array_);
+                case data_type::i32: return append_elements<int32_t>(out, field, param.value.array_);
+                case data_type::u32: return append_elements<uint32_t>(out, field, param.value.array_);
+                case data_type::i64: return append_elements<int64_t>(out, field, param.value.array_);
+                case data_type::u64: return append_elements<uint64_t>(out, field, param.value.array_);
+                case data_type::f32: return append_elements<float>(out, field, param.value.array_);
+                case data_type::f64: return append_elements<double>(out, field, param.value.array_);
+                default:
+                    return false;
+            }
+        default:
+            // pointers and blobs ignore the spec
+            return false;
+    }
+}
+
+// a format string split into literal text and replacement fields, parsed once
+// per distinct format string rather than once per message
+struct format_segment
+{
+    // text preceding the field, with {{ and }} already unescaped
+    std::string literal;
+    // index of the field's argument, or npos for the trailing literal
+    size_t arg_index;
+    // "{:spec}" as passed to format_param when format_field can't handle it
+    std::string spec;
+    field_spec field;
+    // the field had no spec, so the argument can take the fast path
+    bool plain;
+};
+
+struct parsed_format
+{
+    std::string format_string;
+    // format strings using features not handled here (named or dynamic
+    // arguments) or which are malformed are left to fmt::vformat
+    bool valid;
+    std::vector<format_segment> segments;
+};
+
+parsed_format parse_format(const char* format_string)
+{
+    parsed_format parsed;
+    parsed.format_string = format_string;
+    parsed.valid = false;
+
+    const char* it = format_string;
+    size_t next_arg = 0;
+    bool manual_index = false;
+    bool auto_index = false;
+    const field_spec no_spec = parse_spec(nullptr, nullptr);
+    format_segment segment = {std::string(), std::string::npos, std::string(), no_spec, true};
+    while (*it)
+    {
+        const char c = *it++;
+        if (c == '}') {
+            if (*it++ != '}') {
+                return parsed;
+            }
+            segment.literal += '}';
+            continue;
+        }
+        if (c != '{') {
+            segment.literal += c;
+            continue;
+        }
+        if (*it == '{') {
+            ++it;
+            segment.literal += '{';
+            continue;
+        }
+
+        // replacement field: [arg_index][:spec]}
+        if (*it >= '0' && *it <= '9') {
+            size_t index = 0;
+            while (*it >= '0' && *it <= '9') {
+                index = index * 10 + (*it++ - '0');
+            }
+            segment.arg_index = index;
+            manual_index = true;
+        } else {
+            segment.arg_index = next_arg++;
+            auto_index = true;
+        }
+        const char* spec_begin = it;
+        if (*it == ':') {
+            spec_begin = ++it;
+            while (*it && *it != '}' && *it != '{') {
+                ++it;
+            }
+        }
+        if (*it != '}' || manual_index == auto_index) {
+            return parsed;
+        }
+        segment.plain = (it == spec_begin);
+        segment.spec = "{:" + std::string(spec_begin, it) + "}";
+        segment.field = parse_spec(spec_begin, it);
+        ++it;
+
+        parsed.segments.push_back(std::move(segment));
+        segment = {std::string(), std::string::npos, std::string(), no_spec, true};
+    }
+    parsed.segments.push_back(std::move(segment));
+    parsed.valid = true;
+    return parsed;
+}
+
+// a format string looked up where it lies in the record, cached keys point
+// into their own parsed_format
+struct format_key
+{
+    const char* data;
+    size_t size;
+
+    bool operator==(const format_key& other) const
+    {
+        return size == other.size && memcmp(data, other.data, size) == 0;
+    }
+};
+
+struct format_key_hash
+{
+    // FNV-1a
+    size_t operator()(const format_key& key) const
+    {
+        uint64_t hash = 14695981039346656037ull;
+        for(size_t k = 0; k < key.size; ++k) {
+            hash = (hash ^ (uint8_t)key.data[k]) * 1099511628211ull;
+        }
+        return (size_t)hash;
+    }
+};
+
+// each formatting thread keeps its own cache, so lookups need no locking
+const parsed_format& get_parsed_format(const char* format_string)
+{
+    thread_local std::unordered_map<format_key, std::unique_ptr<parsed_format>, format_key_hash> cache;
+    const format_key key = {format_string, strlen(format_string)};
+    auto entry = cache.find(key);
+    if (entry == cache.end()) {
+        std::unique_ptr<parsed_format> parsed(new parsed_format(parse_format(format_string)));
+        const format_key owned = {parsed->format_string.data(), parsed->format_string.size()};
+        entry = cache.emplace(owned, std::move(parsed)).first;
+    }
+    return *entry->second;
+}
+
+// formats the user's arguments with a pre-parsed format string, throws on
+// the same errors fmt::vformat would
+void format_user_msg(std::string& out, const parsed_format& parsed, const std::vector<const fmt_param*>& params)
+{
+    auto it = std::back_inserter(out);
+    for(const auto& segment : parsed.segments) {
+        out += segment.literal;
+        if (segment.arg_index == std::string::npos) {
+            break;
+        }
+        if (segment.arg_index >= params.size()) {
+            throw fmt::format_error("argument index out of range");
+        }
+
+        // common unadorned fields skip fmt's spec parsing entirely
+        const fmt_param& param = *params[segment.arg_index];
+        if (segment.plain) {
+            switch(param.type) {
+                case data_type::utf8:
+                    out += param.value.utf8_;
+                    continue;
+                case data_type::utf16:
+                    append_utf16(out, param.value.utf16_);
+                    continue;
+                case data_type::utf32:
+                    append_utf32(out, param.value.utf32_);
+                    continue;
+                case data_type::i8:  out += fmt::format_int(param.value.i8_).c_str(); continue;
+                case data_type::u8:  out += fmt::format_int(param.value.u8_).c_str(); continue;
+                case data_type::i16: out += fmt::format_int(param.value.i16_).c_str(); continue;
+                case data_type::u16: out += fmt::format_int(param.value.u16_).c_str(); continue;
+                case data_type::i32: out += fmt::format_int(param.value.i32_).c_str(); continue;
+                case data_type::u32: out += fmt::format_int(param.value.u32_).c_str(); continue;
+                case data_type::i64: out += fmt::format_int(param.value.i64_).c_str(); continue;
+                case data_type::u64: out += fmt::format_int(param.value.u64_).c_str(); continue;
+                default:
+                    break;
+            }
+        }
+        // specs were parsed with the format string, fmt only sees the rest
+        if (segment.field.native && format_field(out, segment.field, param)) {
+            continue;
+        }
+        it = format_param(it, segment.spec, param);
+    }
+}
+
+inline void append_uint(std::string& out, uint64_t value)
+{
+    fmt::format_int digits(value);
+    out.append(digits.data(), digits.size());
+}
+
+// nanoseconds as seconds with 6 decimal places, rounded to the nearest
+// microsecond in integer arithmetic rather than through a double and %f
+inline void append_timestamp(std::string& out, uint64_t nanoseconds)
+{
+    const uint64_t microseconds = (nanoseconds + 500) / 1000;
+    append_uint(out, microseconds / 1000000);
+    char fraction[7] = {'.'};
+    uint32_t remainder = (uint32_t)(microseconds % 1000000);
+    for(size_t k = 6; k > 0; --k) {
+        fraction[k] = (char)('0' + remainder % 10);
+        remainder /= 10;
+    }
+    out.append(fraction, sizeof(fraction));
+}
+
+// per thread storage reused by every print_msg call, so decoding and
+// formatting a message does no heap allocation once it has warmed up
+// decoded params and formatting buffers, reused for every message
+struct print_scratch : tbb::reader::decoded_record
+{
+    std::vector<const fmt_param*> user_params;
+    std::string entry;
+};
+
+// recognizes a filter option and adds it to the filter, has_filter is cleared
+// when the option's value doesn't parse
+bool parse_filter_option(const std::string& arg, message_filter& filter, bool& has_filter)
+{
+    auto value_of = [&arg](const char* option, std::string& value) {
+        const size_t len = strlen(option);
+        if (arg.compare(0, len, option) != 0) {
+            return false;
+        }
+        value = arg.substr(len);
+        return true;
+    };
+    auto parse_seconds = [](const std::string& value, uint64_t& nanoseconds) {
+        char* end = nullptr;
+        const double seconds = strtod(value.c_str(), &end);
+        if (value.empty() || *end != '\0' || seconds < 0.0) {
+            return false;
+        }
+        nanoseconds = (uint64_t)(seconds * 1000000000.0 + 0.5);
+        return true;
+    };
+    auto parse_id = [](const std::string& value, uint32_t& id) {
+        if (value == "parent") {
+            id = 0;
+            return true;
+        }
+        char* end = nullptr;
+        const long long parsed = strtoll(value.c_str(), &end, 0);
+        if (value.empty() || *end != '\0') {
+            return false;
+        }
+        // ids of processes which aren't firefox children are logged negated
+        id = (uint32_t)parsed;
+        return true;
+    };
+
+    std::string value;
+    bool valid = true;
+    if (value_of("--since=", value)) {
+        filter.has_since = true;
+        valid = parse_seconds(value, filter.since);
+    } else if (value_of("--until=", value)) {
+        filter.has_until = true;
+        valid = parse_seconds(value, filter.until);
+    } else if (value_of("--process=", value)) {
+        uint32_t id;
+        valid = parse_id(value, id);
+        filter.process_ids.push_back(id);
+    } else if (value_of("--thread=", value)) {
+        uint32_t id;
+        valid = parse_id(value, id);
+        filter.thread_ids.push_back(id);
+    } else if (value_of("--function=", value)) {
+        filter.functions.push_back({value, false, std::regex()});
+    } else if (value_of("--file=", value)) {
+        filter.files.push_back({value, false, std::regex()});
+    } else if (value_of("--format-string=", value)) {
+        filter.format_strings.push_back({value, false, std::regex()});
+    } else {
+        return false;
+    }
+    has_filter = valid;
+    return true;
+}
+
+bool compile_filters(message_filter& filter, bool use_regex)
+{
+    if (!use_regex) {
+        return true;
+    }
+    for (auto* patterns : {&filter.functions, &filter.files, &filter.format_strings})
+    {
+        for (auto& pattern : *patterns)
+        {
+            if (!compile_pattern(pattern)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool compile_pattern(string_filter& pattern)
+{
+    try {
+        pattern.regex = std::regex(pattern.pattern, std::regex::ECMAScript | std::regex::optimize);
+        pattern.is_regex = true;
+    } catch(const std::regex_error& e) {
+        printf("Error parsing regex '%s': %s\n", pattern.pattern.c_str(), e.what());
+        return false;
+    }
+    return true;
+}
+
+static bool matches_any(const std::vector<string_filter>& patterns, const char* str);
+
+bool filter_accepts_site(const message_filter& filter, const char* function, const char* file, const char* format_string)
+{
+    return matches_any(filter.functions, function) &&
+           matches_any(filter.files, file) &&
+           matches_any(filter.format_strings, format_string);
+}
+
+static bool matches_pattern(const string_filter& pattern, const char* str)
+{
+    return pattern.is_regex ? std::regex_search(str, pattern.regex)
+                            : strstr(str, pattern.pattern.c_str()) != nullptr;
+}
+
+static bool matches_any(const std::vector<string_filter>& patterns, const char* str)
+{
+    if (patterns.empty()) {
+        return true;
+    }
+    for (const auto& pattern : patterns)
+    {
+        if (matches_pattern(pattern, str)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool filter_accepts(const message_filter& filter, uint64_t begin_timestamp, const message* msg)
+{
+    // header fields first, they're free to check
+    const uint64_t timestamp = msg->timestamp - begin_timestamp;
+    if ((filter.has_since && timestamp < filter.since) ||
+        (filter.has_until && timestamp > filter.until)) {
+        return false;
+    }
+    if (!filter.process_ids.empty() &&
+        std::find(filter.process_ids.begin(), filter.process_ids.end(), msg->process_id) == filter.process_ids.end()) {
+        return false;
+    }
+    if (!filter.thread_ids.empty() &&
+        std::find(filter.thread_ids.begin(), filter.thread_ids.end(), msg->thread_id) == filter.thread_ids.end()) {
+        return false;
+    }
+    if (filter.functions.empty() && filter.files.empty() && filter.format_strings.empty()) {
+        return true;
+    }
+
+    const log_site site = locate_site(msg);
+
+    // sites repeat endlessly, so each distinct one is only matched once per thread
+    thread_local std::unordered_map<std::string, bool> site_results;
+    thread_local std::string key;
+    assign_site_key(key, site, false);
+    auto it = site_results.find(key);
+    if (it == site_results.end()) {
+        it = site_results.emplace(key, filter_accepts_site(filter, site.function, site.file, site.format_string)).first;
+    }
+    return it->second;
+}
+
+// log index
+
+template<typename T>
+static void put(std::string& out, T value)
+{
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void put_string(std::string& out, const std::string& str)
+{
+    put<uint32_t>(out, (uint32_t)str.size());
+    out += str;
+}
+
+static void put_varint(std::string& out, uint64_t value)
+{
+    while (value >= 0x80) {
+        out += (char)(value | 0x80);
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+// maps signed values to unsigned ones with small magnitudes staying small
+static uint64_t zigzag(int64_t value)
+{
+    return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+}
+
+// bounds checked reads of a serialized index
+struct index_reader
+{
+    const uint8_t* head;
+    const uint8_t* tail;
+    bool ok;
+
+    template<typename T>
+    T get()
+    {
+        T value = T();
+        if (ok && size_t(tail - head) >= sizeof(T)) {
+            ::memcpy(&value, head, sizeof(T));
+            head += sizeof(T);
+        } else {
+            ok = false;
+        }
+        return value;
+    }
+
+    std::string get_string()
+    {
+        const uint32_t len = get<uint32_t>();
+        if (!ok || size_t(tail - head) < len) {
+            ok = false;
+            return std::string();
+        }
+        std::string retval(reinterpret_cast<const char*>(head), len);
+        head += len;
+        return retval;
+    }
+
+    uint64_t get_varint()
+    {
+        uint64_t value = 0;
+        for (uint32_t shift = 0; shift < 64; shift += 7) {
+            const uint8_t byte = get<uint8_t>();
+            value |= uint64_t(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) {
+                break;
+            }
+        }
+        return value;
+    }
+};
+
+static const char INDEX_MAGIC[8] = {'T', 'B', 'B', 'I', 'D', 'X', '0', '2'};
+
+static std::string index_path(const std::string& log_path)
+{
+    return log_path + ".idx";
+}
+
+// indexes the records from index.indexed_bytes on
+static void index_records(log_index& index, const mapped_file& mapped)
+{
+    std::unordered_map<std::string, uint32_t> site_ids;
+    std::string key;
+    for (uint32_t k = 0; k < index.sites.size(); ++k)
+    {
+        const auto& site = index.sites[k];
+        assign_site_key(key, {site.function.c_str(), site.file.c_str(), site.line, site.format_string.c_str()});
+        site_ids[key] = k;
+    }
+
+    size_t offset = index.indexed_bytes;
+    size_t malformed = 0;
+    while (true)
+    {
+        const message* msg = next_message(mapped, offset, &malformed);
+        if (msg == nullptr) {
+            break;
+        }
+        const size_t record_offset = size_t(reinterpret_cast<const uint8_t*>(msg) - mapped.data);
+
+        if (index.record_count == 0) {
+            // the file's first bytes, even if its first record was malformed
+            ::memcpy(index.fingerprint, mapped.data, sizeof(message));
+            index.min_timestamp = msg->timestamp;
+            index.max_timestamp = msg->timestamp;
+        }
+        index.min_timestamp = std::min<uint64_t>(index.min_timestamp, msg->timestamp);
+        index.max_timestamp = std::max<uint64_t>(index.max_timestamp, msg->timestamp);
+        ++index.record_count;
+
+        if (index.blocks.empty() || index.blocks.back().count == INDEX_BLOCK_RECORDS) {
+            index.blocks.push_back({record_offset, 0, msg->timestamp, msg->timestamp});
+        }
+        auto& block = index.blocks.back();
+        block.count++;
+        block.min_timestamp = std::min<uint64_t>(block.min_timestamp, msg->timestamp);
+        block.max_timestamp = std::max<uint64_t>(block.max_timestamp, msg->timestamp);
+
+        auto thread = index.threads.emplace(std::make_pair(msg->process_id, msg->thread_id),
+            index_thread{0, record_offset, record_offset, msg->timestamp, msg->timestamp}).first;
+        thread->second.count++;
+        thread->second.last_offset = record_offset;
+        thread->second.min_timestamp = std::min<uint64_t>(thread->second.min_timestamp, msg->timestamp);
+        thread->second.max_timestamp = std::max<uint64_t>(thread->second.max_timestamp, msg->timestamp);
+
+        const log_site location = locate_site(msg);
+        assign_site_key(key, location);
+        auto site = site_ids.find(key);
+        if (site == site_ids.end()) {
+            site = site_ids.emplace(key, (uint32_t)index.sites.size()).first;
+            index.sites.push_back({location.function, location.file, location.line, location.format_string, {}});
+        }
+        index.sites[site->second].offsets.push_back(record_offset);
+    }
+    index.indexed_bytes = offset;
+    index.malformed_count += malformed;
+}
+
+static bool read_index(const std::string& log_path, log_index& index)
+{
+    FILE* file = fopen(index_path(log_path).c_str(), "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    std::vector<uint8_t> data;
+    uint8_t buffer[64 * 1024];
+    size_t bytes;
+    while ((bytes = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        data.insert(data.end(), buffer, buffer + bytes);
+    }
+    fclose(file);
+
+    index_reader reader = {data.data(), data.data() + data.size(), true};
+    char magic[sizeof(INDEX_MAGIC)];
+    for (auto& c : magic) {
+        c = reader.get<char>();
+    }
+    if (!reader.ok || memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0) {
+        return false;
+    }
+
+    index.indexed_bytes = reader.get<uint64_t>();
+    index.record_count = reader.get<uint64_t>();
+    index.malformed_count = reader.get<uint64_t>();
+    for (auto& byte : index.fingerprint) {
+        byte = reader.get<uint8_t>();
+    }
+    index.min_timestamp = reader.get<uint64_t>();
+    index.max_timestamp = reader.get<uint64_t>();
+
+    const uint32_t block_count = reader.get<uint32_t>();
+    for (uint32_t k = 0; k < block_count && reader.ok; ++k)
+    {
+        index_block block;
+        block.offset = reader.get<uint64_t>();
+        block.count = reader.get<uint32_t>();
+        block.min_timestamp = reader.get<uint64_t>();
+        block.max_timestamp = reader.get<uint64_t>();
+        index.blocks.push_back(block);
+    }
+
+    const uint32_t thread_count = reader.get<uint32_t>();
+    for (uint32_t k = 0; k < thread_count && reader.ok; ++k)
+    {
+        const uint32_t process_id = reader.get<uint32_t>();
+        const uint32_t thread_id = reader.get<uint32_t>();
+        index_thread thread;
+        thread.count = reader.get<uint64_t>();
+        thread.first_offset = reader.get<uint64_t>();
+        thread.last_offset = reader.get<uint64_t>();
+        thread.min_timestamp = reader.get<uint64_t>();
+        thread.max_timestamp = reader.get<uint64_t>();
+        index.threads[std::make_pair(process_id, thread_id)] = thread;
+    }
+
+    const uint32_t site_count = reader.get<uint32_t>();
+    for (uint32_t k = 0; k < site_count && reader.ok; ++k)
+    {
+        index_site site;
+        site.function = reader.get_string();
+        site.file = reader.get_string();
+        site.line = reader.get<uint32_t>();
+        site.format_string = reader.get_string();
+        const uint64_t posting_count = reader.get<uint64_t>();
+        // offsets are delta encoded
+        uint64_t offset = 0;
+        for (uint64_t j = 0; j < posting_count && reader.ok; ++j) {
+            offset += reader.get_varint();
+            site.offsets.push_back(offset);
+        }
+        index.sites.push_back(std::move(site));
+    }
+    return reader.ok;
+}
+
+bool save_index(const std::string& log_path, const log_index& index)
+{
+    std::string out;
+    out.append(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    put<uint64_t>(out, index.indexed_bytes);
+    put<uint64_t>(out, index.record_count);
+    put<uint64_t>(out, index.malformed_count);
+    out.append(reinterpret_cast<const char*>(index.fingerprint), sizeof(index.fingerprint));
+    put<uint64_t>(out, index.min_timestamp);
+    put<uint64_t>(out, index.max_timestamp);
+
+    put<uint32_t>(out, (uint32_t)index.blocks.size());
+    for (const auto& block : index.blocks)
+    {
+        put<uint64_t>(out, block.offset);
+        put<uint32_t>(out, block.count);
+        put<uint64_t>(out, block.min_timestamp);
+        put<uint64_t>(out, block.max_timestamp);
+    }
+
+    put<uint32_t>(out, (uint32_t)index.threads.size());
+    for (const auto& thread : index.threads)
+    {
+        put<uint32_t>(out, thread.first.first);
+        put<uint32_t>(out, thread.first.second);
+        put<uint64_t>(out, thread.second.count);
+        put<uint64_t>(out, thread.second.first_offset);
+        put<uint64_t>(out, thread.second.last_offset);
+        put<uint64_t>(out, thread.second.min_timestamp);
+        put<uint64_t>(out, thread.second.max_timestamp);
+    }
+
+    put<uint32_t>(out, (uint32_t)index.sites.size());
+    for (const auto& site : index.sites)
+    {
+        put_string(out, site.function);
+        put_string(out, site.file);
+        put<uint32_t>(out, site.line);
+        put_string(out, site.format_string);
+        put<uint64_t>(out, site.offsets.size());
+        uint64_t previous = 0;
+        for (auto offset : site.offsets) {
+            put_varint(out, offset - previous);
+            previous = offset;
+        }
+    }
+
+    // written aside and renamed over the old index so readers never see half of one
+    const std::string path = index_path(log_path);
+    const std::string temp_path = path + ".tmp";
+    FILE* file = fopen(temp_path.c_str(), "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    const bool written = fwrite(out.data(), 1, out.size(), file) == out.size();
+    if (fclose(file) != 0 || !written) {
+        remove(temp_path.c_str());
+        return false;
+    }
+#ifdef _WIN32
+    remove(path.c_str());
+#endif
+    return rename(temp_path.c_str(), path.c_str()) == 0;
+}
+
+// loads the log's index, rebuilding it if the log was replaced and extending
+// it if the log has grown since it was written
+bool update_index(const std::string& log_path, const mapped_file& mapped, log_index& index, bool& changed)
+{
+    changed = false;
+    const bool loaded = read_index(log_path, index);
+    const bool replaced = !loaded ||
+        index.indexed_bytes > mapped.size ||
+        (index.record_count != 0 && memcmp(index.fingerprint, mapped.data, sizeof(message)) != 0);
+    if (replaced) {
+        index = log_index();
+        ::memset(index.fingerprint, 0, sizeof(index.fingerprint));
+        changed = true;
+    }
+    if (mapped.size > index.indexed_bytes) {
+        const uint64_t indexed_bytes = index.indexed_bytes;
+        index_records(index, mapped);
+        changed = changed || index.indexed_bytes != indexed_bytes;
+    }
+    return true;
+}
+
+// an index is only used when one exists, queries never create them, but an
+// existing index is kept up to date
+bool load_index(const std::string& log_path, const mapped_file& mapped, log_index& index)
+{
+    FILE* file = fopen(index_path(log_path).c_str(), "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    fclose(file);
+
+    bool changed = false;
+    if (!update_index(log_path, mapped, index, changed)) {
+        return false;
+    }
+    if (changed && !save_index(log_path, index)) {
+        fprintf(stderr, "Error updating index for '%s'\n", log_path.c_str());
+    }
+    return true;
+}
+
+// appends the records of an indexed log which can pass the filter, in file order
+void select_indexed(const log_index& index, const mapped_file& mapped, const message_filter& filter,
+                    uint64_t begin_timestamp, std::vector<const message*>& messages)
+{
+    // only blocks overlapping the time range are read
+    auto block_in_range = [&](const index_block& block) {
+        return !(filter.has_since && block.max_timestamp - begin_timestamp < filter.since) &&
+               !(filter.has_until && block.min_timestamp - begin_timestamp > filter.until);
+    };
+
+    // with a process or thread filter, only offsets within a selected thread's
+    // range are read.  The ranges are merged into sorted disjoint ones which are
+    // walked alongside the offsets, as both loops below visit offsets in order
+    const bool by_thread = !filter.process_ids.empty() || !filter.thread_ids.empty();
+    std::vector<std::pair<uint64_t, uint64_t>> thread_ranges;
+    if (by_thread) {
+        for (const auto& thread : index.threads)
+        {
+            const bool process_match = filter.process_ids.empty() ||
+                std::find(filter.process_ids.begin(), filter.process_ids.end(), thread.first.first) != filter.process_ids.end();
+            const bool thread_match = filter.thread_ids.empty() ||
+                std::find(filter.thread_ids.begin(), filter.thread_ids.end(), thread.first.second) != filter.thread_ids.end();
+            if (process_match && thread_match) {
+                thread_ranges.emplace_back(thread.second.first_offset, thread.second.last_offset);
+            }
+        }
+        if (thread_ranges.empty()) {
+            return;
+        }
+        std::sort(thread_ranges.begin(), thread_ranges.end());
+        size_t merged = 0;
+        for (size_t k = 1; k < thread_ranges.size(); ++k)
+        {
+            if (thread_ranges[k].first <= thread_ranges[merged].second) {
+                thread_ranges[merged].second = std::max(thread_ranges[merged].second, thread_ranges[k].second);
+            } else {
+                thread_ranges[++merged] = thread_ranges[k];
+            }
+        }
+        thread_ranges.resize(merged + 1);
+    }
+    size_t next_range = 0;
+    auto offset_in_threads = [&](uint64_t offset) {
+        if (!by_thread) {
+            return true;
+        }
+        while (next_range < thread_ranges.size() && thread_ranges[next_range].second < offset) {
+            ++next_range;
+        }
+        return next_range < thread_ranges.size() && offset >= thread_ranges[next_range].first;
+    };
+
+    auto push = [&](uint64_t offset) {
+        size_t next = offset;
+        if (const message* msg = next_message(mapped, next)) {
+            messages.push_back(msg);
+        }
+    };
+
+    const bool by_site = !filter.functions.empty() || !filter.files.empty() || !filter.format_strings.empty();
+    if (by_site) {
+        // merge the posting lists of every matching site
+        std::vector<uint64_t> offsets;
+        for (const auto& site : index.sites)
+        {
+            if (filter_accepts_site(filter, site.function.c_str(), site.file.c_str(), site.format_string.c_str())) {
+                offsets.insert(offsets.end(), site.offsets.begin(), site.offsets.end());
+            }
+        }
+        std::sort(offsets.begin(), offsets.end());
+
+        size_t block = 0;
+        for (auto offset : offsets)
+        {
+            while (block + 1 < index.blocks.size() && index.blocks[block + 1].offset <= offset) {
+                ++block;
+            }
+            if (block_in_range(index.blocks[block]) && offset_in_threads(offset)) {
+                push(offset);
+            }
+        }
+        return;
+    }
+
+    for (const auto& block : index.blocks)
+    {
+        if (!block_in_range(block)) {
+            continue;
+        }
+        size_t offset = block.offset;
+        for (uint32_t k = 0; k < block.count; ++k)
+        {
+            const message* msg = next_message(mapped, offset);
+            if (msg == nullptr) {
+                break;
+            }
+            if (offset_in_threads(size_t(reinterpret_cast<const uint8_t*>(msg) - mapped.data))) {
+                messages.push_back(msg);
+            }
+        }
+    }
+}
+
+void append_process_name(std::string& out, uint32_t childid)
+{
+    if (childid == 0) {
+        out += "Parent";
+    } else {
+        out += "Child";
+        append_uint(out, childid);
+    }
+}
+
+std::string process_name(uint32_t childid)
+{
+    std::string retval;
+    append_process_name(retval, childid);
+    return retval;
+}
+
+void assign_site_key(std::string& key, const log_site& site, bool with_line)
+{
+    key.assign(site.function);
+    key += '\0';
+    key += site.file;
+    key += '\0';
+    if (with_line) {
+        key.append(reinterpret_cast<const char*>(&site.line), sizeof(site.line));
+    }
+    key += site.format_string;
+}
+
+void print_msg(const print_config& config, const message* msg)
+{
+    if (config.filter && !filter_accepts(*config.filter, config.begin_timestamp, msg)) {
+        return;
+    }
+
+    thread_local print_scratch scratch;
+
+    if (!tbb::reader::decode_record(msg, scratch)) {
+        return;
+    }
+    auto& fmt_params = scratch.params;
+
+    assert(fmt_params.size() > 3);
+    assert(fmt_params[0].type == data_type::utf8);
+    assert(fmt_params[1].type == data_type::utf8);
+    assert(fmt_params[2].type == data_type::u32);
+    assert(fmt_params[3].type == data_type::utf8);
+
+    // now format the output
+    uint64_t timestamp = msg->timestamp - config.begin_timestamp;
+    auto childid = msg->process_id;
+    auto threadid = msg->thread_id;
+    auto function = fmt_params[0].value.utf8_;
+    auto filename = [&]() {
+        const char* filename = fmt_params[1].value.utf8_;
+        if (strlen(filename) < config.filename_offset) {
+            return "(nil)";
+        }
+        return filename + config.filename_offset;
+    }();
+    auto line = fmt_params[2].value.u32_;
+
+    if (config.options & OPTIONS_METRICS_CSV) {
+        for(size_t k = 4; k < fmt_params.size(); ++k) {
+            if (fmt_params[k].type == data_type::metric) {
+                print_metric_csv(config, msg, function, filename, line, fmt_params[3].value.utf8_, *fmt_params[k].value.metric_);
+            }
+        }
+        return;
+    }
+
+    // entries are formatted in place at the end of the output buffer, except
+    // for flows which hold on to theirs until the report
+    const bool keep_entry = (config.options & OPTIONS_FLOWS) != 0;
+    auto& entry = keep_entry ? scratch.entry : *config.out_buffer;
+    if (keep_entry) {
+        entry.clear();
+    }
+    auto entry_out = std::back_inserter(entry);
+    if (!(config.options & OPTIONS_HIDE_TIMESTAMP)) {
+        entry += '[';
+        append_timestamp(entry, timestamp);
+        entry += ']';
+    }
+    if (!(config.options & OPTIONS_HIDE_CHILDID)) {
+        entry += '[';
+        append_process_name(entry, childid);
+        entry += ']';
+    }
+    if (!(config.options & OPTIONS_HIDE_THREADID)) {
+        entry += '[';
+        append_uint(entry, threadid);
+        entry += ']';
+    }
+    if (!(config.options & OPTIONS_HIDE_LOGSITE)) {
+        entry += ' ';
+        entry += function;
+        entry += " in ";
+        entry += filename;
+        entry += ':';
+        append_uint(entry, line);
+        entry += ' ';
+    }
+
+    // format the user message
+    auto format_string = fmt_params[3].value.utf8_;
+    auto& user_params = scratch.user_params;
+    user_params.clear();
+    const perf_sample* perf = nullptr;
+    const metric_sample* metric = nullptr;
+    const flow_marker* flow = nullptr;
+    for(size_t k = 4; k < fmt_params.size(); ++k) {
+        const auto& param = fmt_params[k];
+        // scope records carry their perf sample after the user's arguments
+        if (param.type == data_type::perf) {
+            perf = param.value.perf_;
+            continue;
+        }
+        // metric records carry a single snapshot, formatted after the metric's name
+        if (param.type == data_type::metric) {
+            metric = param.value.metric_;
+            continue;
+        }
+        // flow markers and contexts are appended after the user's arguments
+        if (param.type == data_type::flow) {
+            flow = &param.value.flow_;
+            continue;
+        }
+        user_params.push_back(&param);
+    }
+
+    const parsed_format& parsed = get_parsed_format(format_string);
+    const size_t user_msg_begin = entry.size();
+    try {
+        if (parsed.valid) {
+            format_user_msg(entry, parsed, user_params);
+        } else {
+            std::vector<fmt::basic_format_arg<fmt::format_context>> args;
+            for(auto param : user_params) {
+                args.push_back(fmt::internal::make_arg<fmt::format_context, fmt_param>(*param));
+            }
+            entry += fmt::vformat(format_string,
+                                  fmt::basic_format_args<fmt::format_context>(args.data(), args.size()));
+        }
+    } catch(...) {
+        entry.resize(user_msg_begin);
+        fmt::format_to(entry_out, "Error processing format string: '{}'", format_string);
+    }
+
+    if (perf) {
+        fmt::format_to(entry_out, " ({:.3f}us", perf->duration / 1000.0);
+        for(size_t k = 0; k < PERF_COUNTER_COUNT; ++k) {
+            if (perf->valid_mask & (1 << k)) {
+                fmt::format_to(entry_out, " {}={}", PERF_COUNTER_NAMES[k], perf->values[k]);
+            }
+        }
+        // counters the kernel time-shared were scaled up by the logger, so they're estimates
+        if (perf->valid_mask & PERF_MULTIPLEXED) {
+            entry += " multiplexed";
+        }
+        entry += ")";
+
+        if (config.perf_summary) {
+            auto site = fmt::format("{} in {}:{} \"{}\"", function, filename, line, format_string);
+            auto& stats = (*config.perf_summary)[site];
+            stats.count++;
+            stats.total_duration += perf->duration;
+            stats.multiplexed += (perf->valid_mask & PERF_MULTIPLEXED) != 0;
+            for(size_t k = 0; k < PERF_COUNTER_COUNT; ++k) {
+                if (perf->valid_mask & (1 << k)) {
+                    stats.counter_samples[k]++;
+                    stats.counter_totals[k] += perf->values[k];
+                }
+            }
+        }
+    }
+
+    if (metric) {
+        switch(metric->kind)
+        {
+            case metric_kind::counter:
+                fmt::format_to(entry_out, " counter={}", metric->sum);
+                break;
+            case metric_kind::gauge:
+                fmt::format_to(entry_out, " gauge={} min={} max={}", metric->last, metric->min, metric->max);
+                break;
+            case metric_kind::histogram:
+                fmt::format_to(entry_out, " histogram count={} mean={} min={} max={}",
+                    metric->count, metric->total / metric->count, metric->min, metric->max);
+                for(size_t k = 0; k < metric_histogram_buckets; ++k) {
+                    if (metric->buckets[k] != 0) {
+                        if (k == 0) {
+                            fmt::format_to(entry_out, " [0,1):{}", metric->buckets[k]);
+                        } else {
+                            fmt::format_to(entry_out, " [{},{}):{}", 1ull << (k - 1), 1ull << k, metric->buckets[k]);
+                        }
+                    }
+                }
+                break;
+        }
+    }
+
+    if (flow) {
+        if (flow->phase == flow_phase::context) {
+            fmt::format_to(entry_out, " (flow 0x{:016x})", flow->id);
+        } else {
+            fmt::format_to(entry_out, " (flow 0x{:016x} {})", flow->id, FLOW_PHASE_NAMES[(size_t)flow->phase]);
+        }
+    }
+
+    if (keep_entry) {
+        if (flow) {
+            (*config.flows)[flow->id].push_back({msg->timestamp, childid, threadid, flow->phase, entry});
+        }
+        return;
+    }
+    entry += '\n';
+}
+
+void print_flows(const print_config& config)
+{
+
+    for(const auto& flow : *config.flows) {
+        const auto& entries = flow.second;
+
+        // latency spans from the first begin marker to the last end marker, falling back
+        // to the flow's first and last entries when those are missing
+        auto first = std::find_if(entries.begin(), entries.end(), [](const flow_entry& e) { return e.phase == flow_phase::begin; });
+        auto last = std::find_if(entries.rbegin(), entries.rend(), [](const flow_entry& e) { return e.phase == flow_phase::end; });
+        const bool complete = first != entries.end() && last != entries.rend();
+        const uint64_t begin_timestamp = first != entries.end() ? first->timestamp : entries.front().timestamp;
+        const uint64_t end_timestamp = last != entries.rend() ? last->timestamp : entries.back().timestamp;
+
+        fprintf(config.out_file, "Flow 0x%016llx: %zu entries, latency %.3fus%s\n",
+            (unsigned long long)flow.first,
+            entries.size(),
+            (end_timestamp - begin_timestamp) / 1000.0,
+            complete ? "" : " (incomplete)");
+
+        // entries logged before the begin marker or after the end marker aren't part of the path
+        const size_t begin_index = first != entries.end() ? size_t(first - entries.begin()) : 0;
+        const size_t end_index = last != entries.rend() ? size_t(entries.rend() - last) - 1 : entries.size() - 1;
+
+        // each entry depends on its thread's previous entry and on the flow being handed to its
+        // thread, by the latest begin or step marker logged on another thread
+        std::vector<size_t> previous(entries.size(), SIZE_MAX);
+        std::vector<size_t> handoff(entries.size(), SIZE_MAX);
+        std::map<std::pair<uint32_t, uint32_t>, size_t> thread_last;
+        // the latest marker, and the latest one from any other thread
+        size_t marker = SIZE_MAX;
+        size_t other_marker = SIZE_MAX;
+        auto same_thread = [&entries](size_t a, size_t b) {
+            return entries[a].process_id == entries[b].process_id && entries[a].thread_id == entries[b].thread_id;
+        };
+        for(size_t k = begin_index; k <= end_index; ++k) {
+            const auto& entry = entries[k];
+            const auto thread = std::make_pair(entry.process_id, entry.thread_id);
+            auto found = thread_last.find(thread);
+            if (found != thread_last.end()) {
+                previous[k] = found->second;
+            }
+            thread_last[thread] = k;
+
+            handoff[k] = (marker != SIZE_MAX && !same_thread(marker, k)) ? marker : other_marker;
+            if (entry.phase == flow_phase::begin || entry.phase == flow_phase::step) {
+                if (marker != SIZE_MAX && !same_thread(marker, k)) {
+                    other_marker = marker;
+                }
+                marker = k;
+            }
+        }
+
+        // the critical path is the chain of dependencies which decided when the flow ended. walking
+        // back from the end, an entry waited on its hand-off if that came after its thread's previous
+        // entry, otherwise on the previous entry. its segments add up to the flow's latency, and
+        // branches which ran concurrently and finished earlier aren't counted
+        struct path_segment
+        {
+            std::string name;
+            // the process the time is totalled under, or "ipc" for hops between processes
+            std::string owner;
+            uint64_t elapsed;
+        };
+        std::vector<path_segment> path;
+        for(size_t current = end_index; current > begin_index;) {
+            const auto& entry = entries[current];
+            const bool handed_off = handoff[current] != SIZE_MAX &&
+                (previous[current] == SIZE_MAX || handoff[current] > previous[current]);
+            const size_t next = handed_off ? handoff[current] : previous[current];
+
+            path_segment segment;
+            if (next == SIZE_MAX) {
+                // nothing to follow back, only possible without a begin marker
+                segment = {"untracked", "untracked", entry.timestamp - entries[begin_index].timestamp};
+            } else {
+                const auto& from = entries[next];
+                segment.elapsed = entry.timestamp - from.timestamp;
+                if (!handed_off) {
+                    segment.name = fmt::format("{}[{}]", process_name(entry.process_id), entry.thread_id);
+                    segment.owner = process_name(entry.process_id);
+                } else if (from.process_id != entry.process_id) {
+                    segment.name = fmt::format("ipc {} -> {}", process_name(from.process_id), process_name(entry.process_id));
+                    segment.owner = "ipc";
+                } else {
+                    segment.name = fmt::format("thread hop {}[{}] -> [{}]", process_name(entry.process_id), from.thread_id, entry.thread_id);
+                    segment.owner = process_name(entry.process_id);
+                }
+            }
+
+            if (!path.empty() && path.back().name == segment.name) {
+                path.back().elapsed += segment.elapsed;
+            } else {
+                path.push_back(std::move(segment));
+            }
+            current = next == SIZE_MAX ? begin_index : next;
+        }
+        std::reverse(path.begin(), path.end());
+
+        // per process totals along the path
+        std::map<std::string, uint64_t> process_totals;
+        for(const auto& segment : path) {
+            fprintf(config.out_file, "  %10.3fus %s\n", segment.elapsed / 1000.0, segment.name.c_str());
+            process_totals[segment.owner] += segment.elapsed;
+        }
+        for(const auto& total : process_totals) {
+            fprintf(config.out_file, "  total %s: %.3fus\n", total.first.c_str(), total.second / 1000.0);
+        }
+
+        for(const auto& entry : entries) {
+            fprintf(config.out_file, "%s\n", entry.text.c_str());
+        }
+        fprintf(config.out_file, "\n");
+    }
+}
+
+void print_metric_csv(const print_config& config, const message* msg, const char* function, const char* filename, uint32_t line, const char* name, const metric_sample& metric)
+{
+    uint64_t timestamp = msg->timestamp - config.begin_timestamp;
+
+    // the logger doubles braces in metric names since they're logged as format strings
+    std::string unescaped;
+    if (strpbrk(name, "{}") != nullptr) {
+        for(const char* c = name; *c; ++c) {
+            unescaped += *c;
+            if ((*c == '{' || *c == '}') && c[1] == *c) {
+                ++c;
+            }
+        }
+        name = unescaped.c_str();
+    }
+
+    // value is the counter's interval sum, the gauge's last value or the histogram's mean
+    const char* kind = "";
+    double value = 0.0;
+    int64_t total = 0;
+    uint64_t count = 0;
+    switch(metric.kind)
+    {
+        case metric_kind::counter:
+        {
+            auto key = fmt::format("{}:{}:{}:{}", function, filename, line, name);
+            total = ((*config.metric_totals)[key] += metric.sum);
+            kind = "counter";
+            value = (double)metric.sum;
+            break;
+        }
+        case metric_kind::gauge:
+            kind = "gauge";
+            value = metric.last;
+            break;
+        case metric_kind::histogram:
+            kind = "histogram";
+            value = metric.total / metric.count;
+            count = metric.count;
+            break;
+    }
+
+    auto& out = *config.out_buffer;
+    // quote strings which may contain separators
+    auto quote = [&out](const char* str) {
+        out += '"';
+        for(; *str; ++str) {
+            if (*str == '"') out += '"';
+            out += *str;
+        }
+        out += "\",";
+    };
+
+    append_timestamp(out, timestamp);
+    out += ',';
+    append_uint(out, msg->process_id);
+    out += ',';
+    append_uint(out, msg->thread_id);
+    out += ',';
+    quote(function);
+    quote(filename);
+    append_uint(out, line);
+    out += ',';
+    quote(name);
+    if (metric.kind == metric_kind::counter) {
+        fmt::format_to(std::back_inserter(out), "{},{},{},{},,\n", kind, value, total, count);
+    } else {
+        fmt::format_to(std::back_inserter(out), "{},{},{},{},{},{}\n", kind, value, total, count, metric.min, metric.max);
+    }
+}
+
+void print_perf_summary(const print_config& config)
+{
+    // most expensive sites first
+    std::vector<const perf_summary_t::value_type*> sites;
+    for(const auto& entry : *config.perf_summary) {
+        sites.push_back(&entry);
+    }
+    std::stable_sort(sites.begin(), sites.end(), [](const perf_summary_t::value_type* a, const perf_summary_t::value_type* b)
+    {
+        return a->second.total_duration > b->second.total_duration;
+    });
+
+    fprintf(config.out_file, "\nPerformance summary (%zu sites):\n", sites.size());
+    for(auto site : sites) {
+        const auto& stats = site->second;
+        fprintf(config.out_file, "%s\n", site->first.c_str());
+        fprintf(config.out_file, "  count=%llu total=%.3fus mean=%.3fus\n",
+            (unsigned long long)stats.count,
+            stats.total_duration / 1000.0,
+            stats.total_duration / 1000.0 / stats.count);
+        for(size_t k = 0; k < PERF_COUNTER_COUNT; ++k) {
+            if (stats.counter_samples[k] != 0) {
+                fprintf(config.out_file, "  %s: total=%llu mean=%.1f\n",
+                    PERF_COUNTER_NAMES[k],
+                    (unsigned long long)stats.counter_totals[k],
+                    (double)stats.counter_totals[k] / stats.counter_samples[k]);
+            }
+        }
+        if (stats.multiplexed != 0) {
+            fprintf(config.out_file, "  multiplexed=%llu (counters scaled from partial counting)\n",
+                (unsigned long long)stats.multiplexed);
+        }
+
+        // instructions per cycle over the samples where both were available
+        constexpr size_t instructions = (size_t)perf_counter::instructions;
+        constexpr size_t cycles = (size_t)perf_counter::cycles;
+        if (stats.counter_totals[cycles] != 0 &&
+            stats.counter_samples[instructions] == stats.counter_samples[cycles]) {
+            fprintf(config.out_file, "  ipc=%.2f\n",
+                (double)stats.counter_totals[instructions] / stats.counter_totals[cycles]);
+        }
+    }
+}
+
+// columnar export
+
+enum class column_kind : uint8_t
+{
+    timestamp = 0,
+    process_id = 1,
+    thread_id = 2,
+    site_id = 3,
+    // one column per argument slot of each site
+    argument = 4,
+};
+
+enum class column_encoding : uint8_t
+{
+    // zigzag encoded differences from the previous value as varints
+    delta_varint = 0,
+    // little endian doubles
+    f64 = 1,
+    // varint length followed by the bytes of each value
+    bytes = 2,
+};
+
+// a column's values within one row group, encoded as they're added along with
+// min/max statistics: integers compare per their type's signedness, floats as
+// doubles, and byte columns by the length of their values
+struct column_chunk
+{
+    column_kind kind;
+    uint32_t site;
+    uint32_t slot;
+    data_type type;
+    column_encoding encoding;
+    std::string data;
+    uint32_t count;
+    uint64_t previous;
+    uint64_t min;
+    uint64_t max;
+
+    column_chunk(column_kind kind, uint32_t site, uint32_t slot, data_type type, column_encoding encoding)
+    : kind(kind)
+    , site(site)
+    , slot(slot)
+    , type(type)
+    , encoding(encoding)
+    , count(0)
+    , previous(0)
+    , min(0)
+    , max(0)
+    { }
+
+    void add_unsigned(uint64_t value)
+    {
+        add_delta(value);
+        if (count == 0 || value < min) {
+            min = value;
+        }
+        if (count == 0 || value > max) {
+            max = value;
+        }
+        ++count;
+    }
+
+    void add_signed(int64_t value)
+    {
+        add_delta(uint64_t(value));
+        if (count == 0 || value < int64_t(min)) {
+            min = uint64_t(value);
+        }
+        if (count == 0 || value > int64_t(max)) {
+            max = uint64_t(value);
+        }
+        ++count;
+    }
+
+    void add_double(double value)
+    {
+        put<double>(data, value);
+        double low, high;
+        ::memcpy(&low, &min, sizeof(double));
+        ::memcpy(&high, &max, sizeof(double));
+        if (count == 0 || value < low) {
+            ::memcpy(&min, &value, sizeof(double));
+        }
+        if (count == 0 || value > high) {
+            ::memcpy(&max, &value, sizeof(double));
+        }
+        ++count;
+    }
+
+    void add_bytes(const char* bytes, size_t size)
+    {
+        put_varint(data, size);
+        data.append(bytes, size);
+        if (count == 0 || size < min) {
+            min = size;
+        }
+        if (count == 0 || size > max) {
+            max = size;
+        }
+        ++count;
+    }
+
+private:
+    void add_delta(uint64_t value)
+    {
+        put_varint(data, zigzag(int64_t(value - previous)));
+        previous = value;
+    }
+};
+
+// where a chunk landed in the file, for the footer's directory
+struct column_entry
+{
+    uint32_t row_group;
+    column_kind kind;
+    uint32_t site;
+    uint32_t slot;
+    data_type type;
+    column_encoding encoding;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t count;
+    uint64_t min;
+    uint64_t max;
+};
+
+struct columnar_site
+{
+    std::string function;
+    std::string file;
+    uint32_t line;
+    std::string format_string;
+    std::vector<data_type> arg_types;
+};
+
+static column_encoding argument_encoding(data_type type)
+{
+    switch(type)
+    {
+        case data_type::i8:
+        case data_type::i16:
+        case data_type::i32:
+        case data_type::i64:
+        case data_type::u8:
+        case data_type::u16:
+        case data_type::u32:
+        case data_type::u64:
+        case data_type::p32:
+        case data_type::p64:
+            return column_encoding::delta_varint;
+        case data_type::f32:
+        case data_type::f64:
+            return column_encoding::f64;
+        default:
+            return column_encoding::bytes;
+    }
+}
+
+// perf samples, metrics and flow markers are stored as they were logged
+static void encode_sample(std::string& out, const fmt_param& param)
+{
+    switch(param.type)
+    {
+        case data_type::perf:
+        {
+            const auto& perf = *param.value.perf_;
+            put<uint8_t>(out, perf.valid_mask);
+            put<uint64_t>(out, perf.duration);
+            for(size_t k = 0; k < PERF_COUNTER_COUNT; ++k) {
+                if (perf.valid_mask & (1 << k)) {
+                    put<uint64_t>(out, perf.values[k]);
+                }
+            }
+            break;
+        }
+        case data_type::metric:
+        {
+            const auto& metric = *param.value.metric_;
+            put<uint8_t>(out, (uint8_t)metric.kind);
+            switch(metric.kind)
+            {
+                case metric_kind::counter:
+                    put<int64_t>(out, metric.sum);
+                    break;
+                case metric_kind::gauge:
+                    put<double>(out, metric.last);
+                    put<double>(out, metric.min);
+                    put<double>(out, metric.max);
+                    break;
+                case metric_kind::histogram:
+                {
+                    put<uint64_t>(out, metric.count);
+                    put<double>(out, metric.total);
+                    put<double>(out, metric.min);
+                    put<double>(out, metric.max);
+                    std::string buckets;
+                    uint8_t bucket_count = 0;
+                    for(size_t k = 0; k < metric_histogram_buckets; ++k) {
+                        if (metric.buckets[k] != 0) {
+                            put<uint8_t>(buckets, (uint8_t)k);
+                            put<uint64_t>(buckets, metric.buckets[k]);
+                            ++bucket_count;
+                        }
+                    }
+                    put<uint8_t>(out, bucket_count);
+                    out += buckets;
+                    break;
+                }
+            }
+            break;
+        }
+        case data_type::flow:
+            put<uint8_t>(out, (uint8_t)param.value.flow_.phase);
+            put<uint64_t>(out, param.value.flow_.id);
+            break;
+        default:
+            break;
+    }
+}
+
+// strings are stored as UTF-8, arrays and blobs as their captured element
+// bytes, and perf samples, metrics and flow markers in their logged encoding
+static void add_argument(column_chunk& column, const fmt_param& param, std::string& text)
+{
+    switch(param.type)
+    {
+        case data_type::i8:  column.add_signed(param.value.i8_); break;
+        case data_type::i16: column.add_signed(param.value.i16_); break;
+        case data_type::i32: column.add_signed(param.value.i32_); break;
+        case data_type::i64: column.add_signed(param.value.i64_); break;
+        case data_type::u8:  column.add_unsigned(param.value.u8_); break;
+        case data_type::u16: column.add_unsigned(param.value.u16_); break;
+        case data_type::u32: column.add_unsigned(param.value.u32_); break;
+        case data_type::u64: column.add_unsigned(param.value.u64_); break;
+        case data_type::p32: column.add_unsigned(param.value.p32_); break;
+        case data_type::p64: column.add_unsigned(param.value.p64_); break;
+        case data_type::f32: column.add_double(param.value.f32_); break;
+        case data_type::f64: column.add_double(param.value.f64_); break;
+        case data_type::utf8:
+            column.add_bytes(param.value.utf8_, strlen(param.value.utf8_));
+            break;
+        case data_type::array:
+        case data_type::blob:
+        {
+            const auto& arr = param.value.array_;
+            column.add_bytes(reinterpret_cast<const char*>(arr.data), arr.count * element_size(arr.element_type));
+            break;
+        }
+        default:
+        {
+            text.clear();
+            if (param.type == data_type::utf16) {
+                append_utf16(text, param.value.utf16_);
+            } else if (param.type == data_type::utf32) {
+                append_utf32(text, param.value.utf32_);
+            } else {
+                encode_sample(text, param);
+            }
+            column.add_bytes(text.data(), text.size());
+            break;
+        }
+    }
+}
+
+void write_columnar(const print_config& config, const std::vector<const message*>& messages)
+{
+    static const char COLUMNAR_MAGIC[8] = {'T', 'B', 'B', 'C', 'O', 'L', '0', '1'};
+
+    auto& writer = *config.writer;
+    uint64_t written = 0;
+    auto write = [&](const std::string& data) {
+        writer.write(data.data(), data.size());
+        written += data.size();
+    };
+    write(std::string(COLUMNAR_MAGIC, sizeof(COLUMNAR_MAGIC)));
+
+    // sites are told apart by their argument types too, so each slot has one type
+    std::vector<columnar_site> sites;
+    std::unordered_map<std::string, uint32_t> site_ids;
+    std::string key;
+
+    std::vector<column_entry> directory;
+    std::vector<std::pair<uint64_t, uint32_t>> row_groups;
+    uint64_t row_count = 0;
+
+    auto make_header_columns = []() {
+        std::vector<column_chunk> columns;
+        columns.emplace_back(column_kind::timestamp, 0, 0, data_type::u64, column_encoding::delta_varint);
+        columns.emplace_back(column_kind::process_id, 0, 0, data_type::u32, column_encoding::delta_varint);
+        columns.emplace_back(column_kind::thread_id, 0, 0, data_type::u32, column_encoding::delta_varint);
+        columns.emplace_back(column_kind::site_id, 0, 0, data_type::u32, column_encoding::delta_varint);
+        return columns;
+    };
+    std::vector<column_chunk> header_columns = make_header_columns();
+    std::map<std::pair<uint32_t, uint32_t>, column_chunk> argument_columns;
+    uint32_t group_rows = 0;
+
+    auto write_chunk = [&](const column_chunk& column) {
+        directory.push_back({(uint32_t)row_groups.size(), column.kind, column.site, column.slot, column.type,
+            column.encoding, written, column.data.size(), column.count, column.min, column.max});
+        write(column.data);
+    };
+    auto flush_group = [&]() {
+        if (group_rows == 0) {
+            return;
+        }
+        for (const auto& column : header_columns) {
+            write_chunk(column);
+        }
+        for (const auto& column : argument_columns) {
+            write_chunk(column.second);
+        }
+        row_groups.emplace_back(row_count - group_rows, group_rows);
+        header_columns = make_header_columns();
+        argument_columns.clear();
+        group_rows = 0;
+    };
+
+    thread_local print_scratch scratch;
+    std::string text;
+    for (auto msg : messages)
+    {
+        if (config.filter && !filter_accepts(*config.filter, config.begin_timestamp, msg)) {
+            continue;
+        }
+        if (!tbb::reader::decode_record(msg, scratch)) {
+            continue;
+        }
+        const auto& params = scratch.params;
+        assert(params.size() > 3);
+
+        assign_site_key(key, {params[0].value.utf8_, params[1].value.utf8_, params[2].value.u32_, params[3].value.utf8_});
+        key += '\0';
+        for (size_t k = 4; k < params.size(); ++k) {
+            key += (char)params[k].type;
+        }
+        auto site = site_ids.find(key);
+        if (site == site_ids.end()) {
+            site = site_ids.emplace(key, (uint32_t)sites.size()).first;
+            columnar_site info = {params[0].value.utf8_, params[1].value.utf8_, params[2].value.u32_, params[3].value.utf8_, {}};
+            for (size_t k = 4; k < params.size(); ++k) {
+                info.arg_types.push_back(params[k].type);
+            }
+            sites.push_back(std::move(info));
+        }
+        const uint32_t site_id = site->second;
+
+        header_columns[0].add_unsigned(msg->timestamp);
+        header_columns[1].add_unsigned(msg->process_id);
+        header_columns[2].add_unsigned(msg->thread_id);
+        header_columns[3].add_unsigned(site_id);
+        for (size_t k = 4; k < params.size(); ++k)
+        {
+            const uint32_t slot = uint32_t(k - 4);
+            auto column = argument_columns.find(std::make_pair(site_id, slot));
+            if (column == argument_columns.end()) {
+                column = argument_columns.emplace(std::make_pair(site_id, slot),
+                    column_chunk(column_kind::argument, site_id, slot, params[k].type, argument_encoding(params[k].type))).first;
+            }
+            add_argument(column->second, params[k], text);
+        }
+
+        ++row_count;
+        if (++group_rows == COLUMNAR_GROUP_ROWS) {
+            flush_group();
+        }
+        writer.maybe_flush();
+    }
+    flush_group();
+
+    std::string footer;
+    put<uint64_t>(footer, config.begin_timestamp);
+    put<uint64_t>(footer, row_count);
+    put<uint32_t>(footer, (uint32_t)sites.size());
+    for (const auto& site : sites)
+    {
+        put_string(footer, site.function);
+        put_string(footer, site.file);
+        put<uint32_t>(footer, site.line);
+        put_string(footer, site.format_string);
+        put<uint32_t>(footer, (uint32_t)site.arg_types.size());
+        for (auto type : site.arg_types) {
+            put<uint8_t>(footer, (uint8_t)type);
+        }
+    }
+    put<uint32_t>(footer, (uint32_t)row_groups.size());
+    for (const auto& group : row_groups)
+    {
+        put<uint64_t>(footer, group.first);
+        put<uint32_t>(footer, group.second);
+    }
+    put<uint32_t>(footer, (uint32_t)directory.size());
+    for (const auto& entry : directory)
+    {
+        put<uint32_t>(footer, entry.row_group);
+        put<uint8_t>(footer, (uint8_t)entry.kind);
+        put<uint32_t>(footer, entry.site);
+        put<uint32_t>(footer, entry.slot);
+        put<uint8_t>(footer, (uint8_t)entry.type);
+        put<uint8_t>(footer, (uint8_t)entry.encoding);
+        put<uint64_t>(footer, entry.offset);
+        put<uint64_t>(footer, entry.size);
+        put<uint32_t>(footer, entry.count);
+        put<uint64_t>(footer, entry.min);
+        put<uint64_t>(footer, entry.max);
+    }
+
+    // readers find the footer from the end of the file
+    const uint64_t footer_offset = written;
+    put<uint64_t>(footer, footer_offset);
+    footer.append(COLUMNAR_MAGIC, sizeof(COLUMNAR_MAGIC));
+    write(footer);
+}
+
+// statistics
+
+// inter-arrival times fall into 1-2-5 buckets from 1us to 100s, plus one
+// below and one above
+static const uint64_t INTERARRIVAL_BOUNDS[] = {
+    1000ull, 2000ull, 5000ull,
+    10000ull, 20000ull, 50000ull,
+    100000ull, 200000ull, 500000ull,
+    1000000ull, 2000000ull, 5000000ull,
+    10000000ull, 20000000ull, 50000000ull,
+    100000000ull, 200000000ull, 500000000ull,
+    1000000000ull, 2000000000ull, 5000000000ull,
+    10000000000ull, 20000000000ull, 50000000000ull,
+    100000000000ull,
+};
+static const size_t INTERARRIVAL_BUCKETS = sizeof(INTERARRIVAL_BOUNDS) / sizeof(INTERARRIVAL_BOUNDS[0]) + 1;
+
+static std::string format_duration(uint64_t nanoseconds)
+{
+    if (nanoseconds >= 1000000000ull) {
+        return fmt::format("{}s", nanoseconds / 1000000000ull);
+    } else if (nanoseconds >= 1000000ull) {
+        return fmt::format("{}ms", nanoseconds / 1000000ull);
+    }
+    return fmt::format("{}us", nanoseconds / 1000ull);
+}
+
+struct site_stats
+{
+    // points into the site's first message
+    log_site site;
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t last_timestamp;
+    std::vector<uint64_t> rate;
+    uint64_t interarrival[INTERARRIVAL_BUCKETS];
+    std::map<uint32_t, uint64_t> processes;
+    std::map<std::pair<uint32_t, uint32_t>, uint64_t> threads;
+};
+
+// the messages are in timestamp order, so each site's inter-arrival times
+// come from consecutive messages of that site
+void print_stats(const print_config& config, const std::vector<const message*>& messages, size_t rate_buckets)
+{
+    std::vector<const message*> accepted;
+    uint64_t first_timestamp = 0;
+    uint64_t last_timestamp = 0;
+    for (auto msg : messages)
+    {
+        if (config.filter && !filter_accepts(*config.filter, config.begin_timestamp, msg)) {
+            continue;
+        }
+        if (accepted.empty()) {
+            first_timestamp = msg->timestamp;
+        }
+        last_timestamp = msg->timestamp;
+        accepted.push_back(msg);
+    }
+    const uint64_t bucket_width = (last_timestamp - first_timestamp) / rate_buckets + 1;
+
+    std::vector<site_stats> sites;
+    std::unordered_map<std::string, size_t> site_ids;
+    std::string key;
+    uint64_t total_bytes = 0;
+    for (auto msg : accepted)
+    {
+        const log_site site = locate_site(msg);
+        assign_site_key(key, site);
+        auto id = site_ids.find(key);
+        if (id == site_ids.end()) {
+            id = site_ids.emplace(key, sites.size()).first;
+            sites.emplace_back();
+            auto& stats = sites.back();
+            stats.site = site;
+            stats.count = 0;
+            stats.bytes = 0;
+            stats.last_timestamp = 0;
+            stats.rate.resize(rate_buckets);
+            std::fill(std::begin(stats.interarrival), std::end(stats.interarrival), 0);
+        }
+
+        auto& stats = sites[id->second];
+        if (stats.count > 0) {
+            const uint64_t gap = msg->timestamp - stats.last_timestamp;
+            stats.interarrival[std::upper_bound(std::begin(INTERARRIVAL_BOUNDS), std::end(INTERARRIVAL_BOUNDS), gap) -
+                               std::begin(INTERARRIVAL_BOUNDS)]++;
+        }
+        stats.count++;
+        stats.bytes += msg->length;
+        stats.last_timestamp = msg->timestamp;
+        stats.rate[(msg->timestamp - first_timestamp) / bucket_width]++;
+        stats.processes[msg->process_id]++;
+        stats.threads[std::make_pair(msg->process_id, msg->thread_id)]++;
+        total_bytes += msg->length;
+    }
+
+    // hottest sites first
+    std::vector<const site_stats*> order;
+    for (const auto& stats : sites) {
+        order.push_back(&stats);
+    }
+    std::stable_sort(order.begin(), order.end(), [](const site_stats* a, const site_stats* b) {
+        return a->count > b->count;
+    });
+
+    const double seconds = (last_timestamp - first_timestamp) / 1e9;
+
+    fprintf(config.out_file, "Statistics (%zu messages, %llu bytes, %zu sites, %.6fs):\n",
+        accepted.size(), (unsigned long long)total_bytes, sites.size(), seconds);
+    for (auto stats : order)
+    {
+        fprintf(config.out_file, "%s in %s:%u \"%s\"\n",
+            stats->site.function,
+            strlen(stats->site.file) < config.filename_offset ? "(nil)" : stats->site.file + config.filename_offset,
+            stats->site.line,
+            stats->site.format_string);
+        fprintf(config.out_file, "  count=%llu (%.1f%%) bytes=%llu (%.1f%%) mean=%.1fB\n",
+            (unsigned long long)stats->count,
+            100.0 * stats->count / accepted.size(),
+            (unsigned long long)stats->bytes,
+            100.0 * stats->bytes / total_bytes,
+            (double)stats->bytes / stats->count);
+
+        // rate over time as message counts per bucket, small rates don't survive as msg/s
+        fprintf(config.out_file, "  rate=%.1f/s, per %.6fs:", seconds > 0 ? stats->count / seconds : 0.0, bucket_width / 1e9);
+        for (auto count : stats->rate) {
+            fprintf(config.out_file, " %llu", (unsigned long long)count);
+        }
+        fprintf(config.out_file, "\n");
+
+        if (stats->count > 1) {
+            fprintf(config.out_file, "  inter-arrival:");
+            for (size_t k = 0; k < INTERARRIVAL_BUCKETS; ++k) {
+                if (stats->interarrival[k] == 0) {
+                    continue;
+                }
+                if (k == 0) {
+                    fprintf(config.out_file, " <%s:", format_duration(INTERARRIVAL_BOUNDS[0]).c_str());
+                } else if (k == INTERARRIVAL_BUCKETS - 1) {
+                    fprintf(config.out_file, " >=%s:", format_duration(INTERARRIVAL_BOUNDS[k - 1]).c_str());
+                } else {
+                    fprintf(config.out_file, " [%s,%s):",
+                        format_duration(INTERARRIVAL_BOUNDS[k - 1]).c_str(),
+                        format_duration(INTERARRIVAL_BOUNDS[k]).c_str());
+                }
+                fprintf(config.out_file, "%llu", (unsigned long long)stats->interarrival[k]);
+            }
+            fprintf(config.out_file, "\n");
+        }
+
+        fprintf(config.out_file, "  processes:");
+        for (const auto& process : stats->processes) {
+            fprintf(config.out_file, " %s=%llu", process_name(process.first).c_str(), (unsigned long long)process.second);
+        }
+        fprintf(config.out_file, "\n");
+
+        fprintf(config.out_file, "  threads:");
+        for (const auto& thread : stats->threads) {
+            fprintf(config.out_file, " %s/%u=%llu",
+                process_name(thread.first.first).c_str(),
+                thread.first.second,
+                (unsigned long long)thread.second);
+        }
+        fprintf(config.out_file, "\n");
+    }
+}
+
+// benchmark
+
+// each stage runs as its own pass over every message, ingest and sort on a
+// thread per core as usual and the rest on one thread; decoding is timed on
+// its own and taken out of the format pass, which decodes again
+void benchmark_stages(print_config& config, const std::vector<std::string>& log_bins,
+                      const std::vector<mapped_file>& mapped_logs, uint64_t map_nanoseconds)
+{
+    using tbb::internal::get_timestamp;
+
+    struct stage
+    {
+        const char* name;
+        uint64_t nanoseconds;
+        uint64_t bytes;
+    };
+
+    uint64_t begin = get_timestamp();
+    std::vector<sorted_run> runs;
+    ingest_runs(config, log_bins, mapped_logs, runs);
+    uint64_t input_bytes = 0;
+    uint64_t begin_timestamp = UINT64_MAX;
+    for (const auto& run : runs)
+    {
+        for (auto msg : run.messages)
+        {
+            input_bytes += msg->length;
+        }
+        begin_timestamp = std::min(begin_timestamp, run.begin_timestamp);
+    }
+    const stage ingest = {"ingest", map_nanoseconds + get_timestamp() - begin, input_bytes};
+    if (begin_timestamp != UINT64_MAX) {
+        config.begin_timestamp = begin_timestamp;
+    }
+
+    begin = get_timestamp();
+    std::vector<const message*> messages;
+    sort_runs(config, mapped_logs, runs);
+    merge_runs(runs, messages);
+    const stage sort = {"sort", get_timestamp() - begin, input_bytes};
+
+    begin = get_timestamp();
+    print_scratch scratch;
+    size_t param_count = 0;
+    for (auto msg : messages)
+    {
+        tbb::reader::decode_record(msg, scratch);
+        param_count += scratch.params.size();
+    }
+    const stage decode = {"decode", get_timestamp() - begin, input_bytes};
+
+    // the writer is flushed here rather than by the pipeline so writes can be timed apart
+    auto& writer = *config.writer;
+    uint64_t write_nanoseconds = 0;
+    uint64_t output_bytes = 0;
+    auto flush = [&]() {
+        output_bytes += writer.buffer().size();
+        const uint64_t write_begin = get_timestamp();
+        writer.flush();
+        write_nanoseconds += get_timestamp() - write_begin;
+    };
+    begin = get_timestamp();
+    for (auto msg : messages)
+    {
+        print_msg(config, msg);
+        if (writer.buffer().size() >= output_writer::FLUSH_BYTES) {
+            flush();
+        }
+    }
+    flush();
+    const uint64_t format_pass = get_timestamp() - begin - write_nanoseconds;
+    const stage format = {"format", format_pass > decode.nanoseconds ? format_pass - decode.nanoseconds : 0, input_bytes};
+    const stage write = {"write", write_nanoseconds, output_bytes};
+
+    const stage stages[] = {ingest, sort, decode, format, write};
+    uint64_t total_nanoseconds = 0;
+    for (const auto& current : stages) {
+        total_nanoseconds += current.nanoseconds;
+    }
+
+    fprintf(stderr, "Benchmark (%zu messages, %zu params, %.1f MB in, %.1f MB out):\n",
+        messages.size(), param_count, input_bytes / 1e6, output_bytes / 1e6);
+    for (const auto& current : stages) {
+        const double seconds = current.nanoseconds / 1e9;
+        fprintf(stderr, "  %-8s %9.3fs %12.0f msg/s %8.3f GB/s\n",
+            current.name,
+            seconds,
+            seconds > 0 ? messages.size() / seconds : 0.0,
+            seconds > 0 ? current.bytes / seconds / 1e9 : 0.0);
+    }
+    fprintf(stderr, "  %-8s %9.3fs %12.0f msg/s %8.3f GB/s\n",
+        "total",
+        total_nanoseconds / 1e9,
+        total_nanoseconds > 0 ? messages.size() / (total_nanoseconds / 1e9) : 0.0,
+        total_nanoseconds > 0 ? input_bytes / (total_nanoseconds / 1e9) / 1e9 : 0.0);
+}
+
+// diff
+
+// a capture is a directory of .bin logs (or .tbba archives) or a single log,
+// directories are read in name order so a capture loads the same way each time
+static bool list_capture(const std::string& path, std::vector<std::string>& log_bins)
+{
+#ifdef _WIN32
+    const DWORD attributes = GetFileAttributesA(path.c_str());
+    if (attributes == INVALID_FILE_ATTRIBUTES) {
+        return false;
+    }
+    if (!(attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+        log_bins.push_back(path);
+        return true;
+    }
+    for (const char* pattern : {"\\*.bin", "\\*.tbba"})
+    {
+        WIN32_FIND_DATAA found;
+        HANDLE find = FindFirstFileA((path + pattern).c_str(), &found);
+        if (find != INVALID_HANDLE_VALUE) {
+            do {
+                log_bins.push_back(path + "\\" + found.cFileName);
+            } while (FindNextFileA(find, &found));
+            FindClose(find);
+        }
+    }
+#else
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+        return false;
+    }
+    if (!S_ISDIR(info.st_mode)) {
+        log_bins.push_back(path);
+        return true;
+    }
+    DIR* dir = opendir(path.c_str());
+    if (dir == nullptr) {
+        return false;
+    }
+    while (dirent* entry = readdir(dir)) {
+        const size_t len = strlen(entry->d_name);
+        if (is_log_name(entry->d_name) || (len > 5 && strcmp(entry->d_name + len - 5, ".tbba") == 0)) {
+            log_bins.push_back(path + "/" + entry->d_name);
+        }
+    }
+    closedir(dir);
+#endif
+    std::sort(log_bins.begin(), log_bins.end());
+    return true;
+}
+
+// a log site as matched between captures, copied out of the mappings
+struct diff_site_name
 {
-    const auto* head = str;
-    while(*str++ != (CharType)0);
-    return (str - head);
-}
+    std::string function;
+    std::string file;
+    std::string format_string;
+};
 
-struct fmt_param
+// one capture's messages from a log site, sites are numbered across both captures
+struct diff_site
 {
-    data_type type;
-    union {
-        char*     utf8_;
-        char16_t* utf16_;
-        char32_t* utf32_;
-        uint32_t  p32_;
-        uint64_t  p64_;
-        int8_t    i8_;
-        uint8_t   u8_;
-        int16_t   i16_;
-        uint16_t  u16_;
-        int32_t   i32_;
-        uint32_t  u32_;
-        int64_t   i64_;
-        uint64_t  u64_;
-        float     f32_;
-        double    f64_;
-    } value;
-
-    fmt_param()
-    : type(data_type::invalid)
-    , value({0})
-    { }
+    uint64_t count;
+    uint64_t last_timestamp;
+    // time from each of the site's messages to the next message on the same thread
+    uint64_t thread_time;
+    // time since the site's previous message, on any thread
+    std::vector<uint64_t> intervals;
+};
+
+struct diff_capture
+{
+    uint64_t message_count;
+    uint64_t first_timestamp;
+    uint64_t last_timestamp;
+    std::vector<diff_site> sites;
+    // gaps between a message and the next one on its thread, keyed by both sites
+    std::unordered_map<uint64_t, std::vector<uint64_t>> transitions;
+};
+
+struct diff_sites
+{
+    std::unordered_map<std::string, uint32_t> ids;
+    std::vector<diff_site_name> names;
+};
 
-    fmt_param(fmt_param&& that)
+// loads, sorts and merges a capture's logs like a plain aggregate run and
+// profiles its (filtered) messages
+static bool profile_capture(print_config& config, const std::string& path, diff_sites& sites, diff_capture& capture)
+{
+    std::vector<std::string> log_bins;
+    if (!list_capture(path, log_bins)) {
+        printf("Error opening capture: '%s'\n", path.c_str());
+        return false;
+    }
+    if (log_bins.empty()) {
+        printf("Error, no .bin logs or .tbba archives in capture: '%s'\n", path.c_str());
+        return false;
+    }
+    std::vector<mapped_file> mapped_logs;
+    for (const auto& log_bin : log_bins)
     {
-        ::memcpy(this, &that, sizeof(that));
-        new(&that) fmt_param();
+        mapped_file mapped;
+        if (!map_file(log_bin.c_str(), mapped)) {
+            printf("Error opening log file: '%s'\n", log_bin.c_str());
+            for (auto& current : mapped_logs) {
+                unmap_file(current);
+            }
+            return false;
+        }
+        mapped_logs.push_back(mapped);
     }
 
-    ~fmt_param()
+    std::vector<sorted_run> runs;
+    ingest_runs(config, log_bins, mapped_logs, runs);
+    uint64_t begin_timestamp = UINT64_MAX;
+    for (const auto& run : runs)
     {
-        // strings are copied to a new properly aligned buffer
-        if (type == data_type::utf8)  delete[] value.utf8_;
-        if (type == data_type::utf16) delete[] value.utf16_;
-        if (type == data_type::utf32) delete[] value.utf32_;
-        ::memset(this, 0x00, sizeof(*this));
+        begin_timestamp = std::min(begin_timestamp, run.begin_timestamp);
     }
-};
+    config.begin_timestamp = begin_timestamp != UINT64_MAX ? begin_timestamp : 0;
+    sort_runs(config, mapped_logs, runs);
+    std::vector<const message*> messages;
+    merge_runs(runs, messages);
 
-namespace fmt {
-    template<>
-    struct formatter<fmt_param> {
-        template <typename ParseContext>
-        constexpr auto parse(ParseContext &ctx)
-        {
-            // extract the format string
-            auto it = ctx.begin();
-            while (*it != '}') {
-                ++it;
-            }
-            std::stringstream ss;
-            ss << "{:" << std::string(ctx.begin(), it) << '}';
-            format_string = ss.str();
-            return it;
+    struct thread_state
+    {
+        uint32_t site;
+        uint64_t timestamp;
+    };
+    std::unordered_map<uint64_t, thread_state> threads;
+    std::string key;
+    capture.message_count = 0;
+    capture.first_timestamp = 0;
+    capture.last_timestamp = 0;
+    capture.sites.resize(sites.names.size());
+    for (auto msg : messages)
+    {
+        if (config.filter && !filter_accepts(*config.filter, config.begin_timestamp, msg)) {
+            continue;
+        }
+        if (capture.message_count++ == 0) {
+            capture.first_timestamp = msg->timestamp;
         }
+        capture.last_timestamp = msg->timestamp;
 
-        template <typename FormatContext>
-        auto format(const fmt_param &param, FormatContext &ctx)
-        {
-            auto ctx_begin = ctx.out();
-            switch(param.type) {
-                // string types
-                case data_type::utf8:
-                    return format_to(ctx_begin, format_string, param.value.utf8_);
-                    break;
-                case data_type::utf16:
-                {
-                    std::wstring_convert<std::codecvt_utf8_utf16<char16_t>, char16_t> conv;
-                    return format_to(ctx_begin, format_string, conv.to_bytes(param.value.utf16_));
-                    break;
-                }
-                case data_type::utf32:
-                {
-                    std::wstring_convert<std::codecvt_utf8<char32_t>, char32_t> conv;
-                    return format_to(ctx_begin, format_string, conv.to_bytes(param.value.utf32_));
-                }
-                // pointer types
-                case data_type::p32:
-                    return format_to(ctx_begin, "0x{:08x}", param.value.p32_);
-                case data_type::p64:
-                    return format_to(ctx_begin, "0x{:016x}", param.value.p64_);
-                // integer types
-                case data_type::i8:
-                    return format_to(ctx_begin, format_string, param.value.i8_);
-                case data_type::u8:
-                    return format_to(ctx_begin, format_string, param.value.u8_);
-                case data_type::i16:
-                    return format_to(ctx_begin, format_string, param.value.i16_);
-                case data_type::u16:
-                    return format_to(ctx_begin, format_string, param.value.u16_);
-                case data_type::i32:
-                    return format_to(ctx_begin, format_string, param.value.i32_);
-                case data_type::u32:
-                    return format_to(ctx_begin, format_string, param.value.u32_);
-                case data_type::i64:
-                    return format_to(ctx_begin, format_string, param.value.i64_);
-                case data_type::u64:
-                    return format_to(ctx_begin, format_string, param.value.u64_);
-                // float types
-                case data_type::f32:
-                    return format_to(ctx_begin, format_string, param.value.f32_);
-                case data_type::f64:
-                    return format_to(ctx_begin, format_string, param.value.f64_);
-                default:
-                    assert(!"Invalid data_type");
-                    return format_to(ctx_begin, "{}", "Invalid data_type");
-            }
+        const log_site site = locate_site(msg);
+        assign_site_key(key, site, false);
+        auto id = sites.ids.find(key);
+        if (id == sites.ids.end()) {
+            id = sites.ids.emplace(key, (uint32_t)sites.names.size()).first;
+            sites.names.push_back({site.function, site.file, site.format_string});
+        }
+        const uint32_t site_id = id->second;
+        if (site_id >= capture.sites.size()) {
+            capture.sites.resize(site_id + 1);
         }
 
-        std::string format_string;
+        auto& stats = capture.sites[site_id];
+        if (stats.count++ > 0) {
+            stats.intervals.push_back(msg->timestamp - stats.last_timestamp);
+        }
+        stats.last_timestamp = msg->timestamp;
+
+        const uint64_t thread_key = (uint64_t(msg->process_id) << 32) | msg->thread_id;
+        auto thread = threads.find(thread_key);
+        if (thread != threads.end()) {
+            const uint64_t gap = msg->timestamp - thread->second.timestamp;
+            capture.sites[thread->second.site].thread_time += gap;
+            capture.transitions[(uint64_t(thread->second.site) << 32) | site_id].push_back(gap);
+            thread->second = {site_id, msg->timestamp};
+        } else {
+            threads.emplace(thread_key, thread_state{site_id, msg->timestamp});
+        }
+    }
+
+    for (auto& mapped : mapped_logs)
+    {
+        unmap_file(mapped);
+    }
+    return true;
+}
+
+// nearest rank percentile of sorted values
+static uint64_t percentile(const std::vector<uint64_t>& sorted, uint32_t percent)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    const size_t rank = (sorted.size() * percent + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static std::string format_time(double nanoseconds)
+{
+    const double magnitude = nanoseconds < 0 ? -nanoseconds : nanoseconds;
+    if (magnitude >= 1e9) {
+        return fmt::format("{:.3f}s", nanoseconds / 1e9);
+    } else if (magnitude >= 1e6) {
+        return fmt::format("{:.3f}ms", nanoseconds / 1e6);
+    } else if (magnitude >= 1e3) {
+        return fmt::format("{:.3f}us", nanoseconds / 1e3);
+    }
+    return fmt::format("{:.0f}ns", nanoseconds);
+}
+
+static std::string format_time_change(int64_t nanoseconds)
+{
+    return (nanoseconds >= 0 ? "+" : "") + format_time((double)nanoseconds);
+}
+
+static std::string format_relative_change(double a, double b)
+{
+    if (a == b) {
+        return "0%";
+    } else if (a == 0) {
+        return "new";
+    } else if (b == 0) {
+        return "gone";
+    }
+    return fmt::format("{:+.1f}%", 100.0 * (b - a) / a);
+}
+
+// "p50 A -> B, p90 A -> B, p99 A -> B" of two sets of intervals, which are sorted here
+static std::string format_percentile_changes(std::vector<uint64_t>& a, std::vector<uint64_t>& b)
+{
+    std::sort(a.begin(), a.end());
+    std::sort(b.begin(), b.end());
+    std::string out;
+    for (uint32_t percent : {50u, 90u, 99u})
+    {
+        out += fmt::format("{}p{} {} -> {}", out.empty() ? "" : ", ", percent,
+            a.empty() ? "-" : format_time((double)percentile(a, percent)),
+            b.empty() ? "-" : format_time((double)percentile(b, percent)));
+    }
+    return out;
+}
+
+// sites are ranked by the change in thread time, the time from a site's
+// messages to their thread's next message, which is where a slower subsystem
+// shows up; transitions between consecutive sites on a thread are ranked by
+// the change in their total time
+bool diff_captures(print_config& config, const std::string& capture_a, const std::string& capture_b, size_t top)
+{
+    diff_sites sites;
+    diff_capture captures[2];
+    if (!profile_capture(config, capture_a, sites, captures[0]) ||
+        !profile_capture(config, capture_b, sites, captures[1])) {
+        return false;
+    }
+    for (auto& capture : captures) {
+        capture.sites.resize(sites.names.size());
+    }
+    const double seconds[2] = {
+        (captures[0].last_timestamp - captures[0].first_timestamp) / 1e9,
+        (captures[1].last_timestamp - captures[1].first_timestamp) / 1e9,
     };
 
-    // needed implementation of make_arg for fmt_param
-    namespace v5 {
-        namespace internal {
-            template<>
-            fmt::basic_format_arg<fmt::format_context> make_arg<fmt::format_context, fmt_param>(const fmt_param& param) {
-                fmt::basic_format_arg<fmt::format_context> retval;
-                retval.value_ = value<fmt::format_context>(param);
-                retval.type_ = custom_type;
-                return retval;
+    auto file_name = [&](const std::string& file) {
+        return file.size() < config.filename_offset ? "(nil)" : file.c_str() + config.filename_offset;
+    };
+    auto shown = [&](size_t count) {
+        return top == 0 ? count : std::min(top, count);
+    };
+
+    fprintf(config.out_file, "Diff of '%s' (%llu messages, %.6fs) and '%s' (%llu messages, %.6fs):\n",
+        capture_a.c_str(), (unsigned long long)captures[0].message_count, seconds[0],
+        capture_b.c_str(), (unsigned long long)captures[1].message_count, seconds[1]);
+
+    struct site_change
+    {
+        uint32_t site;
+        int64_t time_change;
+        int64_t count_change;
+    };
+    std::vector<site_change> site_changes;
+    for (uint32_t k = 0; k < sites.names.size(); ++k)
+    {
+        const auto& a = captures[0].sites[k];
+        const auto& b = captures[1].sites[k];
+        site_changes.push_back({k, int64_t(b.thread_time - a.thread_time), int64_t(b.count - a.count)});
+    }
+    std::stable_sort(site_changes.begin(), site_changes.end(), [](const site_change& a, const site_change& b) {
+        const uint64_t time_a = a.time_change < 0 ? -uint64_t(a.time_change) : uint64_t(a.time_change);
+        const uint64_t time_b = b.time_change < 0 ? -uint64_t(b.time_change) : uint64_t(b.time_change);
+        if (time_a != time_b) {
+            return time_a > time_b;
+        }
+        const uint64_t count_a = a.count_change < 0 ? -uint64_t(a.count_change) : uint64_t(a.count_change);
+        const uint64_t count_b = b.count_change < 0 ? -uint64_t(b.count_change) : uint64_t(b.count_change);
+        return count_a > count_b;
+    });
+
+    fprintf(config.out_file, "Sites by change in thread time (%zu of %zu):\n", shown(site_changes.size()), site_changes.size());
+    for (size_t k = 0; k < shown(site_changes.size()); ++k)
+    {
+        const auto& change = site_changes[k];
+        const auto& name = sites.names[change.site];
+        auto& a = captures[0].sites[change.site];
+        auto& b = captures[1].sites[change.site];
+        const double rate_a = seconds[0] > 0 ? a.count / seconds[0] : 0.0;
+        const double rate_b = seconds[1] > 0 ? b.count / seconds[1] : 0.0;
+        fprintf(config.out_file, "%s %s in %s \"%s\"\n",
+            format_time_change(change.time_change).c_str(),
+            name.function.c_str(),
+            file_name(name.file),
+            name.format_string.c_str());
+        fprintf(config.out_file, "  count %llu -> %llu (%s), rate %.1f/s -> %.1f/s (%s)\n",
+            (unsigned long long)a.count, (unsigned long long)b.count,
+            format_relative_change((double)a.count, (double)b.count).c_str(),
+            rate_a, rate_b, format_relative_change(rate_a, rate_b).c_str());
+        fprintf(config.out_file, "  thread time %s -> %s, interval %s\n",
+            format_time((double)a.thread_time).c_str(),
+            format_time((double)b.thread_time).c_str(),
+            format_percentile_changes(a.intervals, b.intervals).c_str());
+    }
+
+    struct transition_change
+    {
+        uint64_t key;
+        int64_t time_change;
+    };
+    std::vector<transition_change> transition_changes;
+    auto total = [](const std::vector<uint64_t>* gaps) {
+        uint64_t sum = 0;
+        if (gaps) {
+            for (auto gap : *gaps) {
+                sum += gap;
             }
         }
+        return sum;
+    };
+    auto find_gaps = [](diff_capture& capture, uint64_t key) -> std::vector<uint64_t>* {
+        auto found = capture.transitions.find(key);
+        return found != capture.transitions.end() ? &found->second : nullptr;
+    };
+    for (const auto& transition : captures[0].transitions)
+    {
+        transition_changes.push_back({transition.first,
+            int64_t(total(find_gaps(captures[1], transition.first)) - total(&transition.second))});
+    }
+    for (const auto& transition : captures[1].transitions)
+    {
+        if (captures[0].transitions.count(transition.first) == 0) {
+            transition_changes.push_back({transition.first, int64_t(total(&transition.second))});
+        }
+    }
+    // the maps are unordered, so ties are broken by the sites' numbers
+    std::sort(transition_changes.begin(), transition_changes.end(), [](const transition_change& a, const transition_change& b) {
+        const uint64_t time_a = a.time_change < 0 ? -uint64_t(a.time_change) : uint64_t(a.time_change);
+        const uint64_t time_b = b.time_change < 0 ? -uint64_t(b.time_change) : uint64_t(b.time_change);
+        if (time_a != time_b) {
+            return time_a > time_b;
+        }
+        return a.key < b.key;
+    });
+
+    fprintf(config.out_file, "Transitions by change in total time (%zu of %zu):\n",
+        shown(transition_changes.size()), transition_changes.size());
+    std::vector<uint64_t> none;
+    for (size_t k = 0; k < shown(transition_changes.size()); ++k)
+    {
+        const auto& change = transition_changes[k];
+        const auto& from = sites.names[change.key >> 32];
+        const auto& to = sites.names[change.key & 0xffffffff];
+        auto* a = find_gaps(captures[0], change.key);
+        auto* b = find_gaps(captures[1], change.key);
+        const uint64_t count_a = a ? a->size() : 0;
+        const uint64_t count_b = b ? b->size() : 0;
+        fprintf(config.out_file, "%s %s \"%s\" -> %s \"%s\"\n",
+            format_time_change(change.time_change).c_str(),
+            from.function.c_str(), from.format_string.c_str(),
+            to.function.c_str(), to.format_string.c_str());
+        fprintf(config.out_file, "  count %llu -> %llu (%s), mean %s -> %s, gap %s\n",
+            (unsigned long long)count_a, (unsigned long long)count_b,
+            format_relative_change((double)count_a, (double)count_b).c_str(),
+            count_a ? format_time((double)total(a) / count_a).c_str() : "-",
+            count_b ? format_time((double)total(b) / count_b).c_str() : "-",
+            format_percentile_changes(a ? *a : none, b ? *b : none).c_str());
     }
+    return true;
 }
 
-void print_msg(const print_config& config, const message* msg)
+// latency
+
+// latencies are counted in buckets a 32nd of a power of two wide, so
+// percentiles are within about 3% without keeping every latency
+const uint32_t LATENCY_SUB_BUCKET_BITS = 5;
+const uint32_t LATENCY_SUB_BUCKETS = 1u << LATENCY_SUB_BUCKET_BITS;
+const size_t LATENCY_BUCKETS = (64 - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS;
+
+static size_t latency_bucket(uint64_t nanoseconds)
+{
+    if (nanoseconds < LATENCY_SUB_BUCKETS) {
+        return (size_t)nanoseconds;
+    }
+    uint32_t exponent = LATENCY_SUB_BUCKET_BITS;
+    while (exponent < 63 && (nanoseconds >> (exponent + 1)) != 0) {
+        ++exponent;
+    }
+    const uint32_t shift = exponent - LATENCY_SUB_BUCKET_BITS;
+    return (shift + 1) * LATENCY_SUB_BUCKETS + (size_t)((nanoseconds >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+// the middle of the bucket's range
+static uint64_t latency_bucket_value(size_t bucket)
+{
+    if (bucket < LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+    const uint32_t shift = (uint32_t)(bucket / LATENCY_SUB_BUCKETS) - 1;
+    const uint64_t lowest = (uint64_t(LATENCY_SUB_BUCKETS) + bucket % LATENCY_SUB_BUCKETS) << shift;
+    return lowest + ((uint64_t(1) << shift) >> 1);
+}
+
+// a begin message waiting for its end
+struct latency_begin
 {
+    uint64_t timestamp;
+    uint32_t process_id;
+    uint32_t thread_id;
+};
+
+struct latency_pair
+{
+    uint64_t latency;
+    latency_begin begin;
+    latency_begin end;
+    std::string key;
+};
 
-    uint32_t len = msg->length;
-    const uint8_t* head = reinterpret_cast<const uint8_t*>(msg);
-    const uint8_t* tail = head + len;
-    head += sizeof(message);
+static bool slower_pair(const latency_pair& a, const latency_pair& b)
+{
+    if (a.latency != b.latency) {
+        return a.latency > b.latency;
+    }
+    return a.begin.timestamp < b.begin.timestamp;
+}
 
-    // serialize raw message buffer to list of fmt_params
-    std::vector<fmt_param> fmt_params;
-    for(int i = 0; head < tail; ++i)
+// a format argument's value as text, so a key logged as an i32 at the begin
+// site and a u64 at the end site still matches
+static bool append_latency_key(std::string& key, const fmt_param& param)
+{
+    switch(param.type)
     {
-        fmt_param current_fmt_param;
-        current_fmt_param.type = (data_type)*head;
-        assert(current_fmt_param.type != data_type::invalid);
-        head += sizeof(current_fmt_param.type);
-        switch(current_fmt_param.type)
+        case data_type::utf8: key += param.value.utf8_; return true;
+        case data_type::utf16: append_utf16(key, param.value.utf16_); return true;
+        case data_type::utf32: append_utf32(key, param.value.utf32_); return true;
+        case data_type::p32: append_uint(key, param.value.p32_); return true;
+        case data_type::p64: append_uint(key, param.value.p64_); return true;
+        case data_type::u8: append_uint(key, param.value.u8_); return true;
+        case data_type::u16: append_uint(key, param.value.u16_); return true;
+        case data_type::u32: append_uint(key, param.value.u32_); return true;
+        case data_type::u64: append_uint(key, param.value.u64_); return true;
+        case data_type::i8:
+        case data_type::i16:
+        case data_type::i32:
+        case data_type::i64:
         {
-            default:
-                assert(!"Invalid data_type");
-                break;
-            case data_type::utf8:
-            {
-                const size_t len = string_length(reinterpret_cast<const char*>(head));
-                current_fmt_param.value.utf8_ = new char[len];
-                ::memcpy(current_fmt_param.value.utf8_, head, len * sizeof(char));
-                head += len * sizeof(char);
-                break;
+            const int64_t value = param.type == data_type::i8 ? param.value.i8_ :
+                                  param.type == data_type::i16 ? param.value.i16_ :
+                                  param.type == data_type::i32 ? param.value.i32_ : param.value.i64_;
+            if (value < 0) {
+                key += '-';
             }
-            case data_type::utf16:
-            {
-                const size_t len = string_length(reinterpret_cast<const char16_t*>(head));
-                current_fmt_param.value.utf16_ = new char16_t[len];
-                ::memcpy(current_fmt_param.value.utf16_, head, len * sizeof(char16_t));
-                head += len * sizeof(char16_t);
-                break;
+            append_uint(key, value < 0 ? -uint64_t(value) : uint64_t(value));
+            return true;
+        }
+        case data_type::f32: key += fmt::format("{}", param.value.f32_); return true;
+        case data_type::f64: key += fmt::format("{}", param.value.f64_); return true;
+        default: return false;
+    }
+}
+
+// messages come from a merged_reader in timestamp order; an end closes the
+// most recent open begin of its thread (or key), so nested pairs on a thread
+// match up like scopes
+void print_latency(print_config& config, const std::vector<mapped_file>& mapped_logs, size_t reorder_window,
+                   const latency_query& query, size_t top)
+{
+    tbb::reader::merged_reader reader(mapped_logs, reorder_window);
+    std::vector<stream_release> releases(mapped_logs.size(), stream_release{0, 0});
+    if (reader.peek() != nullptr) {
+        config.begin_timestamp = reader.peek()->timestamp;
+    }
+
+    enum : uint8_t { MATCHES_NONE = 0, MATCHES_BEGIN = 1, MATCHES_END = 2 };
+    std::unordered_map<std::string, uint8_t> site_matches;
+    std::unordered_map<std::string, std::vector<latency_begin>> open;
+    std::vector<uint64_t> buckets(LATENCY_BUCKETS, 0);
+    uint64_t histogram[INTERARRIVAL_BUCKETS] = {};
+    // a min heap of the slowest pairs
+    std::vector<latency_pair> slowest;
+    uint64_t pair_count = 0;
+    uint64_t total = 0;
+    uint64_t minimum = UINT64_MAX;
+    uint64_t maximum = 0;
+    uint64_t unmatched_ends = 0;
+    uint64_t missing_keys = 0;
+
+    tbb::reader::decoded_record record;
+    std::string site_key;
+    std::string key;
+    size_t file = 0;
+    while (const message* msg = reader.next(&file))
+    {
+        release_consumed(reader, file, mapped_logs[file], releases[file], []() {});
+        if (config.filter && !filter_accepts(*config.filter, config.begin_timestamp, msg)) {
+            continue;
+        }
+
+        const log_site site = locate_site(msg);
+        assign_site_key(site_key, site);
+        auto match = site_matches.find(site_key);
+        if (match == site_matches.end()) {
+            const uint8_t matches = (matches_pattern(query.begin, site.format_string) ? MATCHES_BEGIN : MATCHES_NONE) |
+                                    (matches_pattern(query.end, site.format_string) ? MATCHES_END : MATCHES_NONE);
+            match = site_matches.emplace(site_key, matches).first;
+        }
+        if (match->second == MATCHES_NONE) {
+            continue;
+        }
+
+        key.clear();
+        if (query.has_key) {
+            const size_t argument = 4 + query.key_argument;
+            if (!tbb::reader::decode_record(msg, record) || argument >= record.params.size() ||
+                !append_latency_key(key, record.params[argument])) {
+                missing_keys++;
+                continue;
             }
-            case data_type::utf32:
-            {
-                const size_t len = string_length(reinterpret_cast<const char32_t*>(head));
-                current_fmt_param.value.utf32_ = new char32_t[len];
-                ::memcpy(current_fmt_param.value.utf32_, head, len * sizeof(char32_t));
-                head += len * sizeof(char32_t);
-                break;
+        } else {
+            key.append(reinterpret_cast<const char*>(&msg->process_id), sizeof(msg->process_id));
+            key.append(reinterpret_cast<const char*>(&msg->thread_id), sizeof(msg->thread_id));
+        }
+
+        const latency_begin current = {msg->timestamp, msg->process_id, msg->thread_id};
+        auto waiting = open.find(key);
+        // a site matching both patterns ends an open pair before it begins one
+        if ((match->second & MATCHES_END) && waiting != open.end()) {
+            const latency_begin begin = waiting->second.back();
+            waiting->second.pop_back();
+            if (waiting->second.empty()) {
+                open.erase(waiting);
             }
-            case data_type::p32:
-                current_fmt_param.value.p32_ = *reinterpret_cast<const uint32_t*>(head);
-                head += sizeof(uint32_t);
-                break;
-            case data_type::p64:
-                current_fmt_param.value.p64_ = *reinterpret_cast<const uint64_t*>(head);
-                head += sizeof(uint64_t);
-                break;
-            case data_type::i8:
-                current_fmt_param.value.i8_ = *reinterpret_cast<const int8_t*>(head);
-                head += sizeof(int8_t);
-                break;
-            case data_type::u8:
-                current_fmt_param.value.u8_ = *reinterpret_cast<const uint8_t*>(head);
-                head += sizeof(uint8_t);
-                break;
-            case data_type::i16:
-                current_fmt_param.value.i16_ = *reinterpret_cast<const int16_t*>(head);
-                head += sizeof(int16_t);
-                break;
-            case data_type::u16:
-                current_fmt_param.value.u16_ = *reinterpret_cast<const uint16_t*>(head);
-                head += sizeof(uint16_t);
-                break;
-            case data_type::i32:
-                current_fmt_param.value.i32_ = *reinterpret_cast<const int32_t*>(head);
-                head += sizeof(int32_t);
-                break;
-            case data_type::u32:
-                current_fmt_param.value.u32_ = *reinterpret_cast<const uint32_t*>(head);
-                head += sizeof(uint32_t);
-                break;
-            case data_type::i64:
-                current_fmt_param.value.i64_ = *reinterpret_cast<const int64_t*>(head);
-                head += sizeof(int64_t);
-                break;
-            case data_type::u64:
-                current_fmt_param.value.u64_ = *reinterpret_cast<const uint64_t*>(head);
-                head += sizeof(uint64_t);
-                break;
-            case data_type::f32:
-                current_fmt_param.value.f32_ = *reinterpret_cast<const float*>(head);
-                head += sizeof(float);
-                break;
-            case data_type::f64:
-                current_fmt_param.value.f64_ = *reinterpret_cast<const double*>(head);
-                head += sizeof(double);
-                break;
+
+            const uint64_t latency = current.timestamp - begin.timestamp;
+            pair_count++;
+            total += latency;
+            minimum = std::min(minimum, latency);
+            maximum = std::max(maximum, latency);
+            buckets[latency_bucket(latency)]++;
+            histogram[std::upper_bound(std::begin(INTERARRIVAL_BOUNDS), std::end(INTERARRIVAL_BOUNDS), latency) -
+                      std::begin(INTERARRIVAL_BOUNDS)]++;
+
+            if (top == 0 || slowest.size() < top) {
+                slowest.push_back({latency, begin, current, query.has_key ? key : std::string()});
+                std::push_heap(slowest.begin(), slowest.end(), slower_pair);
+            } else if (latency > slowest.front().latency) {
+                std::pop_heap(slowest.begin(), slowest.end(), slower_pair);
+                slowest.back() = {latency, begin, current, query.has_key ? key : std::string()};
+                std::push_heap(slowest.begin(), slowest.end(), slower_pair);
+            }
+        } else if (match->second & MATCHES_BEGIN) {
+            open[key].push_back(current);
+        } else {
+            unmatched_ends++;
         }
-        fmt_params.push_back(std::move(current_fmt_param));
     }
 
-    assert(fmt_params.size() > 3);
-    assert(fmt_params[0].type == data_type::utf8);
-    assert(fmt_params[1].type == data_type::utf8);
-    assert(fmt_params[2].type == data_type::u32);
-    assert(fmt_params[3].type == data_type::utf8);
+    uint64_t unmatched_begins = 0;
+    for (const auto& waiting : open) {
+        unmatched_begins += waiting.second.size();
+    }
 
-    // now format the output
-    uint64_t timestamp = msg->timestamp - config.begin_timestamp;
-    double seconds = timestamp / 1000000000.0;
-    auto childid = msg->process_id;
-    auto threadid = msg->thread_id;
-    auto function = fmt_params[0].value.utf8_;
-    auto filename = [&]() {
-        try {
-            return std::string(fmt_params[1].value.utf8_).substr(config.filename_offset);
-        } catch(...) {
-            return std::string("(nil)");
+    fprintf(config.out_file, "Latency from \"%s\" to \"%s\" %s (%llu pairs, %llu begins without an end, %llu ends without a begin",
+        query.begin.pattern.c_str(),
+        query.end.pattern.c_str(),
+        query.has_key ? fmt::format("by argument {}", query.key_argument).c_str() : "per thread",
+        (unsigned long long)pair_count,
+        (unsigned long long)unmatched_begins,
+        (unsigned long long)unmatched_ends);
+    if (query.has_key) {
+        fprintf(config.out_file, ", %llu without the argument", (unsigned long long)missing_keys);
+    }
+    fprintf(config.out_file, "):\n");
+
+    if (pair_count > 0) {
+        // percentiles in tenths of a percent
+        auto percentile = [&](uint64_t permille) {
+            const uint64_t rank = std::max<uint64_t>(1, (pair_count * permille + 999) / 1000);
+            uint64_t seen = 0;
+            for (size_t k = 0; k < LATENCY_BUCKETS; ++k) {
+                seen += buckets[k];
+                if (seen >= rank) {
+                    return std::min(std::max(latency_bucket_value(k), minimum), maximum);
+                }
+            }
+            return maximum;
+        };
+        fprintf(config.out_file, "  min %s, mean %s, max %s\n",
+            format_time((double)minimum).c_str(),
+            format_time((double)total / pair_count).c_str(),
+            format_time((double)maximum).c_str());
+        fprintf(config.out_file, "  p50 %s, p90 %s, p99 %s, p99.9 %s\n",
+            format_time((double)percentile(500)).c_str(),
+            format_time((double)percentile(900)).c_str(),
+            format_time((double)percentile(990)).c_str(),
+            format_time((double)percentile(999)).c_str());
+
+        const uint64_t most = *std::max_element(std::begin(histogram), std::end(histogram));
+        fprintf(config.out_file, "Histogram:\n");
+        for (size_t k = 0; k < INTERARRIVAL_BUCKETS; ++k) {
+            if (histogram[k] == 0) {
+                continue;
+            }
+            std::string range;
+            if (k == 0) {
+                range = "<" + format_duration(INTERARRIVAL_BOUNDS[0]);
+            } else if (k == INTERARRIVAL_BUCKETS - 1) {
+                range = ">=" + format_duration(INTERARRIVAL_BOUNDS[k - 1]);
+            } else {
+                range = "[" + format_duration(INTERARRIVAL_BOUNDS[k - 1]) + "," + format_duration(INTERARRIVAL_BOUNDS[k]) + ")";
+            }
+            fprintf(config.out_file, "  %-12s %10llu %s\n",
+                range.c_str(),
+                (unsigned long long)histogram[k],
+                std::string(size_t((histogram[k] * 50 + most - 1) / most), '#').c_str());
         }
-    }();
-    auto line = fmt_params[2].value.u32_;
+    }
 
-    if (!(config.options & OPTIONS_HIDE_TIMESTAMP)) {
-        fprintf(config.out_file, "[%f]", seconds);
+    std::sort(slowest.begin(), slowest.end(), slower_pair);
+    if (!slowest.empty()) {
+        fprintf(config.out_file, "Slowest %zu:\n", slowest.size());
     }
-    if (!(config.options & OPTIONS_HIDE_CHILDID)) {
-        if (childid == 0) {
-            fprintf(config.out_file, "[Parent]");
-        } else {
-            fprintf(config.out_file, "[Child%u]", childid);
+    std::string line;
+    for (const auto& pair : slowest)
+    {
+        line = "  " + format_time((double)pair.latency) + " [";
+        append_timestamp(line, pair.begin.timestamp - config.begin_timestamp);
+        line += "][";
+        append_process_name(line, pair.begin.process_id);
+        line += "][" + std::to_string(pair.begin.thread_id) + "] -> [";
+        append_timestamp(line, pair.end.timestamp - config.begin_timestamp);
+        line += "][";
+        append_process_name(line, pair.end.process_id);
+        line += "][" + std::to_string(pair.end.thread_id) + "]";
+        if (query.has_key) {
+            line += " key=" + pair.key;
         }
+        fprintf(config.out_file, "%s\n", line.c_str());
     }
-    if (!(config.options & OPTIONS_HIDE_THREADID)) {
-        fprintf(config.out_file, "[%u]", threadid);
+
+    if (reader.malformed() != 0) {
+        fprintf(stderr, "Skipped %zu malformed records\n", reader.malformed());
     }
-    if (!(config.options & OPTIONS_HIDE_LOGSITE)) {
-        fprintf(config.out_file, " %s in %s:%u ", function, filename.c_str(), line);
+    report_unread(reader, mapped_logs);
+    const size_t out_of_order = reader.out_of_order();
+    if (out_of_order != 0) {
+        fprintf(stderr, "%zu messages were out of order by more than the reorder window, "
+                        "try a larger --reorder-window\n", out_of_order);
     }
+}
 
-    // format the user message
-    auto format_string = fmt_params[3].value.utf8_;
-    std::vector<fmt::basic_format_arg<fmt::format_context>> args;
-    for(size_t k = 4; k < fmt_params.size(); ++k) {
-        const auto& param = fmt_params[k];
-        args.push_back(fmt::internal::make_arg<fmt::format_context, fmt_param>(param));
+// repack
+
+// sites and threads are numbered in order of first appearance, and every
+// integer in a record becomes a varint, which is most of a record's bytes
+bool write_archive(const print_config& config, const std::vector<const message*>& messages, const std::string& path)
+{
+    using tbb::reader::ARCHIVE_MAGIC;
+    using tbb::reader::ARCHIVE_BLOCK_RECORDS;
+    using tbb::reader::archive_block;
+
+    std::vector<const message*> accepted;
+    for (auto msg : messages)
+    {
+        if (!config.filter || filter_accepts(*config.filter, config.begin_timestamp, msg)) {
+            accepted.push_back(msg);
+        }
     }
 
-    std::string user_msg;
-    try {
-        user_msg = fmt::vformat(format_string,
-                                fmt::basic_format_args<fmt::format_context>(args.data(), args.size()));
-    } catch(...) {
-        user_msg = fmt::format("Error processing format string: '{}'", format_string);
+    // written aside and renamed so a failed repack never leaves half an archive,
+    // and a block at a time so only one block is ever held encoded in memory
+    const std::string temp_path = path + ".tmp";
+    FILE* file = fopen(temp_path.c_str(), "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    std::string out(ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC));
+    uint64_t out_offset = 0;
+    bool written = true;
+    auto write_out = [&]() {
+        written = written && fwrite(out.data(), 1, out.size(), file) == out.size();
+        out_offset += out.size();
+        out.clear();
+    };
+
+    std::unordered_map<std::string, uint32_t> site_ids;
+    // each site's serialized params, as they're stored in the footer
+    std::vector<std::string> sites;
+    std::map<std::pair<uint32_t, uint32_t>, uint32_t> thread_ids;
+    std::vector<std::pair<uint32_t, uint32_t>> threads;
+    std::vector<archive_block> blocks;
+    uint64_t decoded_size = 0;
+    uint64_t input_bytes = 0;
+    std::string site_key;
+    std::string params;
+
+    for (size_t first = 0; first < accepted.size(); first += ARCHIVE_BLOCK_RECORDS)
+    {
+        const size_t last = std::min(accepted.size(), first + ARCHIVE_BLOCK_RECORDS);
+        archive_block block = {out_offset + out.size(), 0, decoded_size, uint32_t(last - first), UINT64_MAX, 0};
+        for (size_t k = first; k < last; ++k)
+        {
+            block.min_timestamp = std::min<uint64_t>(block.min_timestamp, accepted[k]->timestamp);
+            block.max_timestamp = std::max<uint64_t>(block.max_timestamp, accepted[k]->timestamp);
+        }
+
+        uint64_t previous = block.min_timestamp;
+        for (size_t k = first; k < last; ++k)
+        {
+            const message* msg = accepted[k];
+            const uint8_t* head = reinterpret_cast<const uint8_t*>(msg) + sizeof(message);
+            const uint8_t* tail = reinterpret_cast<const uint8_t*>(msg) + msg->length;
+            const log_site site = locate_site(msg);
+            const uint8_t* site_end = reinterpret_cast<const uint8_t*>(site.format_string) + strlen(site.format_string) + 1;
+
+            assign_site_key(site_key, site);
+            auto site_id = site_ids.find(site_key);
+            if (site_id == site_ids.end()) {
+                site_id = site_ids.emplace(site_key, (uint32_t)sites.size()).first;
+                sites.emplace_back(reinterpret_cast<const char*>(head), site_end - head);
+            }
+            auto thread_id = thread_ids.find(std::make_pair(msg->process_id, msg->thread_id));
+            if (thread_id == thread_ids.end()) {
+                thread_id = thread_ids.emplace(std::make_pair(msg->process_id, msg->thread_id), (uint32_t)threads.size()).first;
+                threads.push_back(thread_id->first);
+            }
+
+            params.clear();
+            uint64_t param_count = 0;
+            uint64_t decoded_length = sizeof(message) + sites[site_id->second].size();
+            for (head = site_end; head < tail; ++param_count)
+            {
+                const data_type type = (data_type)*head++;
+                // the records were validated as they were read
+                size_t size = 0;
+                tbb::reader::param_size(type, head, size_t(tail - head), size);
+                params += (char)type;
+                switch(type)
+                {
+                    case data_type::i8: put_varint(params, zigzag(load_unaligned<int8_t>(head))); break;
+                    case data_type::i16: put_varint(params, zigzag(load_unaligned<int16_t>(head))); break;
+                    case data_type::i32: put_varint(params, zigzag(load_unaligned<int32_t>(head))); break;
+                    case data_type::i64: put_varint(params, zigzag(load_unaligned<int64_t>(head))); break;
+                    case data_type::u8: put_varint(params, load_unaligned<uint8_t>(head)); break;
+                    case data_type::u16: put_varint(params, load_unaligned<uint16_t>(head)); break;
+                    case data_type::p32:
+                    case data_type::u32: put_varint(params, load_unaligned<uint32_t>(head)); break;
+                    case data_type::p64:
+                    case data_type::u64: put_varint(params, load_unaligned<uint64_t>(head)); break;
+                    default: params.append(reinterpret_cast<const char*>(head), size); break;
+                }
+                head += size;
+                decoded_length += sizeof(type) + size;
+            }
+
+            put_varint(out, site_id->second);
+            put_varint(out, msg->timestamp - previous);
+            put_varint(out, thread_id->second);
+            put_varint(out, param_count);
+            out += params;
+            previous = msg->timestamp;
+            decoded_size += decoded_length;
+            input_bytes += msg->length;
+        }
+        block.size = out_offset + out.size() - block.offset;
+        blocks.push_back(block);
+        write_out();
+    }
+
+    const uint64_t footer_offset = out_offset + out.size();
+    put<uint64_t>(out, accepted.size());
+    put<uint64_t>(out, decoded_size);
+    put<uint32_t>(out, (uint32_t)sites.size());
+    for (const auto& site : sites)
+    {
+        put_varint(out, site.size());
+        out += site;
+    }
+    put<uint32_t>(out, (uint32_t)threads.size());
+    for (const auto& thread : threads)
+    {
+        put<uint32_t>(out, thread.first);
+        put<uint32_t>(out, thread.second);
+    }
+    put<uint32_t>(out, (uint32_t)blocks.size());
+    for (const auto& block : blocks)
+    {
+        put<uint64_t>(out, block.offset);
+        put<uint64_t>(out, block.size);
+        put<uint64_t>(out, block.decoded_offset);
+        put<uint32_t>(out, block.count);
+        put<uint64_t>(out, block.min_timestamp);
+        put<uint64_t>(out, block.max_timestamp);
+    }
+    put<uint64_t>(out, footer_offset);
+    out.append(ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC));
+    write_out();
+
+    if (fclose(file) != 0 || !written) {
+        remove(temp_path.c_str());
+        return false;
+    }
+#ifdef _WIN32
+    remove(path.c_str());
+#endif
+    if (rename(temp_path.c_str(), path.c_str()) != 0) {
+        return false;
     }
 
-    fprintf(config.out_file, "%s\n", user_msg.data());
+    printf("%s: %zu records, %zu sites, %zu threads, %llu bytes of logs in %zu bytes\n",
+        path.c_str(), accepted.size(), sites.size(), threads.size(), (unsigned long long)input_bytes, (size_t)out_offset);
+    return true;
 }
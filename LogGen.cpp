@@ -0,0 +1,262 @@
+#include "TbbLogger.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+// C++
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+
+// Writes synthetic firefoxN.bin logs in the logger's record format, for
+// reproducible aggregate benchmarks without running a real workload.
+//
+// Build with `make gen_logs`, then for example
+// `bin/gen_logs --processes=8 --threads=4 --messages=250000 --out=bench`
+// followed by `bin/aggregate --benchmark bench/*.bin -o /dev/null`.
+
+using namespace tbb::serialization;
+
+struct gen_options
+{
+    size_t processes = 4;
+    size_t threads = 4;
+    size_t messages = 100000;
+    size_t sites = 64;
+    // relative weights of integer, floating point and string arguments
+    uint32_t int_weight = 4;
+    uint32_t float_weight = 2;
+    uint32_t string_weight = 1;
+    // percentage of string arguments which are utf16
+    uint32_t utf16_percent = 10;
+    // threads take their timestamp up to this long before their record is queued,
+    // which is what puts records out of order within a file
+    uint32_t disorder_us = 50;
+    // mean time between one thread's records
+    uint32_t interval_us = 5;
+    uint64_t seed = 1;
+    std::string out = ".";
+};
+
+static const char* const WORDS[] = {
+    "Paint", "Layout", "Reflow", "GC", "CC", "IPC", "Compositor", "Decode",
+    "Fetch", "Parse", "Script", "Style", "Raster", "Upload", "Timer", "Worker",
+};
+static const char* const STRINGS[] = {
+    "ok", "pending", "https://example.com/index.html", "content", "gpu", "main thread",
+    "a considerably longer string argument, as logged with a url or a message",
+};
+static const char16_t* const STRINGS16[] = {
+    u"ok", u"pending", u"https://example.com/index.html", u"content", u"gpu", u"main thread",
+    u"a considerably longer string argument, as logged with a url or a message",
+};
+static const char* const FILES[] = {
+    "dom/base/nsDocument.cpp", "layout/base/PresShell.cpp", "js/src/gc/GC.cpp",
+    "ipc/glue/MessageChannel.cpp", "gfx/layers/Compositor.cpp", "netwerk/base/nsNetUtil.cpp",
+};
+
+// a log site: where it is, its format string and the types of its arguments
+struct gen_site
+{
+    std::string function;
+    const char* file;
+    uint32_t line;
+    std::string format_string;
+    std::vector<data_type> arg_types;
+};
+
+static std::vector<gen_site> make_sites(const gen_options& options, std::mt19937_64& rng)
+{
+    const uint32_t total_weight = options.int_weight + options.float_weight + options.string_weight;
+    std::vector<gen_site> sites;
+    for(size_t k = 0; k < options.sites; ++k)
+    {
+        gen_site site;
+        site.function = std::string(WORDS[rng() % 16]) + "::" + WORDS[rng() % 16];
+        site.file = FILES[rng() % 6];
+        site.line = uint32_t(100 + rng() % 5000);
+        site.format_string = WORDS[rng() % 16];
+
+        const size_t arg_count = rng() % 5;
+        for(size_t j = 0; j < arg_count; ++j)
+        {
+            const uint32_t pick = total_weight > 0 ? uint32_t(rng() % total_weight) : 0;
+            if (pick < options.int_weight) {
+                static const data_type ints[] = {data_type::i32, data_type::u32, data_type::i64, data_type::u64};
+                const data_type type = ints[rng() % 4];
+                site.arg_types.push_back(type);
+                site.format_string += (type == data_type::u64) ? " {:x}" : " {}";
+            } else if (pick < options.int_weight + options.float_weight) {
+                const data_type type = (rng() % 2) ? data_type::f64 : data_type::f32;
+                site.arg_types.push_back(type);
+                site.format_string += (type == data_type::f64) ? " {:.3f}" : " {}";
+            } else {
+                site.arg_types.push_back(rng() % 100 < options.utf16_percent ? data_type::utf16 : data_type::utf8);
+                site.format_string += " '{}'";
+            }
+        }
+        sites.push_back(std::move(site));
+    }
+    return sites;
+}
+
+// a record waiting to be written, ordered by when it reached the queue
+struct gen_record
+{
+    uint64_t queued;
+    size_t offset;
+};
+
+static bool write_process(const gen_options& options, const std::vector<gen_site>& sites, size_t process, std::mt19937_64& rng)
+{
+    std::vector<uint8_t> data;
+    std::vector<gen_record> records;
+    records.reserve(options.threads * options.messages);
+
+    // site popularity is skewed like real logs, a few sites log most records
+    std::vector<double> weights;
+    for(size_t k = 0; k < sites.size(); ++k) {
+        weights.push_back(1.0 / (k + 1));
+    }
+    std::discrete_distribution<size_t> pick_site(weights.begin(), weights.end());
+    std::exponential_distribution<double> interval(1.0 / (options.interval_us * 1000.0 + 1.0));
+
+    const uint64_t start = 1000000000000ull;
+    for(size_t thread = 0; thread < options.threads; ++thread)
+    {
+        const uint32_t thread_id = uint32_t(10000 + process * 100 + thread);
+        uint64_t timestamp = start + rng() % 1000000;
+        for(size_t k = 0; k < options.messages; ++k)
+        {
+            timestamp += uint64_t(interval(rng)) + 1;
+            const gen_site& site = sites[pick_site(rng)];
+
+            arg_desc args[4 + 4];
+            size_t count = 0;
+            args[count++] = make_arg(site.function.c_str());
+            args[count++] = make_arg(site.file);
+            args[count++] = make_arg(site.line);
+            args[count++] = make_arg(site.format_string.c_str());
+            for(auto type : site.arg_types)
+            {
+                switch(type)
+                {
+                    case data_type::i32: args[count++] = make_arg(int32_t(rng() % 100000) - 50000); break;
+                    case data_type::u32: args[count++] = make_arg(uint32_t(rng() % 1000)); break;
+                    case data_type::i64: args[count++] = make_arg(int64_t(rng() >> 20) - (int64_t(1) << 42)); break;
+                    case data_type::u64: args[count++] = make_arg(uint64_t(rng())); break;
+                    case data_type::f32: args[count++] = make_arg(float(rng() % 10000) / 100.0f); break;
+                    case data_type::f64: args[count++] = make_arg(double(rng() % 1000000) / 1000.0); break;
+                    case data_type::utf16: args[count++] = make_arg(STRINGS16[rng() % 7]); break;
+                    default: args[count++] = make_arg(STRINGS[rng() % 7]); break;
+                }
+            }
+
+            const size_t size = msg_size(args, count);
+            const size_t offset = data.size();
+            data.resize(offset + size);
+            message* msg = reinterpret_cast<message*>(data.data() + offset);
+            write_msg(msg, args, count);
+            msg->process_id = uint32_t(process);
+            msg->thread_id = thread_id;
+            msg->timestamp = timestamp;
+
+            const uint64_t delay = options.disorder_us ? rng() % (options.disorder_us * 1000ull) : 0;
+            records.push_back({timestamp + delay, offset});
+        }
+    }
+
+    std::stable_sort(records.begin(), records.end(), [](const gen_record& a, const gen_record& b) {
+        return a.queued < b.queued;
+    });
+
+    const std::string filename = options.out + "/firefox" + std::to_string(process) + ".bin";
+    FILE* file = fopen(filename.c_str(), "wb");
+    if (file == nullptr) {
+        printf("Error opening output file: '%s'\n", filename.c_str());
+        return false;
+    }
+    for(const auto& record : records)
+    {
+        const message* msg = reinterpret_cast<const message*>(data.data() + record.offset);
+        fwrite(msg, 1, msg->length, file);
+    }
+    const bool failed = ferror(file) != 0;
+    if (fclose(file) != 0 || failed) {
+        printf("Error writing output file: '%s'\n", filename.c_str());
+        return false;
+    }
+    printf("%s: %zu records, %zu bytes\n", filename.c_str(), records.size(), data.size());
+    return true;
+}
+
+static void print_help()
+{
+    printf(
+        "Usage: gen_logs [OPTION]...\n"
+        "Options:\n"
+        " --processes=N          Processes, one firefoxN.bin each (default 4)\n"
+        " --threads=N            Threads per process (default 4)\n"
+        " --messages=N           Records per thread (default 100000)\n"
+        " --sites=N              Distinct log sites (default 64)\n"
+        " --mix=I:F:S            Relative weights of integer, floating point and string\n"
+        "                        arguments (default 4:2:1)\n"
+        " --utf16=PERCENT        Share of string arguments which are utf16 (default 10)\n"
+        " --disorder=US          Maximum delay between a record's timestamp and it being\n"
+        "                        written, 0 keeps files in timestamp order (default 50)\n"
+        " --interval=US          Mean time between a thread's records (default 5)\n"
+        " --seed=N               Random seed (default 1)\n"
+        " --out=DIR              Directory to write to (default .)\n"
+    );
+}
+
+int main(int argc, char** argv)
+{
+    gen_options options;
+    for(int k = 1; k < argc; ++k)
+    {
+        const char* arg = argv[k];
+        unsigned long long value = 0;
+        unsigned int i = 0, f = 0, s = 0;
+        if (strcmp(arg, "--help") == 0) {
+            print_help();
+            return -1;
+        } else if (sscanf(arg, "--processes=%llu", &value) == 1) {
+            options.processes = value;
+        } else if (sscanf(arg, "--threads=%llu", &value) == 1) {
+            options.threads = value;
+        } else if (sscanf(arg, "--messages=%llu", &value) == 1) {
+            options.messages = value;
+        } else if (sscanf(arg, "--sites=%llu", &value) == 1 && value > 0) {
+            options.sites = value;
+        } else if (sscanf(arg, "--mix=%u:%u:%u", &i, &f, &s) == 3) {
+            options.int_weight = i;
+            options.float_weight = f;
+            options.string_weight = s;
+        } else if (sscanf(arg, "--utf16=%llu", &value) == 1 && value <= 100) {
+            options.utf16_percent = uint32_t(value);
+        } else if (sscanf(arg, "--disorder=%llu", &value) == 1) {
+            options.disorder_us = uint32_t(value);
+        } else if (sscanf(arg, "--interval=%llu", &value) == 1) {
+            options.interval_us = uint32_t(value);
+        } else if (sscanf(arg, "--seed=%llu", &value) == 1) {
+            options.seed = value;
+        } else if (strncmp(arg, "--out=", 6) == 0) {
+            options.out = arg + 6;
+        } else {
+            printf("Unknown option: '%s'\n", arg);
+            return -1;
+        }
+    }
+
+    std::mt19937_64 rng(options.seed);
+    const std::vector<gen_site> sites = make_sites(options, rng);
+    for(size_t process = 0; process < options.processes; ++process)
+    {
+        if (!write_process(options, sites, process, rng)) {
+            return -1;
+        }
+    }
+    return 0;
+}
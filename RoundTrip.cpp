@@ -0,0 +1,424 @@
+#include "TbbLogger.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+// C++
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+// End to end benchmark of the whole pipeline: producer threads log through the
+// real logger into a temporary TBB_LOG_DIR while a monitor tails the log file,
+// then aggregate turns the file into text and every message is checked against
+// what was logged. Reports producer per-call cost, how far the writer thread
+// falls behind and aggregate throughput, and fails if any message was lost,
+// duplicated, reordered or changed on the way.
+//
+// Build with `make round_trip`, then for example
+// `bin/round_trip --producers=8 --messages=500000 --aggregate-args="-j 0"`.
+
+// producers time their calls in batches, the slowest batch shows stalls
+constexpr size_t BATCH_CALLS = 256;
+
+struct round_trip_options
+{
+    size_t producers = 4;
+    size_t messages = 250000;
+    std::string aggregate = "bin/aggregate";
+    std::string aggregate_args;
+    bool keep = false;
+};
+
+static const char* const STRINGS[] = {
+    "ok", "pending", "https://example.com/index.html", "main thread",
+    "a considerably longer string argument, as logged with a url or a message",
+};
+static const char16_t* const STRINGS16[] = {
+    u"ok", u"pending", u"https://example.com/index.html", u"main thread",
+    u"a considerably longer string argument, as logged with a url or a message",
+};
+constexpr size_t STRING_COUNT = sizeof(STRINGS) / sizeof(STRINGS[0]);
+
+// every argument is derived from the producer and sequence number, so the
+// text aggregate prints can be checked without keeping what was logged
+static inline int32_t signed_value(uint32_t producer, uint64_t seq)
+{
+    return int32_t(uint32_t(seq * 2654435761u) ^ producer);
+}
+
+static inline uint64_t unsigned_value(uint32_t producer, uint64_t seq)
+{
+    return (seq * 0x9E3779B97F4A7C15ull) ^ producer;
+}
+
+static inline double float_value(uint32_t producer, uint64_t seq)
+{
+    // quarters print exactly with two decimals
+    return double(seq) * 0.25 + producer;
+}
+
+static int expected_text(char* buffer, size_t len, uint32_t producer, uint64_t seq)
+{
+    return snprintf(buffer, len, "roundtrip %u %llu %d %llx %.2f '%s' '%s'",
+        producer, (unsigned long long)seq, signed_value(producer, seq),
+        (unsigned long long)unsigned_value(producer, seq), float_value(producer, seq),
+        STRINGS[seq % STRING_COUNT], STRINGS[(seq + producer) % STRING_COUNT]);
+}
+
+// written by a producer only, padded so producers don't share cache lines
+struct alignas(64) producer_state
+{
+    std::atomic<uint64_t> logged{0};
+    uint64_t begin = 0;
+    uint64_t end = 0;
+    uint64_t slowest_batch = 0;
+};
+
+static void produce(uint32_t producer, size_t messages, producer_state& state, std::atomic<bool>& go)
+{
+    while (!go.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+    }
+
+    state.begin = tbb::internal::get_timestamp();
+    uint64_t batch_begin = state.begin;
+    for(uint64_t seq = 0; seq < messages; ++seq)
+    {
+        TBB_LOG("roundtrip {} {} {} {:x} {:.2f} '{}' '{}'",
+            producer, seq, signed_value(producer, seq), unsigned_value(producer, seq),
+            float_value(producer, seq), STRINGS[seq % STRING_COUNT],
+            STRINGS16[(seq + producer) % STRING_COUNT]);
+
+        if ((seq + 1) % BATCH_CALLS == 0 || seq + 1 == messages)
+        {
+            const uint64_t now = tbb::internal::get_timestamp();
+            state.slowest_batch = std::max(state.slowest_batch, now - batch_begin);
+            batch_begin = now;
+            state.logged.store(seq + 1, std::memory_order_relaxed);
+        }
+    }
+    state.end = tbb::internal::get_timestamp();
+}
+
+// tails the log file while the producers run, counting the complete records
+// which have reached it
+struct writer_monitor
+{
+    std::string path;
+    FILE* file = nullptr;
+    std::vector<uint8_t> pending;
+    uint64_t records = 0;
+    uint64_t bytes = 0;
+
+    void poll()
+    {
+        if (file == nullptr) {
+            file = fopen(path.c_str(), "rb");
+            if (file == nullptr) {
+                return;
+            }
+        }
+
+        uint8_t chunk[1 << 16];
+        size_t read = 0;
+        while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+            pending.insert(pending.end(), chunk, chunk + read);
+        }
+        // the writer may be part way through a record, carry on from here next time
+        clearerr(file);
+
+        size_t offset = 0;
+        while (pending.size() - offset >= sizeof(uint32_t))
+        {
+            uint32_t length;
+            memcpy(&length, pending.data() + offset, sizeof(length));
+            if (length < sizeof(tbb::serialization::message) || pending.size() - offset < length) {
+                break;
+            }
+            offset += length;
+            ++records;
+        }
+        bytes += offset;
+        pending.erase(pending.begin(), pending.begin() + offset);
+    }
+
+    ~writer_monitor()
+    {
+        if (file != nullptr) {
+            fclose(file);
+        }
+    }
+};
+
+struct verify_result
+{
+    uint64_t lines = 0;
+    uint64_t unexpected = 0;
+    uint64_t duplicated = 0;
+    uint64_t mismatched = 0;
+    uint64_t reordered = 0;
+    uint64_t missing = 0;
+    uint64_t thread_changes = 0;
+};
+
+// checks that every logged message appears exactly once in aggregate's output,
+// with the arguments it was logged with, in order on its producer's thread
+static bool verify_output(const std::string& path, const round_trip_options& options, verify_result& result)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        printf("Error opening aggregate output: '%s'\n", path.c_str());
+        return false;
+    }
+
+    std::vector<std::vector<bool>> seen(options.producers, std::vector<bool>(options.messages, false));
+    std::vector<uint64_t> next_seq(options.producers, 0);
+    std::vector<std::string> thread_ids(options.producers);
+
+    char expected[512];
+    char* line = nullptr;
+    size_t capacity = 0;
+    ssize_t length = 0;
+    while ((length = getline(&line, &capacity, file)) > 0)
+    {
+        ++result.lines;
+        if (line[length - 1] == '\n') {
+            line[--length] = 0;
+        }
+
+        // [timestamp][child][thread] function in file:line message
+        const char* text = strstr(line, " roundtrip ");
+        const char* thread_begin = strstr(line, "][");
+        thread_begin = thread_begin ? strstr(thread_begin + 2, "][") : nullptr;
+        const char* thread_end = thread_begin ? strchr(thread_begin + 2, ']') : nullptr;
+        unsigned int producer = 0;
+        unsigned long long seq = 0;
+        if (text == nullptr || thread_end == nullptr ||
+            sscanf(text, " roundtrip %u %llu", &producer, &seq) != 2 ||
+            producer >= options.producers || seq >= options.messages) {
+            ++result.unexpected;
+            continue;
+        }
+        ++text;
+
+        if (seen[producer][seq]) {
+            ++result.duplicated;
+            continue;
+        }
+        seen[producer][seq] = true;
+
+        expected_text(expected, sizeof(expected), producer, seq);
+        if (strcmp(text, expected) != 0) {
+            ++result.mismatched;
+        }
+        if (seq < next_seq[producer]) {
+            ++result.reordered;
+        }
+        next_seq[producer] = std::max<uint64_t>(next_seq[producer], seq + 1);
+
+        // each producer is one thread, its messages should all carry the same id
+        const std::string thread_id(thread_begin + 2, thread_end);
+        if (thread_ids[producer].empty()) {
+            thread_ids[producer] = thread_id;
+        } else if (thread_ids[producer] != thread_id) {
+            ++result.thread_changes;
+        }
+    }
+    free(line);
+    fclose(file);
+
+    for(const auto& producer_seen : seen) {
+        result.missing += std::count(producer_seen.begin(), producer_seen.end(), false);
+    }
+    return true;
+}
+
+static uint64_t file_size(const std::string& path)
+{
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 ? uint64_t(info.st_size) : 0;
+}
+
+static void remove_directory(const std::string& dir)
+{
+    if (DIR* listing = opendir(dir.c_str()); listing != nullptr)
+    {
+        while (dirent* entry = readdir(listing))
+        {
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+                unlink((dir + "/" + entry->d_name).c_str());
+            }
+        }
+        closedir(listing);
+    }
+    rmdir(dir.c_str());
+}
+
+static double seconds(uint64_t nanoseconds)
+{
+    return nanoseconds / 1e9;
+}
+
+static void print_help()
+{
+    printf(
+        "Usage: round_trip [OPTION]...\n"
+        "Options:\n"
+        " --producers=N          Logging threads (default 4)\n"
+        " --messages=N           Messages logged by each thread (default 250000)\n"
+        " --aggregate=PATH       aggregate binary to run (default bin/aggregate)\n"
+        " --aggregate-args=ARGS  Extra arguments for aggregate, e.g. \"-j 0\" or\n"
+        "                        \"--stream\"\n"
+        " --keep                 Keep the temporary log directory and text output\n"
+    );
+}
+
+int main(int argc, char** argv)
+{
+    round_trip_options options;
+    for(int k = 1; k < argc; ++k)
+    {
+        const char* arg = argv[k];
+        unsigned long long value = 0;
+        if (strcmp(arg, "--help") == 0) {
+            print_help();
+            return -1;
+        } else if (sscanf(arg, "--producers=%llu", &value) == 1 && value > 0) {
+            options.producers = value;
+        } else if (sscanf(arg, "--messages=%llu", &value) == 1 && value > 0) {
+            options.messages = value;
+        } else if (strncmp(arg, "--aggregate=", 12) == 0) {
+            options.aggregate = arg + 12;
+        } else if (strncmp(arg, "--aggregate-args=", 17) == 0) {
+            options.aggregate_args = arg + 17;
+        } else if (strcmp(arg, "--keep") == 0) {
+            options.keep = true;
+        } else {
+            printf("Unknown option: '%s'\n", arg);
+            return -1;
+        }
+    }
+
+    // the logger reads TBB_LOG_DIR when it starts, which is on the first TBB_LOG
+    char log_dir[1024];
+    const size_t temp_length = tbb::internal::get_temp_path(log_dir, sizeof(log_dir));
+    snprintf(log_dir + temp_length, sizeof(log_dir) - temp_length, "/tbb_round_trip.XXXXXX");
+    if (mkdtemp(log_dir) == nullptr) {
+        printf("Error creating temporary directory: '%s'\n", log_dir);
+        return -1;
+    }
+    setenv("TBB_LOG_DIR", log_dir, 1);
+
+    char log_path[1024];
+    tbb::internal::get_log_path(log_path, sizeof(log_path), tbb::internal::get_child_id());
+    writer_monitor monitor;
+    monitor.path = log_path;
+
+    const uint64_t total = uint64_t(options.producers) * options.messages;
+    std::vector<producer_state> states(options.producers);
+    std::vector<std::thread> producers;
+    std::atomic<bool> go{false};
+    for(size_t k = 0; k < options.producers; ++k) {
+        producers.emplace_back(produce, uint32_t(k), options.messages, std::ref(states[k]), std::ref(go));
+    }
+
+    // sample the writer's backlog until everything logged is in the file, or
+    // nothing more has arrived for a while after the producers finished
+    constexpr uint64_t WRITER_TIMEOUT = 10000000000ull;
+    uint64_t max_backlog = 0;
+    uint64_t written = 0;
+    uint64_t last_progress = tbb::internal::get_timestamp();
+    go.store(true, std::memory_order_release);
+    while (true)
+    {
+        tbb::internal::thread_sleep(1);
+
+        uint64_t logged = 0;
+        for(auto& state : states) {
+            logged += state.logged.load(std::memory_order_relaxed);
+        }
+        const uint64_t records = monitor.records;
+        monitor.poll();
+        written = tbb::internal::get_timestamp();
+        if (logged > monitor.records) {
+            max_backlog = std::max(max_backlog, logged - monitor.records);
+        }
+        if (monitor.records >= total) {
+            break;
+        }
+        if (monitor.records != records || logged < total) {
+            last_progress = written;
+        } else if (written - last_progress > WRITER_TIMEOUT) {
+            break;
+        }
+    }
+    uint64_t producers_done = 0;
+    for(size_t k = 0; k < producers.size(); ++k) {
+        producers[k].join();
+        producers_done = std::max(producers_done, states[k].end);
+    }
+
+    uint64_t produce_begin = UINT64_MAX;
+    uint64_t thread_time = 0;
+    uint64_t slowest_batch = 0;
+    for(const auto& state : states) {
+        produce_begin = std::min(produce_begin, state.begin);
+        thread_time += state.end - state.begin;
+        slowest_batch = std::max(slowest_batch, state.slowest_batch);
+    }
+    const uint64_t produce_time = producers_done - produce_begin;
+    const uint64_t writer_lag = written > producers_done ? written - producers_done : 0;
+
+    // aggregate the log to text, as a user would
+    const std::string output = std::string(log_dir) + "/roundtrip.txt";
+    const std::string command = options.aggregate + " " + options.aggregate_args + " '" + log_path + "' -o '" + output + "'";
+    const uint64_t aggregate_begin = tbb::internal::get_timestamp();
+    const int status = system(command.c_str());
+    const uint64_t aggregate_time = tbb::internal::get_timestamp() - aggregate_begin;
+    if (status != 0) {
+        printf("Error running aggregate: '%s'\n", command.c_str());
+        if (!options.keep) {
+            remove_directory(log_dir);
+        }
+        return -1;
+    }
+    const uint64_t log_bytes = file_size(log_path);
+    const uint64_t text_bytes = file_size(output);
+
+    verify_result result;
+    const bool verified = verify_output(output, options, result);
+    if (options.keep) {
+        printf("logs and output kept in %s\n", log_dir);
+    } else {
+        remove_directory(log_dir);
+    }
+    if (!verified) {
+        return -1;
+    }
+
+    printf("%zu producers x %zu messages, %llu total\n", options.producers, options.messages, (unsigned long long)total);
+    printf("produce    %8.3fs %10.0f msg/s  %6.0f ns/call, slowest %zu calls %.3fms\n",
+        seconds(produce_time), total / seconds(produce_time), double(thread_time) / total, BATCH_CALLS, slowest_batch / 1e6);
+    printf("writer     %8.3fs after the last call, max backlog %llu messages, %llu bytes written\n",
+        seconds(writer_lag), (unsigned long long)max_backlog, (unsigned long long)monitor.bytes);
+    printf("aggregate  %8.3fs %10.0f msg/s  %6.3f GB/s of log, %.3f GB/s of text\n",
+        seconds(aggregate_time), total / seconds(aggregate_time), log_bytes / 1e9 / seconds(aggregate_time), text_bytes / 1e9 / seconds(aggregate_time));
+    printf("end to end %8.3fs %10.0f msg/s\n",
+        seconds(written - produce_begin + aggregate_time), total / seconds(written - produce_begin + aggregate_time));
+
+    const bool lossless = result.missing == 0 && result.duplicated == 0 && result.mismatched == 0 &&
+        result.reordered == 0 && result.unexpected == 0 && result.thread_changes == 0 && monitor.records == total;
+    printf("%s: %llu lines, %llu missing, %llu duplicated, %llu changed, %llu out of order, %llu unexpected, %llu thread id changes\n",
+        lossless ? "lossless" : "Error, messages lost",
+        (unsigned long long)result.lines, (unsigned long long)result.missing, (unsigned long long)result.duplicated,
+        (unsigned long long)result.mismatched, (unsigned long long)result.reordered, (unsigned long long)result.unexpected,
+        (unsigned long long)result.thread_changes);
+    return lossless ? 0 : -1;
+}
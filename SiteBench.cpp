@@ -0,0 +1,102 @@
+#include "TbbLogger.h"
+#include <stdio.h>
+#include <stdint.h>
+
+// C++
+#include <utility>
+
+// Instantiates SITE_COUNT distinct log sites, each with a different format string
+// length and argument types, to measure the code size and instruction cache
+// cost of TBB_LOG across a large codebase.
+//
+// Build with `make site_bench`, then compare the .text size reported by
+// `size bin/site_bench` and the per-call time printed below. Run under
+// `perf stat -e instructions,L1-icache-load-misses bin/site_bench` for
+// instruction cache misses.
+
+constexpr size_t SITE_COUNT = 1000;
+constexpr size_t ROUNDS = 100;
+
+// "site {} {}" padded with dots so every site's format string has a different length
+template<size_t I>
+struct site_format
+{
+    static constexpr size_t length = sizeof("site {} {}") + I;
+    struct storage_t
+    {
+        char str[length];
+    };
+
+    static constexpr storage_t make()
+    {
+        storage_t retval = {};
+        const char prefix[] = "site {} {}";
+        size_t k = 0;
+        for(; k < sizeof(prefix) - 1; ++k) {
+            retval.str[k] = prefix[k];
+        }
+        for(; k < length - 1; ++k) {
+            retval.str[k] = '.';
+        }
+        retval.str[k] = 0;
+        return retval;
+    }
+
+    static constexpr storage_t value = make();
+};
+
+template<size_t I>
+constexpr typename site_format<I>::storage_t site_format<I>::value;
+
+// cycles through the supported argument types
+template<size_t I> struct site_arg;
+template<> struct site_arg<0> { typedef int8_t type; };
+template<> struct site_arg<1> { typedef uint16_t type; };
+template<> struct site_arg<2> { typedef int32_t type; };
+template<> struct site_arg<3> { typedef uint64_t type; };
+template<> struct site_arg<4> { typedef float type; };
+template<> struct site_arg<5> { typedef double type; };
+template<> struct site_arg<6> { typedef const char* type; };
+
+template<size_t I>
+typename site_arg<I>::type make_arg(size_t k)
+{
+    return (typename site_arg<I>::type)k;
+}
+
+template<>
+const char* make_arg<6>(size_t)
+{
+    return "string";
+}
+
+template<size_t I>
+void __attribute__((noinline)) site(size_t k)
+{
+    TBB_LOG(site_format<I>::value.str, make_arg<I % 7>(k), make_arg<(I / 7) % 7>(k));
+}
+
+template<size_t... I>
+void all_sites(size_t k, std::index_sequence<I...>)
+{
+    using expand = int[];
+    (void)expand{(site<I>(k), 0)...};
+}
+
+int main(int argc, char** argv)
+{
+    // initial log so that logger thread spinning up isn't counted in timing
+    TBB_TRACE();
+
+    constexpr double NANOSECONDS_PER_SECOND = 1000000000.0;
+    const uint64_t begin = tbb::internal::get_timestamp();
+    for(size_t k = 0; k < ROUNDS; ++k)
+    {
+        all_sites(k, std::make_index_sequence<SITE_COUNT>());
+    }
+    const uint64_t end = tbb::internal::get_timestamp();
+
+    const double seconds = (end - begin) / NANOSECONDS_PER_SECOND;
+    printf("Sites: %zu, calls: %zu\n", SITE_COUNT, SITE_COUNT * ROUNDS);
+    printf("Time Logging: %f seconds (%.1f ns per call)\n", seconds, seconds * NANOSECONDS_PER_SECOND / (SITE_COUNT * ROUNDS));
+}
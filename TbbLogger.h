@@ -7,11 +7,13 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <math.h>
 
 // C++
 #include <atomic>
 #include <memory>
 #include <vector>
+#include <algorithm>
 #include <functional>
 #include <type_traits>
 #include <utility>
@@ -25,17 +27,84 @@
 #   include <sys/stat.h>
 #   include <sys/types.h>
 #   include <sys/syscall.h>
+#   include <linux/perf_event.h>
+#endif
+
+#define TBB_CONCAT_IMPL(A, B) A##B
+#define TBB_CONCAT(A, B) TBB_CONCAT_IMPL(A, B)
+// names a local unique to its expansion, __LINE__ alone collides when a macro expands to several on one line
+#ifdef __COUNTER__
+#define TBB_UNIQUE_NAME(PREFIX) TBB_CONCAT(PREFIX, __COUNTER__)
+#else
+#define TBB_UNIQUE_NAME(PREFIX) TBB_CONCAT(PREFIX, __LINE__)
 #endif
 
 #define TBB_LOG_IMPL(...) tbb::logger::log(__FUNCTION__, __FILE__, __LINE__, __VA_ARGS__)
+#define TBB_SCOPE_IMPL(FMT, PERF) tbb::scope TBB_UNIQUE_NAME(tbb_scope_)(__FUNCTION__, __FILE__, __LINE__, FMT, PERF)
 
 #if 0
 #define TBB_LOG(...) (void)(0)
+#define TBB_SCOPE(FMT) (void)(0)
+#define TBB_PERF_SCOPE(FMT) (void)(0)
 #else
 #define TBB_LOG(...) TBB_LOG_IMPL(__VA_ARGS__)
+// logs a record with the scope's duration when the enclosing scope exits
+#define TBB_SCOPE(FMT) TBB_SCOPE_IMPL(FMT, false)
+// same as TBB_SCOPE, but also records this thread's performance counter deltas
+#define TBB_PERF_SCOPE(FMT) TBB_SCOPE_IMPL(FMT, true)
 #endif
 #define TBB_TRACE(...) TBB_LOG("")
 
+#define TBB_METRIC_IMPL(KIND, NAME, UPDATE, VALUE) do { \
+        static const tbb::metrics::site* TBB_CONCAT(tbb_metric_, __LINE__) = \
+            tbb::metrics::register_site(__FUNCTION__, __FILE__, __LINE__, NAME, KIND); \
+        tbb::metrics::UPDATE(TBB_CONCAT(tbb_metric_, __LINE__), VALUE); \
+    } while(0)
+
+#if 0
+#define TBB_COUNTER(NAME, VALUE) (void)(0)
+#define TBB_GAUGE(NAME, VALUE) (void)(0)
+#define TBB_HISTOGRAM(NAME, VALUE) (void)(0)
+#else
+// adds VALUE to a per-thread counter
+#define TBB_COUNTER(NAME, VALUE) TBB_METRIC_IMPL(tbb::serialization::metric_kind::counter, NAME, counter_add, VALUE)
+// sets a per-thread gauge to VALUE
+#define TBB_GAUGE(NAME, VALUE) TBB_METRIC_IMPL(tbb::serialization::metric_kind::gauge, NAME, gauge_set, VALUE)
+// adds VALUE to a per-thread log2 histogram
+#define TBB_HISTOGRAM(NAME, VALUE) TBB_METRIC_IMPL(tbb::serialization::metric_kind::histogram, NAME, histogram_record, VALUE)
+#endif
+
+#define TBB_FLOW_IMPL(PHASE, ID, ...) tbb::logger::log_flow(tbb::serialization::flow_phase::PHASE, ID, __FUNCTION__, __FILE__, __LINE__, __VA_ARGS__)
+
+#if 0
+#define TBB_FLOW_BEGIN(ID, ...) (void)(0)
+#define TBB_FLOW_STEP(ID, ...) (void)(0)
+#define TBB_FLOW_END(ID, ...) (void)(0)
+#define TBB_FLOW_CONTEXT(ID) (void)(0)
+#else
+// explicit flow markers, ID is a uint64_t from tbb::new_flow_id() which may be passed across threads and processes
+#define TBB_FLOW_BEGIN(ID, ...) TBB_FLOW_IMPL(begin, ID, __VA_ARGS__)
+#define TBB_FLOW_STEP(ID, ...) TBB_FLOW_IMPL(step, ID, __VA_ARGS__)
+#define TBB_FLOW_END(ID, ...) TBB_FLOW_IMPL(end, ID, __VA_ARGS__)
+// tags every record logged by this thread with flow ID until the enclosing scope exits
+#define TBB_FLOW_CONTEXT(ID) tbb::flow_context TBB_UNIQUE_NAME(tbb_flow_context_)(ID)
+#endif
+
+// default maximum number of elements captured by tbb::span
+#ifndef TBB_MAX_SPAN_COUNT
+#define TBB_MAX_SPAN_COUNT 64
+#endif
+
+// default maximum number of bytes captured by tbb::blob
+#ifndef TBB_MAX_BLOB_BYTES
+#define TBB_MAX_BLOB_BYTES 256
+#endif
+
+// how often the logger thread snapshots every thread's metrics to the log
+#ifndef TBB_METRICS_INTERVAL_MS
+#define TBB_METRICS_INTERVAL_MS 100
+#endif
+
 namespace tbb
 {
     namespace serialization
@@ -62,84 +131,201 @@ namespace tbb
             // floating points
             f32,
             f64,
+            // scope duration and performance counter deltas
+            perf,
+            // metric snapshot
+            metric,
+            // flow marker
+            flow,
+            // array of integers or floating points
+            array,
+            // raw bytes
+            blob,
         };
 
-        // used to determine size of param in bytes
-        constexpr size_t param_size()                        { return 0; }
-
-        // string size of unknown size implementation
-        size_t param_size_impl(const char* str);
-        size_t param_size_impl(const char16_t* str);
-        size_t param_size_impl(const char32_t* str);
-        size_t param_size_impl(const wchar_t* str);
-        // arbitatry pointer size impemetation
-        constexpr size_t param_size_impl(const void*)        { return sizeof(void*)        + sizeof(data_type); }
-        // fixed string literal size
-        template<size_t N>
-        constexpr size_t param_size(const char (&str)[N])    { return sizeof(char)     * N + sizeof(data_type); }
-        template<size_t N>
-        constexpr size_t param_size(const char16_t (&str)[N]){ return sizeof(char16_t) * N + sizeof(data_type); }
-        template<size_t N>
-        constexpr size_t param_size(const char32_t (&str)[N]){ return sizeof(char32_t) * N + sizeof(data_type); }
+        // data_type of an array element, invalid for types spans don't support
+        template<typename T> struct element_type { static constexpr data_type value = data_type::invalid; };
+        template<> struct element_type<int8_t>   { static constexpr data_type value = data_type::i8; };
+        template<> struct element_type<uint8_t>  { static constexpr data_type value = data_type::u8; };
+        template<> struct element_type<int16_t>  { static constexpr data_type value = data_type::i16; };
+        template<> struct element_type<uint16_t> { static constexpr data_type value = data_type::u16; };
+        template<> struct element_type<int32_t>  { static constexpr data_type value = data_type::i32; };
+        template<> struct element_type<uint32_t> { static constexpr data_type value = data_type::u32; };
+        template<> struct element_type<int64_t>  { static constexpr data_type value = data_type::i64; };
+        template<> struct element_type<uint64_t> { static constexpr data_type value = data_type::u64; };
+        template<> struct element_type<float>    { static constexpr data_type value = data_type::f32; };
+        template<> struct element_type<double>   { static constexpr data_type value = data_type::f64; };
+
+        // serialized as the element type (u8, arrays only), captured count (u32) and total count (u32)
+        // followed by the captured elements
+        struct array_param
+        {
+            data_type type;
+            data_type element_type;
+            uint32_t count;
+            uint32_t total;
+            const void* data;
+        };
+
+        // performance counters which may be attached to a scope's record
+        enum class perf_counter : uint8_t
+        {
+            // hardware
+            instructions = 0,
+            cycles,
+            cache_misses,
+            // software
+            context_switches,
+            page_faults,
+            task_clock,
+            count,
+        };
+
+        // set in a perf sample's valid mask when the kernel multiplexed the counters, their
+        // values have been scaled up by the share of the scope they were actually counting
+        constexpr uint8_t PERF_MULTIPLEXED = 0x80;
+
+        // serialized as: valid mask (u8), duration (u64), then one u64 per valid counter
+        struct perf_sample
+        {
+            uint8_t valid_mask;
+            uint64_t duration;
+            uint64_t values[(size_t)perf_counter::count];
+        };
+
+        enum class metric_kind : uint8_t
+        {
+            counter = 0,
+            gauge,
+            histogram,
+        };
+
+        // context markers are attached to any record logged with a current flow context,
+        // the others are logged explicitly with TBB_FLOW_BEGIN/STEP/END
+        enum class flow_phase : uint8_t
+        {
+            context = 0,
+            begin,
+            step,
+            end,
+        };
+
+        // serialized as the phase (u8) followed by the id (u64)
+        struct flow_marker
+        {
+            flow_phase phase;
+            uint64_t id;
+        };
+
+        // bucket 0 holds values below 1, bucket K holds values in [2^(K-1), 2^K)
+        constexpr size_t metric_histogram_buckets = 64;
+
+        // one thread's metric state since its previous snapshot, serialized as the kind (u8) followed by
+        // counter: sum (i64)
+        // gauge: last, min, max (f64)
+        // histogram: count (u64), sum, min, max (f64), bucket count (u8), then (index (u8), count (u64)) per non-empty bucket
+        struct metric_sample
+        {
+            metric_kind kind;
+            int64_t sum;
+            uint64_t count;
+            double last;
+            double total;
+            double min;
+            double max;
+            uint64_t buckets[metric_histogram_buckets];
+        };
+
+        // type-erased argument captured at the log site, log sites only fill in an array of these
+        // and leave the sizing and packing to a single out-of-line serializer
+        struct arg_desc
+        {
+            data_type type;
+            // length in characters of strings (excluding the terminator)
+            uint32_t length;
+            union
+            {
+                uint64_t bits;
+                const void* ptr;
+            } value;
+        };
+
+        // length of strings which the serializer must measure itself
+        constexpr uint32_t unknown_length = 0xFFFFFFFF;
+
+        // fixed string literal, length known at compile time
         template<size_t N>
-        constexpr size_t param_size(const wchar_t (&str)[N]) { return sizeof(wchar_t)  * N + sizeof(data_type); }
-        // read/write string buffer size
-        size_t param_size(char str[]);
-        size_t param_size(char16_t str[]);
-        size_t param_size(char32_t str[]);
-        size_t param_size(wchar_t str[]);
-        // catch-all template functionf or pointers
+        arg_desc make_literal(const char (&str)[N]);
+        // string of unknown size implementation
+        arg_desc make_arg_impl(const char* str);
+        arg_desc make_arg_impl(const char16_t* str);
+        arg_desc make_arg_impl(const char32_t* str);
+        arg_desc make_arg_impl(const wchar_t* str);
+        // arbitrary pointer implementation
+        arg_desc make_arg_impl(const void* ptr);
+        // catch-all template function for pointers
         template<typename T>
         typename std::enable_if<
-            std::is_pointer<T>::value, size_t>::type
-        param_size(T ptr)                                    { return param_size_impl(ptr); }
-        constexpr size_t param_size(std::nullptr_t)          { return sizeof(void*)       + sizeof(data_type); }
-        constexpr size_t param_size(int8_t)                  { return sizeof(int8_t)      + sizeof(data_type); }
-        constexpr size_t param_size(uint8_t)                 { return sizeof(uint8_t)     + sizeof(data_type); }
-        constexpr size_t param_size(int16_t)                 { return sizeof(int16_t)     + sizeof(data_type); }
-        constexpr size_t param_size(uint16_t)                { return sizeof(uint16_t)    + sizeof(data_type); }
-        constexpr size_t param_size(int32_t)                 { return sizeof(int32_t)     + sizeof(data_type); }
-        constexpr size_t param_size(uint32_t)                { return sizeof(uint32_t)    + sizeof(data_type); }
-        constexpr size_t param_size(int64_t)                 { return sizeof(int64_t)     + sizeof(data_type); }
-        constexpr size_t param_size(uint64_t)                { return sizeof(uint64_t)    + sizeof(data_type); }
-        constexpr size_t param_size(float)                   { return sizeof(float)       + sizeof(data_type); }
-        constexpr size_t param_size(double)                  { return sizeof(double)      + sizeof(data_type); }
-
-        template<typename FIRST, typename ...ARGS>
-        size_t param_size(FIRST&& first, ARGS&&... args)
-        {
-            return param_size(std::forward<FIRST>(first)) + param_size(std::forward<ARGS>(args)...);
-        }
-
-        uint8_t* pack_param_impl(uint8_t* dest, const char* str);
-        uint8_t* pack_param_impl(uint8_t* dest, const char16_t* str);
-        uint8_t* pack_param_impl(uint8_t* dest, const char32_t* str);
-        uint8_t* pack_param_impl(uint8_t* dest, const wchar_t* str);
-        uint8_t* pack_param_impl(uint8_t* dest, char str[]);
-        uint8_t* pack_param_impl(uint8_t* dest, wchar_t str[]);
-        uint8_t* pack_param_impl(uint8_t* dest, char16_t str[]);
-        uint8_t* pack_param_impl(uint8_t* dest, char32_t str[]);
-        uint8_t* pack_param_impl(uint8_t* dest, const void* ptr);
-        uint8_t* pack_param_impl(uint8_t* dest, void* ptr);
-        uint8_t* pack_param_impl(uint8_t* dest, std::nullptr_t);
-        uint8_t* pack_param_impl(uint8_t* dest, int8_t val);
-        uint8_t* pack_param_impl(uint8_t* dest, uint8_t val);
-        uint8_t* pack_param_impl(uint8_t* dest, int16_t val);
-        uint8_t* pack_param_impl(uint8_t* dest, uint16_t val);
-        uint8_t* pack_param_impl(uint8_t* dest, int32_t val);
-        uint8_t* pack_param_impl(uint8_t* dest, uint32_t val);
-        uint8_t* pack_param_impl(uint8_t* dest, int64_t val);
-        uint8_t* pack_param_impl(uint8_t* dest, uint64_t val);
-        uint8_t* pack_param_impl(uint8_t* dest, float val);
-        uint8_t* pack_param_impl(uint8_t* dest, double val);
-
-        inline uint8_t* pack_param(uint8_t* dest) {return dest;}
-        template<typename FIRST, typename ...ARGS>
-        uint8_t* pack_param(uint8_t* dest, FIRST&& first, ARGS&&... args)
-        {
-            return pack_param(pack_param_impl(dest, std::forward<FIRST>(first)), std::forward<ARGS>(args)...);
+            std::is_pointer<T>::value, arg_desc>::type
+        make_arg(T ptr)                                      { return make_arg_impl(ptr); }
+        arg_desc make_arg(std::nullptr_t);
+        arg_desc make_arg(int8_t val);
+        arg_desc make_arg(uint8_t val);
+        arg_desc make_arg(int16_t val);
+        arg_desc make_arg(uint16_t val);
+        arg_desc make_arg(int32_t val);
+        arg_desc make_arg(uint32_t val);
+        arg_desc make_arg(int64_t val);
+        arg_desc make_arg(uint64_t val);
+        arg_desc make_arg(float val);
+        arg_desc make_arg(double val);
+        // structured params are referenced, they must outlive the serializer call
+        arg_desc make_arg(const perf_sample& sample);
+        arg_desc make_arg(const metric_sample& sample);
+        arg_desc make_arg(const flow_marker& marker);
+        arg_desc make_arg(const array_param& arr);
+
+        // size in bytes of pointer, integer and floating point values
+        constexpr size_t scalar_size(data_type type)
+        {
+            switch(type)
+            {
+                case data_type::i8:
+                case data_type::u8:
+                    return sizeof(uint8_t);
+                case data_type::i16:
+                case data_type::u16:
+                    return sizeof(uint16_t);
+                case data_type::p32:
+                case data_type::i32:
+                case data_type::u32:
+                case data_type::f32:
+                    return sizeof(uint32_t);
+                case data_type::p64:
+                case data_type::i64:
+                case data_type::u64:
+                case data_type::f64:
+                    return sizeof(uint64_t);
+                default:
+                    return 0;
+            }
         }
 
+        // used to determine size of structured params in bytes
+        size_t param_size(const perf_sample& sample);
+        size_t param_size(const metric_sample& sample);
+        constexpr size_t param_size(const flow_marker&)      { return sizeof(flow_phase) + sizeof(uint64_t) + sizeof(data_type); }
+        size_t param_size(const array_param& arr);
+
+        uint8_t* pack_param_impl(uint8_t* dest, const perf_sample& sample);
+        uint8_t* pack_param_impl(uint8_t* dest, const metric_sample& sample);
+        uint8_t* pack_param_impl(uint8_t* dest, const flow_marker& marker);
+        uint8_t* pack_param_impl(uint8_t* dest, const array_param& arr);
+
+        // size in bytes of a type-erased param, measures strings of unknown length
+        size_t arg_size(arg_desc& arg);
+        uint8_t* pack_arg(uint8_t* dest, const arg_desc& arg);
+
         #pragma pack(1)
         struct message
         {
@@ -153,255 +339,325 @@ namespace tbb
         message* alloc_msg(size_t size);
         void free_msg(message* msg);
 
-        template<typename ...ARGS>
-        size_t msg_size(ARGS&&... args)
+        inline size_t msg_size(arg_desc* args, size_t count)
         {
-            return sizeof(message) + serialization::param_size(std::forward<ARGS>(args)...);
+            size_t size = sizeof(message);
+            for(size_t k = 0; k < count; ++k) {
+                size += serialization::arg_size(args[k]);
+            }
+            return size;
         }
 
-        template<typename ...ARGS>
-        void write_msg(message* msg, ARGS&&... args)
+        // args must have been sized by msg_size first
+        inline void write_msg(message* msg, const arg_desc* args, size_t count)
         {
             uint8_t* head = reinterpret_cast<uint8_t*>(msg);
             uint8_t* tail = head + sizeof(message);
-            tail = serialization::pack_param(tail, std::forward<ARGS>(args)...);
+            for(size_t k = 0; k < count; ++k) {
+                tail = serialization::pack_arg(tail, args[k]);
+            }
             size_t len = (size_t)(tail - head);
             *reinterpret_cast<uint32_t*>(head) = static_cast<uint32_t>(len);
         }
 
+        // packs an additional param after those written by write_msg, msg must have been allocated with room for it
+        template<typename ARG>
+        void append_msg(message* msg, ARG&& arg)
+        {
+            uint8_t* head = reinterpret_cast<uint8_t*>(msg);
+            uint8_t* tail = head + msg->length;
+            tail = serialization::pack_param_impl(tail, std::forward<ARG>(arg));
+            msg->length = static_cast<uint32_t>(tail - head);
+        }
+
         #define NULL_STRING(PREFIX) PREFIX##"(nil)"
         #define UTF8_NULLSTRING   NULL_STRING(u8)
         #define UTF16_NULLSTRING  NULL_STRING(u)
         #define UTF32_NULLSTRING  NULL_STRING(U)
-        #define WIDE_NULLSTRING  NULL_STRING(L)
 
         template<typename CharType>
-        constexpr size_t param_size_string(const CharType* str)
+        uint32_t string_length(const CharType* str)
         {
             const auto* head = str;
-            while(*str++ != (CharType)0);
-            return (str - head) * sizeof(CharType) + sizeof(data_type);
-        }
-
-        /// Size Params
-        inline size_t param_size_impl(const char* str)
-        {
-            if (!str) {
-                str = UTF8_NULLSTRING;
-            }
-            return param_size_string(str);
-        }
-        inline size_t param_size_impl(const char16_t* str)
-        {
-            if (!str) {
-                str = UTF16_NULLSTRING;
-            }
-            return param_size_string(str);
-        }
-        inline size_t param_size_impl(const char32_t* str)
-        {
-            if (!str) {
-                str = UTF32_NULLSTRING;
-            }
-            return param_size_string(str);
-        }
-        inline size_t param_size_impl(const wchar_t* str)
-        {
-            if (!str) {
-                str = WIDE_NULLSTRING;
+            while(*str != (CharType)0) {
+                ++str;
             }
-            return param_size_string(str);
+            return (uint32_t)(str - head);
         }
 
-        inline size_t param_size(char str[])
-        {
-            return param_size_impl(str);
-        }
-        inline size_t param_size(char16_t str[])
-        {
-            return param_size_impl(str);
-        }
-        inline size_t param_size(char32_t str[])
+        /// Make Args
+        template<size_t N>
+        inline arg_desc make_literal(const char (&str)[N])
         {
-            return param_size_impl(str);
+            arg_desc retval = {data_type::utf8, N - 1, {0}};
+            retval.value.ptr = str;
+            return retval;
         }
-        inline size_t param_size(wchar_t str[])
+
+        template<typename T>
+        arg_desc make_scalar(data_type type, T val)
         {
-            return param_size_impl(str);
+            arg_desc retval = {type, 0, {0}};
+            memcpy(&retval.value.bits, &val, sizeof(T));
+            return retval;
         }
 
-        /// Pack Params
-        template<typename CharType>
-        uint8_t* pack_param_string(uint8_t* dest, const CharType* str)
+        template<typename T>
+        arg_desc make_reference(data_type type, const T* param)
         {
-            static_assert((sizeof(CharType) == sizeof(char) ||
-                           sizeof(CharType) == sizeof(char16_t) ||
-                           sizeof(CharType) == sizeof(char32_t)), "Invalid character size");
-            switch(sizeof(CharType))
-            {
-                case sizeof(char):
-                    *dest++ = (uint8_t)data_type::utf8; break;
-                case sizeof(char16_t):
-                    *dest++ = (uint8_t)data_type::utf16; break;
-                case sizeof(char32_t):
-                    *dest++ = (uint8_t)data_type::utf32; break;
-            }
-            auto* str_dest = reinterpret_cast<CharType*>(dest);
-            while((*str_dest++ = *str++));
-            return reinterpret_cast<uint8_t*>(str_dest);
+            arg_desc retval = {type, 0, {0}};
+            retval.value.ptr = param;
+            return retval;
         }
 
         // various string overloads
-        inline uint8_t* pack_param_impl(uint8_t* dest, const char* str)
-        {
-            if (!str) {
-                str = UTF8_NULLSTRING;
-            }
-            return pack_param_string(dest, str);
-        }
-        inline uint8_t* pack_param_impl(uint8_t* dest, const char16_t* str)
-        {
-            if (!str) {
-                str = UTF16_NULLSTRING;
-            }
-            return pack_param_string(dest, str);
-        }
-        inline uint8_t* pack_param_impl(uint8_t* dest, const char32_t* str)
+        inline arg_desc make_arg_impl(const char* str)
         {
-            if (!str) {
-                str = UTF32_NULLSTRING;
-            }
-            return pack_param_string(dest, str);
-        }
-        inline uint8_t* pack_param_impl(uint8_t* dest, const wchar_t* str)
-        {
-            if (!str) {
-                str = WIDE_NULLSTRING;
-            }
-            return pack_param_string(dest, str);
-        }
-        inline uint8_t* pack_param_impl(uint8_t* dest, char str[])
-        {
-            return pack_param_impl(dest, (const char*)str);
+            arg_desc retval = {data_type::utf8, unknown_length, {0}};
+            retval.value.ptr = str;
+            return retval;
         }
-        inline uint8_t* pack_param_impl(uint8_t* dest, char16_t str[])
+        inline arg_desc make_arg_impl(const char16_t* str)
         {
-            return pack_param_impl(dest, (const char16_t*)str);
+            arg_desc retval = {data_type::utf16, unknown_length, {0}};
+            retval.value.ptr = str;
+            return retval;
         }
-        inline uint8_t* pack_param_impl(uint8_t* dest, char32_t str[])
+        inline arg_desc make_arg_impl(const char32_t* str)
         {
-            return pack_param_impl(dest, (const char32_t*)str);
+            arg_desc retval = {data_type::utf32, unknown_length, {0}};
+            retval.value.ptr = str;
+            return retval;
         }
-        inline uint8_t* pack_param_impl(uint8_t* dest, wchar_t str[])
+        inline arg_desc make_arg_impl(const wchar_t* str)
         {
-            return pack_param_impl(dest, (const wchar_t*)str);
+            static_assert(sizeof(wchar_t) == sizeof(char16_t) ||
+                          sizeof(wchar_t) == sizeof(char32_t),
+                          "Invalid character size");
+
+            arg_desc retval = {sizeof(wchar_t) == sizeof(char16_t) ? data_type::utf16 : data_type::utf32, unknown_length, {0}};
+            retval.value.ptr = str;
+            return retval;
         }
 
-        inline uint8_t* pack_param_impl(uint8_t* dest, const void* ptr)
+        inline arg_desc make_arg_impl(const void* ptr)
         {
             static_assert(sizeof(void*) == sizeof(uint32_t) ||
                           sizeof(void*) == sizeof(uint64_t),
                           "Invalid pointer size");
 
-            constexpr size_t N = sizeof(void*);
-            if(N == sizeof(uint32_t)) {
-                *dest++ = (uint8_t)(data_type::p32);
-            } else if(N == sizeof(uint64_t)) {
-                *dest++ = (uint8_t)(data_type::p64);
-            }
-
-            memcpy(dest, &ptr, N);
-            return dest + N;
-        }
-
-        inline uint8_t* pack_param_impl(uint8_t* dest, void* ptr)
-        {
-            return pack_param_impl(dest, (const void*)ptr);
+            return make_scalar(sizeof(void*) == sizeof(uint32_t) ? data_type::p32 : data_type::p64, ptr);
         }
 
-        inline uint8_t* pack_param_impl(uint8_t* dest, std::nullptr_t)
-        {
-            return pack_param_impl(dest, (void*)nullptr);
-        }
+        inline arg_desc make_arg(std::nullptr_t)        { return make_arg_impl((const void*)nullptr); }
+        inline arg_desc make_arg(int8_t val)            { return make_scalar(data_type::i8, val); }
+        inline arg_desc make_arg(uint8_t val)           { return make_scalar(data_type::u8, val); }
+        inline arg_desc make_arg(int16_t val)           { return make_scalar(data_type::i16, val); }
+        inline arg_desc make_arg(uint16_t val)          { return make_scalar(data_type::u16, val); }
+        inline arg_desc make_arg(int32_t val)           { return make_scalar(data_type::i32, val); }
+        inline arg_desc make_arg(uint32_t val)          { return make_scalar(data_type::u32, val); }
+        inline arg_desc make_arg(int64_t val)           { return make_scalar(data_type::i64, val); }
+        inline arg_desc make_arg(uint64_t val)          { return make_scalar(data_type::u64, val); }
+        inline arg_desc make_arg(float val)             { return make_scalar(data_type::f32, val); }
+        inline arg_desc make_arg(double val)            { return make_scalar(data_type::f64, val); }
+        inline arg_desc make_arg(const perf_sample& sample)   { return make_reference(data_type::perf, &sample); }
+        inline arg_desc make_arg(const metric_sample& sample) { return make_reference(data_type::metric, &sample); }
+        inline arg_desc make_arg(const flow_marker& marker)   { return make_reference(data_type::flow, &marker); }
+        inline arg_desc make_arg(const array_param& arr)      { return make_reference(arr.type, &arr); }
 
-        inline uint8_t* pack_param_impl(uint8_t* dest, int8_t val)
-        {
-            constexpr size_t N = sizeof(int8_t);
-            *dest++ = (uint8_t)(data_type::i8);
-            memcpy(dest, &val, N);
-            return dest + N;
-        }
-
-        inline uint8_t* pack_param_impl(uint8_t* dest, uint8_t val)
+        /// Size Params
+        inline size_t arg_size(arg_desc& arg)
         {
-            constexpr size_t N = sizeof(uint8_t);
-            *dest++ = (uint8_t)(data_type::u8);
-            memcpy(dest, &val, N);
-            return dest + N;
+            switch(arg.type)
+            {
+                // strings are measured once here, pack_arg reuses the length
+                case data_type::utf8:
+                    if (arg.value.ptr == nullptr) {
+                        arg.value.ptr = UTF8_NULLSTRING;
+                        arg.length = unknown_length;
+                    }
+                    if (arg.length == unknown_length) {
+                        arg.length = string_length(static_cast<const char*>(arg.value.ptr));
+                    }
+                    return sizeof(char) * (arg.length + 1) + sizeof(data_type);
+                case data_type::utf16:
+                    if (arg.value.ptr == nullptr) {
+                        arg.value.ptr = UTF16_NULLSTRING;
+                    }
+                    arg.length = string_length(static_cast<const char16_t*>(arg.value.ptr));
+                    return sizeof(char16_t) * (arg.length + 1) + sizeof(data_type);
+                case data_type::utf32:
+                    if (arg.value.ptr == nullptr) {
+                        arg.value.ptr = UTF32_NULLSTRING;
+                    }
+                    arg.length = string_length(static_cast<const char32_t*>(arg.value.ptr));
+                    return sizeof(char32_t) * (arg.length + 1) + sizeof(data_type);
+                case data_type::perf:
+                    return param_size(*static_cast<const perf_sample*>(arg.value.ptr));
+                case data_type::metric:
+                    return param_size(*static_cast<const metric_sample*>(arg.value.ptr));
+                case data_type::flow:
+                    return param_size(*static_cast<const flow_marker*>(arg.value.ptr));
+                case data_type::array:
+                case data_type::blob:
+                    return param_size(*static_cast<const array_param*>(arg.value.ptr));
+                default:
+                    return scalar_size(arg.type) + sizeof(data_type);
+            }
         }
 
-        inline uint8_t* pack_param_impl(uint8_t* dest, int16_t val)
+        inline size_t param_size(const array_param& arr)
         {
-           constexpr size_t N = sizeof(int16_t);
-            *dest++ = (uint8_t)(data_type::i16);
-            memcpy(dest, &val, N);
-            return dest + N;
+            const size_t header = sizeof(uint32_t) * 2 + sizeof(data_type);
+            if (arr.type == data_type::array) {
+                return header + sizeof(data_type) + scalar_size(arr.element_type) * arr.count;
+            }
+            return header + arr.count;
         }
 
-        inline uint8_t* pack_param_impl(uint8_t* dest, uint16_t val)
+        /// Pack Params
+        inline uint8_t* pack_arg(uint8_t* dest, const arg_desc& arg)
         {
-            constexpr size_t N = sizeof(uint16_t);
-            *dest++ = (uint8_t)(data_type::u16);
-            memcpy(dest, &val, N);
-            return dest + N;
+            switch(arg.type)
+            {
+                case data_type::utf8:
+                case data_type::utf16:
+                case data_type::utf32:
+                {
+                    const size_t bytes = (arg.length + 1) * (arg.type == data_type::utf8  ? sizeof(char) :
+                                                             arg.type == data_type::utf16 ? sizeof(char16_t) :
+                                                                                            sizeof(char32_t));
+                    *dest++ = (uint8_t)(arg.type);
+                    memcpy(dest, arg.value.ptr, bytes);
+                    return dest + bytes;
+                }
+                case data_type::perf:
+                    return pack_param_impl(dest, *static_cast<const perf_sample*>(arg.value.ptr));
+                case data_type::metric:
+                    return pack_param_impl(dest, *static_cast<const metric_sample*>(arg.value.ptr));
+                case data_type::flow:
+                    return pack_param_impl(dest, *static_cast<const flow_marker*>(arg.value.ptr));
+                case data_type::array:
+                case data_type::blob:
+                    return pack_param_impl(dest, *static_cast<const array_param*>(arg.value.ptr));
+                default:
+                {
+                    const size_t N = scalar_size(arg.type);
+                    *dest++ = (uint8_t)(arg.type);
+                    memcpy(dest, &arg.value.bits, N);
+                    return dest + N;
+                }
+            }
         }
 
-        inline uint8_t* pack_param_impl(uint8_t* dest, int32_t val)
+        inline size_t param_size(const perf_sample& sample)
         {
-            constexpr size_t N = sizeof(int32_t);
-            *dest++ = (uint8_t)(data_type::i32);
-            memcpy(dest, &val, N);
-            return dest + N;
+            size_t counters = 0;
+            for(size_t k = 0; k < (size_t)perf_counter::count; ++k) {
+                counters += (sample.valid_mask >> k) & 1;
+            }
+            return sizeof(uint8_t) + sizeof(uint64_t) * (1 + counters) + sizeof(data_type);
         }
 
-        inline uint8_t* pack_param_impl(uint8_t* dest, uint32_t val)
+        inline uint8_t* pack_param_impl(uint8_t* dest, const perf_sample& sample)
         {
-            constexpr size_t N = sizeof(uint32_t);
-            *dest++ = (uint8_t)(data_type::u32);
-            memcpy(dest, &val, N);
-            return dest + N;
+            *dest++ = (uint8_t)(data_type::perf);
+            *dest++ = sample.valid_mask;
+            memcpy(dest, &sample.duration, sizeof(uint64_t));
+            dest += sizeof(uint64_t);
+            for(size_t k = 0; k < (size_t)perf_counter::count; ++k) {
+                if (sample.valid_mask & (1 << k)) {
+                    memcpy(dest, &sample.values[k], sizeof(uint64_t));
+                    dest += sizeof(uint64_t);
+                }
+            }
+            return dest;
         }
-
-        inline uint8_t* pack_param_impl(uint8_t* dest, int64_t val)
+        inline size_t param_size(const metric_sample& sample)
         {
-            constexpr size_t N = sizeof(int64_t);
-            *dest++ = (uint8_t)(data_type::i64);
-            memcpy(dest, &val, N);
-            return dest + N;
+            size_t size = sizeof(data_type) + sizeof(metric_kind);
+            switch(sample.kind)
+            {
+                case metric_kind::counter:
+                    return size + sizeof(int64_t);
+                case metric_kind::gauge:
+                    return size + sizeof(double) * 3;
+                case metric_kind::histogram:
+                    size += sizeof(uint64_t) + sizeof(double) * 3 + sizeof(uint8_t);
+                    for(size_t k = 0; k < metric_histogram_buckets; ++k) {
+                        if (sample.buckets[k] != 0) {
+                            size += sizeof(uint8_t) + sizeof(uint64_t);
+                        }
+                    }
+                    return size;
+            }
+            return size;
         }
 
-        inline uint8_t* pack_param_impl(uint8_t* dest, uint64_t val)
+        inline uint8_t* pack_param_impl(uint8_t* dest, const metric_sample& sample)
         {
-            constexpr size_t N = sizeof(uint64_t);
-            *dest++ = (uint8_t)(data_type::u64);
-            memcpy(dest, &val, N);
-            return dest + N;
+            *dest++ = (uint8_t)(data_type::metric);
+            *dest++ = (uint8_t)(sample.kind);
+            switch(sample.kind)
+            {
+                case metric_kind::counter:
+                    memcpy(dest, &sample.sum, sizeof(int64_t));
+                    return dest + sizeof(int64_t);
+                case metric_kind::gauge:
+                    memcpy(dest, &sample.last, sizeof(double));
+                    dest += sizeof(double);
+                    memcpy(dest, &sample.min, sizeof(double));
+                    dest += sizeof(double);
+                    memcpy(dest, &sample.max, sizeof(double));
+                    return dest + sizeof(double);
+                case metric_kind::histogram:
+                {
+                    memcpy(dest, &sample.count, sizeof(uint64_t));
+                    dest += sizeof(uint64_t);
+                    memcpy(dest, &sample.total, sizeof(double));
+                    dest += sizeof(double);
+                    memcpy(dest, &sample.min, sizeof(double));
+                    dest += sizeof(double);
+                    memcpy(dest, &sample.max, sizeof(double));
+                    dest += sizeof(double);
+                    uint8_t* bucket_count = dest++;
+                    *bucket_count = 0;
+                    for(size_t k = 0; k < metric_histogram_buckets; ++k) {
+                        if (sample.buckets[k] != 0) {
+                            *dest++ = (uint8_t)k;
+                            memcpy(dest, &sample.buckets[k], sizeof(uint64_t));
+                            dest += sizeof(uint64_t);
+                            ++*bucket_count;
+                        }
+                    }
+                    return dest;
+                }
+            }
+            return dest;
         }
 
-        inline uint8_t* pack_param_impl(uint8_t* dest, float val)
+        inline uint8_t* pack_param_impl(uint8_t* dest, const flow_marker& marker)
         {
-            constexpr size_t N = sizeof(float);
-            *dest++ = (uint8_t)(data_type::f32);
-            memcpy(dest, &val, N);
-            return dest + N;
+            *dest++ = (uint8_t)(data_type::flow);
+            *dest++ = (uint8_t)(marker.phase);
+            memcpy(dest, &marker.id, sizeof(uint64_t));
+            return dest + sizeof(uint64_t);
         }
 
-        inline uint8_t* pack_param_impl(uint8_t* dest, double val)
+        inline uint8_t* pack_param_impl(uint8_t* dest, const array_param& arr)
         {
-            constexpr size_t N = sizeof(double);
-            *dest++ = (uint8_t)(data_type::f64);
-            memcpy(dest, &val, N);
-            return dest + N;
+            *dest++ = (uint8_t)(arr.type);
+            size_t bytes = arr.count;
+            if (arr.type == data_type::array) {
+                *dest++ = (uint8_t)(arr.element_type);
+                bytes *= scalar_size(arr.element_type);
+            }
+            memcpy(dest, &arr.count, sizeof(uint32_t));
+            dest += sizeof(uint32_t);
+            memcpy(dest, &arr.total, sizeof(uint32_t));
+            dest += sizeof(uint32_t);
+            memcpy(dest, arr.data, bytes);
+            return dest + bytes;
         }
 
         inline message* alloc_msg(size_t size)
@@ -455,6 +711,22 @@ namespace tbb
             return thread_id;
         }
 
+        inline uint32_t get_process_id()
+        {
+#ifdef _WIN32
+            return GetCurrentProcessId();
+#else
+            return getpid();
+#endif
+        }
+
+        // id of the flow this thread is currently working on behalf of, 0 if none
+        inline uint64_t& get_flow_context()
+        {
+            static thread_local uint64_t flow_context = 0;
+            return flow_context;
+        }
+
         inline void thread_yield()
         {
 #ifdef _WIN32
@@ -565,36 +837,53 @@ namespace tbb
 #endif
         }
 
-        inline file_t get_log_file(int32_t childID)
+        // logs are written to $TBB_LOG_DIR when it's set, otherwise to firefox in
+        // the temp directory
+        inline size_t get_log_directory(char* buffer, size_t len)
         {
-            char filename[1024];
-            char* head = filename;
-            head += get_temp_path(head, sizeof(filename));
-#if _WIN32
-            head += sprintf(head, "firefox");
-            CreateDirectoryA(filename, nullptr);
-            if (childID >= 0)
+            const char* log_dir = getenv("TBB_LOG_DIR");
+            if (log_dir != nullptr && log_dir[0] != 0)
             {
-                sprintf(head, "\\firefox%i.bin", childID);
-            }
-            else
-            {
-                sprintf(head, "\\other%i.bin", -childID);
+                const size_t written = snprintf(buffer, len, "%s", log_dir);
+                return written < len ? written : len - 1;
             }
+            size_t head = get_temp_path(buffer, len);
+#if _WIN32
+            head += snprintf(buffer + head, len - head, "firefox");
+#else
+            head += snprintf(buffer + head, len - head, "/firefox");
+#endif
+            return head;
+        }
 
+        inline void get_log_path(char* buffer, size_t len, int32_t childID)
+        {
+            size_t head = get_log_directory(buffer, len);
+#if _WIN32
+            const char separator[] = "\\";
 #else
-            head += sprintf(head, "/firefox");
-            mkdir(filename, 0777);
-            if (childID >=0)
+            const char separator[] = "/";
+#endif
+            if (childID >= 0)
             {
-                sprintf(head, "/firefox%i.bin", childID);
+                snprintf(buffer + head, len - head, "%sfirefox%i.bin", separator, childID);
             }
             else
             {
-                sprintf(head, "/other%i.bin", -childID);
+                snprintf(buffer + head, len - head, "%sother%i.bin", separator, -childID);
             }
+        }
 
+        inline file_t get_log_file(int32_t childID)
+        {
+            char filename[1024];
+            get_log_directory(filename, sizeof(filename));
+#if _WIN32
+            CreateDirectoryA(filename, nullptr);
+#else
+            mkdir(filename, 0777);
 #endif
+            get_log_path(filename, sizeof(filename), childID);
             return open_file(filename);
         }
 
@@ -624,6 +913,128 @@ namespace tbb
             fclose(file);
 #endif
         }
+
+        // per-thread group of performance counters, counting only the calling thread
+        class perf_counters
+        {
+            typedef serialization::perf_counter perf_counter;
+            static constexpr size_t counter_count = (size_t)perf_counter::count;
+        public:
+            perf_counters()
+            {
+                for(size_t k = 0; k < counter_count; ++k) {
+                    group_slot[k] = -1;
+                }
+#ifndef _WIN32
+                // hardware counters are opened first so one of them leads the group; if the PMU
+                // isn't exposed (VMs, containers, sandboxes) the software counters lead instead
+                const struct
+                {
+                    uint32_t type;
+                    uint64_t config;
+                } events[counter_count] =
+                {
+                    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+                    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+                    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+                    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+                    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+                    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+                };
+
+                int32_t slot = 0;
+                for(size_t k = 0; k < counter_count; ++k) {
+                    const int fd = open_counter(events[k].type, events[k].config);
+                    if (fd < 0) {
+                        continue;
+                    }
+                    if (group_fd < 0) {
+                        group_fd = fd;
+                    }
+                    fds[slot] = fd;
+                    group_slot[k] = slot++;
+                }
+                group_size = slot;
+#endif
+            }
+
+            ~perf_counters()
+            {
+#ifndef _WIN32
+                for(int32_t k = 0; k < group_size; ++k) {
+                    close(fds[k]);
+                }
+#endif
+            }
+
+            // reads current counter values and how long the group has been enabled and actually
+            // counting, returns mask of counters which could be read
+            uint8_t read(uint64_t (&values)[counter_count], uint64_t& time_enabled, uint64_t& time_running)
+            {
+                uint8_t valid_mask = 0;
+#ifndef _WIN32
+                if (group_fd < 0) {
+                    return valid_mask;
+                }
+
+                // layout of a PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING read
+                struct
+                {
+                    uint64_t nr;
+                    uint64_t time_enabled;
+                    uint64_t time_running;
+                    uint64_t values[counter_count];
+                } group;
+                if (::read(group_fd, &group, sizeof(group)) < (ssize_t)(3 * sizeof(uint64_t))) {
+                    return valid_mask;
+                }
+                time_enabled = group.time_enabled;
+                time_running = group.time_running;
+
+                for(size_t k = 0; k < counter_count; ++k) {
+                    const int32_t slot = group_slot[k];
+                    if (slot >= 0 && (uint64_t)slot < group.nr) {
+                        values[k] = group.values[slot];
+                        valid_mask |= (1 << k);
+                    }
+                }
+#endif
+                return valid_mask;
+            }
+
+        private:
+#ifndef _WIN32
+            int open_counter(uint32_t type, uint64_t config)
+            {
+                perf_event_attr attr;
+                memset(&attr, 0x00, sizeof(attr));
+                attr.size = sizeof(attr);
+                attr.type = type;
+                attr.config = config;
+                attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+                attr.exclude_hv = 1;
+
+                // count kernel time where allowed, otherwise fall back to user-space only
+                int fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+                if (fd < 0) {
+                    attr.exclude_kernel = 1;
+                    fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+                }
+                return fd;
+            }
+
+            int fds[counter_count];
+#endif
+            int group_fd = -1;
+            int32_t group_size = 0;
+            int32_t group_slot[counter_count];
+        };
+
+        inline perf_counters& get_perf_counters()
+        {
+            static thread_local perf_counters counters;
+            return counters;
+        }
     }
 
 
@@ -674,47 +1085,132 @@ namespace tbb
 #endif
     };
 
+    // for short critical sections which are almost never contended
+    class spin_lock
+    {
+    public:
+        void lock()
+        {
+            while (locked.exchange(true, std::memory_order_acquire)) {
+                internal::thread_yield();
+            }
+        }
+
+        void unlock()
+        {
+            locked.store(false, std::memory_order_release);
+        }
+    private:
+        std::atomic_bool locked{false};
+    };
+
+    namespace metrics
+    {
+        // logs a snapshot of every thread's changed metrics, called from the logger thread
+        inline void collect();
+    }
+
     class logger
     {
         typedef std::vector<serialization::message*> message_queue_t;
     public:
 
+        // log sites only capture their arguments into descriptors, sizing and packing is left
+        // to log_args so it isn't instantiated for every combination of literal lengths and types
         template<size_t N, typename... ARGS>
-        static void __attribute__((noinline)) debug_log(const char* func, const char* file, uint32_t line, const char(&fmt)[N], ARGS&&... args)
+        static inline __attribute__((always_inline)) void debug_log(const char* func, const char* file, uint32_t line, const char(&fmt)[N], ARGS&&... args)
         {
-            const uint64_t timestamp = internal::get_timestamp();
+            serialization::arg_desc descs[] =
+            {
+                serialization::make_arg(func),
+                serialization::make_arg(file),
+                serialization::make_arg(line),
+                serialization::make_literal(fmt),
+                serialization::make_arg(std::forward<ARGS>(args))...
+            };
+            log_args(descs, sizeof(descs) / sizeof(descs[0]), true);
+        }
 
-            auto& self = logger::get();
+        template<size_t N, size_t M, size_t O, typename... ARGS>
+        static inline __attribute__((always_inline)) void log(const char (&func)[N], const char (&file)[M], uint32_t line, const char (&fmt)[O], ARGS&&... args)
+        {
+            serialization::arg_desc descs[] =
+            {
+                serialization::make_literal(func),
+                serialization::make_literal(file),
+                serialization::make_arg(line),
+                serialization::make_literal(fmt),
+                serialization::make_arg(std::forward<ARGS>(args))...
+            };
+            log_args(descs, sizeof(descs) / sizeof(descs[0]), true);
+        }
 
-            size_t size = serialization::msg_size(func, file, line, fmt, std::forward<ARGS>(args)...);
-            auto* msg = serialization::alloc_msg(size);
-            serialization::write_msg(msg, func, file, line, fmt, std::forward<ARGS>(args)...);
+        template<size_t N, size_t M, size_t O, typename... ARGS>
+        static inline __attribute__((always_inline)) void log_flow(serialization::flow_phase phase, uint64_t id, const char (&func)[N], const char (&file)[M], uint32_t line, const char (&fmt)[O], ARGS&&... args)
+        {
+            const serialization::flow_marker flow = {phase, id};
+            serialization::arg_desc descs[] =
+            {
+                serialization::make_literal(func),
+                serialization::make_literal(file),
+                serialization::make_arg(line),
+                serialization::make_literal(fmt),
+                serialization::make_arg(std::forward<ARGS>(args))...,
+                serialization::make_arg(flow)
+            };
+            log_args(descs, sizeof(descs) / sizeof(descs[0]), false);
+        }
 
-            // write info about logger
-            self.enqueue_msg(msg, timestamp);
+        // snapshots may be logged by the logger thread on behalf of the thread which recorded them
+        static void log_metric(uint32_t thread_id, const char* func, const char* file, uint32_t line, const char* name, const serialization::metric_sample& sample)
+        {
+            const uint64_t timestamp = internal::get_timestamp();
+
+            serialization::arg_desc descs[] =
+            {
+                serialization::make_arg(func),
+                serialization::make_arg(file),
+                serialization::make_arg(line),
+                serialization::make_arg(name),
+                serialization::make_arg(sample),
+            };
+            const size_t count = sizeof(descs) / sizeof(descs[0]);
+            auto* msg = serialization::alloc_msg(serialization::msg_size(descs, count));
+            serialization::write_msg(msg, descs, count);
+
+            logger::get().enqueue_msg(msg, timestamp, thread_id);
         }
 
-        template<size_t N, size_t M, size_t O, typename... ARGS>
-        static void __attribute__((noinline)) log(const char (&func)[N], const char (&file)[M], uint32_t line, const char (&fmt)[O], ARGS&&... args)
+        // shared serializer behind every log site
+        static void __attribute__((noinline)) log_args(serialization::arg_desc* args, size_t count, bool tag_flow_context)
         {
             const uint64_t timestamp = internal::get_timestamp();
 
             auto& self = logger::get();
 
-            size_t size = serialization::msg_size(func, file, line, fmt, std::forward<ARGS>(args)...);
+            // records logged within a flow context are tagged with it
+            const serialization::flow_marker flow = {serialization::flow_phase::context, tag_flow_context ? internal::get_flow_context() : 0};
+
+            size_t size = serialization::msg_size(args, count);
+            if (flow.id != 0) {
+                size += serialization::param_size(flow);
+            }
             auto* msg = serialization::alloc_msg(size);
-            serialization::write_msg(msg, func, file, line, fmt, std::forward<ARGS>(args)...);
+            serialization::write_msg(msg, args, count);
+            if (flow.id != 0) {
+                serialization::append_msg(msg, flow);
+            }
 
             // write info about logger
-            self.enqueue_msg(msg, timestamp);
+            self.enqueue_msg(msg, timestamp, internal::get_thread_id());
         }
 
     private:
 
-        void enqueue_msg(serialization::message* msg, uint64_t timestamp)
+        void enqueue_msg(serialization::message* msg, uint64_t timestamp, uint32_t thread_id)
         {
             msg->timestamp= timestamp;
-            msg->thread_id = internal::get_thread_id();
+            msg->thread_id = thread_id;
 
             ++remaining_messages;
             queue_lock.lock();
@@ -786,9 +1282,19 @@ namespace tbb
             const int32_t childID = internal::get_child_id();
             auto log_file = internal::get_log_file(childID);
             size_t total_messages_written = 0;
+            constexpr uint64_t METRICS_INTERVAL = uint64_t(TBB_METRICS_INTERVAL_MS) * 1000000;
+            uint64_t last_collect = internal::get_timestamp();
             // spin until exit is signalled (unless there are remaining messages to write)
             while(!self.signal_exit || self.remaining_messages != 0)
             {
+                // metrics are snapshot here rather than by the threads recording them, so threads
+                // which have gone idle are still flushed and updates never read the clock
+                const uint64_t now = internal::get_timestamp();
+                if (now - last_collect >= METRICS_INTERVAL) {
+                    metrics::collect();
+                    last_collect = now;
+                }
+
                 // repeatedly spin until message queues are empty
                 while (self.remaining_messages != 0)
                 {
@@ -810,7 +1316,8 @@ namespace tbb
                 internal::flush_file(log_file);
 
                 // sleep for a bit rather than spinning
-                while (!self.signal_exit && self.remaining_messages == 0) {
+                while (!self.signal_exit && self.remaining_messages == 0 &&
+                       internal::get_timestamp() - last_collect < METRICS_INTERVAL) {
                     internal::thread_sleep(20);
                 }
             }
@@ -834,6 +1341,355 @@ namespace tbb
         pthread_t logger_thread;
 #endif
     };
+
+    namespace metrics
+    {
+        typedef serialization::metric_kind metric_kind;
+        typedef serialization::metric_sample metric_sample;
+
+        struct site
+        {
+            uint32_t id;
+            metric_kind kind;
+            const char* func;
+            const char* file;
+            uint32_t line;
+            const char* name;
+        };
+
+        // a metric's name is logged as its record's format string, so braces in it are doubled
+        // to print literally rather than being parsed as replacement fields
+        inline const char* escape_name(const char* name)
+        {
+            size_t braces = 0;
+            for(const char* c = name; *c; ++c) {
+                braces += (*c == '{' || *c == '}');
+            }
+            if (braces == 0) {
+                return name;
+            }
+
+            char* escaped = static_cast<char*>(malloc(strlen(name) + braces + 1));
+            char* dest = escaped;
+            for(const char* c = name; *c; ++c) {
+                if (*c == '{' || *c == '}') {
+                    *dest++ = *c;
+                }
+                *dest++ = *c;
+            }
+            *dest = 0;
+            return escaped;
+        }
+
+        // sites are registered once and live for the lifetime of the process
+        inline const site* register_site(const char* func, const char* file, uint32_t line, const char* name, metric_kind kind)
+        {
+            static mutex registry_lock;
+            static uint32_t site_count = 0;
+
+            name = escape_name(name);
+            registry_lock.lock();
+            auto retval = new site{site_count++, kind, func, file, line, name};
+            registry_lock.unlock();
+            return retval;
+        }
+
+        class thread_metrics;
+
+        struct thread_registry
+        {
+            mutex lock;
+            std::vector<thread_metrics*> threads;
+        };
+
+        // never destroyed, threads may still exit while static objects are being destroyed
+        inline thread_registry& get_thread_registry()
+        {
+            static thread_registry* retval = new thread_registry();
+            return *retval;
+        }
+
+        // this thread's accumulated metrics, snapshot to the log by the logger thread every
+        // TBB_METRICS_INTERVAL_MS and by the thread itself when it exits
+        class thread_metrics
+        {
+            struct slot
+            {
+                const site* owner;
+                bool dirty;
+                metric_sample sample;
+            };
+        public:
+            thread_metrics()
+            : thread_id(internal::get_thread_id())
+            {
+                auto& registry = get_thread_registry();
+                registry.lock.lock();
+                registry.threads.push_back(this);
+                registry.lock.unlock();
+            }
+
+            ~thread_metrics()
+            {
+                auto& registry = get_thread_registry();
+                registry.lock.lock();
+                registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), this));
+                registry.lock.unlock();
+
+                flush();
+            }
+
+            // only called with the lock held
+            metric_sample& get(const site* s)
+            {
+                if (s->id >= slots.size()) {
+                    slots.resize(s->id + 1);
+                }
+                auto& current = slots[s->id];
+                if (!current.dirty) {
+                    if (current.owner == nullptr) {
+                        current.owner = s;
+                    }
+                    reset(current.sample, s->kind);
+                    current.dirty = true;
+                    dirty_slots.push_back(s->id);
+                }
+                return current.sample;
+            }
+
+            // called by the logger thread (holding the registry lock) or by the destructor once
+            // unregistered, so only ever one at a time
+            void flush()
+            {
+                // the samples are copied out under the lock so the recording thread isn't held
+                // up while they're logged
+                lock.lock();
+                for(auto id : dirty_slots) {
+                    auto& current = slots[id];
+                    pending.push_back(current);
+                    current.dirty = false;
+                }
+                dirty_slots.clear();
+                lock.unlock();
+
+                for(const auto& current : pending) {
+                    const site* s = current.owner;
+                    logger::log_metric(thread_id, s->func, s->file, s->line, s->name, current.sample);
+                }
+                pending.clear();
+            }
+
+            // guards slots and dirty_slots, only contended while the logger thread takes a snapshot
+            spin_lock lock;
+
+        private:
+            static void reset(metric_sample& sample, metric_kind kind)
+            {
+                sample.kind = kind;
+                sample.sum = 0;
+                sample.count = 0;
+                sample.last = 0.0;
+                sample.total = 0.0;
+                sample.min = 0.0;
+                sample.max = 0.0;
+                if (kind == metric_kind::histogram) {
+                    memset(sample.buckets, 0x00, sizeof(sample.buckets));
+                }
+            }
+
+            const uint32_t thread_id;
+            std::vector<slot> slots;
+            std::vector<uint32_t> dirty_slots;
+            std::vector<slot> pending;
+        };
+
+        inline thread_metrics& get_thread_metrics()
+        {
+            static thread_local thread_metrics retval;
+            return retval;
+        }
+
+        inline void collect()
+        {
+            auto& registry = get_thread_registry();
+            registry.lock.lock();
+            for(auto* thread : registry.threads) {
+                thread->flush();
+            }
+            registry.lock.unlock();
+        }
+
+        inline void counter_add(const site* s, int64_t value)
+        {
+            auto& self = get_thread_metrics();
+            self.lock.lock();
+            self.get(s).sum += value;
+            self.lock.unlock();
+        }
+
+        inline void gauge_set(const site* s, double value)
+        {
+            auto& self = get_thread_metrics();
+            self.lock.lock();
+            auto& sample = self.get(s);
+            if (sample.count++ == 0) {
+                sample.min = value;
+                sample.max = value;
+            }
+            sample.last = value;
+            sample.min = value < sample.min ? value : sample.min;
+            sample.max = value > sample.max ? value : sample.max;
+            self.lock.unlock();
+        }
+
+        inline void histogram_record(const site* s, double value)
+        {
+            auto& self = get_thread_metrics();
+            self.lock.lock();
+            auto& sample = self.get(s);
+            if (sample.count++ == 0) {
+                sample.min = value;
+                sample.max = value;
+            }
+            sample.total += value;
+            sample.min = value < sample.min ? value : sample.min;
+            sample.max = value > sample.max ? value : sample.max;
+
+            size_t bucket = 0;
+            if (value >= 1.0) {
+                int exponent;
+                frexp(value, &exponent);
+                bucket = (size_t)exponent < serialization::metric_histogram_buckets ?
+                         (size_t)exponent : serialization::metric_histogram_buckets - 1;
+            }
+            sample.buckets[bucket]++;
+            self.lock.unlock();
+        }
+    }
+
+    // logs up to max_count elements of an integer or floating point array
+    template<typename T>
+    serialization::array_param span(const T* data, size_t count, size_t max_count = TBB_MAX_SPAN_COUNT)
+    {
+        static_assert(serialization::element_type<T>::value != serialization::data_type::invalid,
+                      "span elements must be int8_t to int64_t, uint8_t to uint64_t, float or double");
+        // counts beyond what the record's u32 can hold are saturated
+        const uint32_t total = data ? (count < UINT32_MAX ? (uint32_t)count : UINT32_MAX) : 0;
+        return {serialization::data_type::array, serialization::element_type<T>::value,
+                total < max_count ? total : (uint32_t)max_count, total, data};
+    }
+
+    template<typename T>
+    serialization::array_param span(const std::vector<T>& vec, size_t max_count = TBB_MAX_SPAN_COUNT)
+    {
+        return span(vec.data(), vec.size(), max_count);
+    }
+
+    // logs up to max_bytes of a buffer, printed as a hexdump
+    inline serialization::array_param blob(const void* data, size_t bytes, size_t max_bytes = TBB_MAX_BLOB_BYTES)
+    {
+        const uint32_t total = data ? (bytes < UINT32_MAX ? (uint32_t)bytes : UINT32_MAX) : 0;
+        return {serialization::data_type::blob, serialization::data_type::u8,
+                total < max_bytes ? total : (uint32_t)max_bytes, total, data};
+    }
+
+    // returns an id which is unique across this session's threads and processes
+    inline uint64_t new_flow_id()
+    {
+        static std::atomic<uint32_t> flow_count(0);
+        return (uint64_t(internal::get_process_id()) << 32) | uint64_t(++flow_count);
+    }
+
+    // sets this thread's flow context for the lifetime of the object, restoring the previous one afterwards
+    class flow_context
+    {
+    public:
+        explicit flow_context(uint64_t id)
+        : previous(internal::get_flow_context())
+        {
+            internal::get_flow_context() = id;
+        }
+
+        ~flow_context()
+        {
+            internal::get_flow_context() = previous;
+        }
+
+        flow_context(const flow_context&) = delete;
+        flow_context& operator=(const flow_context&) = delete;
+    private:
+        const uint64_t previous;
+    };
+
+    // logs a record for the enclosing scope on exit, with its duration and optionally
+    // the deltas of this thread's performance counters
+    template<size_t N, size_t M, size_t O>
+    class scope
+    {
+        typedef serialization::perf_counter perf_counter;
+        static constexpr size_t counter_count = (size_t)perf_counter::count;
+    public:
+        scope(const char (&func)[N], const char (&file)[M], uint32_t line, const char (&fmt)[O], bool perf)
+        : func(func)
+        , file(file)
+        , line(line)
+        , fmt(fmt)
+        , valid_mask(0)
+        {
+            if (perf) {
+                valid_mask = internal::get_perf_counters().read(begin_values, begin_enabled, begin_running);
+            }
+            begin_timestamp = internal::get_timestamp();
+        }
+
+        ~scope()
+        {
+            const uint64_t end_timestamp = internal::get_timestamp();
+
+            serialization::perf_sample sample;
+            sample.valid_mask = 0;
+            sample.duration = end_timestamp - begin_timestamp;
+            if (valid_mask) {
+                uint64_t end_values[counter_count];
+                uint64_t end_enabled = 0;
+                uint64_t end_running = 0;
+                sample.valid_mask = valid_mask & internal::get_perf_counters().read(end_values, end_enabled, end_running);
+
+                // when the kernel time-shares more counters than the PMU has, the group only counts
+                // for part of the scope, so extrapolate to the whole scope and flag the sample
+                const uint64_t enabled = end_enabled - begin_enabled;
+                const uint64_t running = end_running - begin_running;
+                if (running == 0 && enabled != 0) {
+                    sample.valid_mask = 0;
+                }
+                const bool multiplexed = sample.valid_mask != 0 && running < enabled;
+                for(size_t k = 0; k < counter_count; ++k) {
+                    if (sample.valid_mask & (1 << k)) {
+                        sample.values[k] = end_values[k] - begin_values[k];
+                        if (multiplexed) {
+                            sample.values[k] = (uint64_t)((double)sample.values[k] * enabled / running);
+                        }
+                    }
+                }
+                if (multiplexed) {
+                    sample.valid_mask |= serialization::PERF_MULTIPLEXED;
+                }
+            }
+
+            logger::log(func, file, line, fmt, sample);
+        }
+
+    private:
+        const char (&func)[N];
+        const char (&file)[M];
+        const uint32_t line;
+        const char (&fmt)[O];
+        uint64_t begin_timestamp;
+        uint8_t valid_mask;
+        uint64_t begin_values[counter_count];
+        uint64_t begin_enabled = 0;
+        uint64_t begin_running = 0;
+    };
 }
 
 #endif // TBB_LOGGER_H
@@ -0,0 +1,1207 @@
+#ifndef TBB_READER_H
+#define TBB_READER_H
+
+// Zero-copy access to the .bin logs written by TbbLogger.h: files are mapped
+// read-only, records are walked in place, and a record's params decode to
+// views into the mapping.  Archives written by aggregate --repack are decoded
+// into memory a block at a time as they're read, and read the same way.  Records whose site or params
+// don't fit within their length are skipped as the mapping is walked.  Shared
+// by aggregate and analysis tools.
+//
+//     tbb::reader::mapped_file mapped;
+//     tbb::reader::map_file("/tmp/firefox/firefox0.bin", mapped);
+//     tbb::reader::decoded_record record;
+//     for (const auto* msg : tbb::reader::records(mapped)) {
+//         auto site = tbb::reader::locate_site(msg);
+//         tbb::reader::decode_record(msg, record);
+//     }
+//     tbb::reader::unmap_file(mapped);
+
+// C
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+// C++
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <queue>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "TbbLogger.h"
+
+namespace tbb
+{
+    namespace reader
+    {
+        using serialization::data_type;
+        using serialization::message;
+
+        struct archive_decoder;
+
+        // read-only mapping of an entire log file, messages are read in place
+        struct mapped_file
+        {
+            const uint8_t* data;
+            size_t size;
+            // decoded from an archive written by aggregate --repack, the records
+            // are then in memory and already in timestamp order
+            bool archive;
+            // the archive itself, whose blocks are decoded into data as they're read
+            archive_decoder* decoder;
+#ifdef _WIN32
+            HANDLE file;
+            HANDLE mapping;
+#endif
+        };
+
+        inline bool open_archive(mapped_file& mapped);
+        inline void close_archive(mapped_file& mapped);
+        inline bool decode_archive_at(const mapped_file& mapped, size_t offset);
+        inline bool validate_record(const message* msg);
+
+        // logs and archives are both accepted, an archive's records are decoded
+        // into memory as they're reached and then read like a log's
+        inline bool map_file(const char* filename, mapped_file& mapped)
+        {
+            mapped.data = nullptr;
+            mapped.size = 0;
+            mapped.archive = false;
+            mapped.decoder = nullptr;
+#ifdef _WIN32
+            mapped.file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                                      OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+            mapped.mapping = nullptr;
+            if (mapped.file == INVALID_HANDLE_VALUE) {
+                return false;
+            }
+            LARGE_INTEGER size;
+            if (!GetFileSizeEx(mapped.file, &size)) {
+                CloseHandle(mapped.file);
+                return false;
+            }
+            mapped.size = (size_t)size.QuadPart;
+            // empty files can't be mapped, but are valid logs
+            if (mapped.size == 0) {
+                return true;
+            }
+            mapped.mapping = CreateFileMappingA(mapped.file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapped.mapping == nullptr) {
+                CloseHandle(mapped.file);
+                return false;
+            }
+            mapped.data = (const uint8_t*)MapViewOfFile(mapped.mapping, FILE_MAP_READ, 0, 0, 0);
+            if (mapped.data == nullptr) {
+                CloseHandle(mapped.mapping);
+                CloseHandle(mapped.file);
+                return false;
+            }
+            if (!open_archive(mapped)) {
+                UnmapViewOfFile(mapped.data);
+                CloseHandle(mapped.mapping);
+                CloseHandle(mapped.file);
+                return false;
+            }
+#else
+            int fd = open(filename, O_RDONLY);
+            if (fd < 0) {
+                return false;
+            }
+            struct stat st;
+            if (fstat(fd, &st) != 0) {
+                close(fd);
+                return false;
+            }
+            mapped.size = (size_t)st.st_size;
+            // empty files can't be mapped, but are valid logs
+            if (mapped.size != 0) {
+                void* data = mmap(nullptr, mapped.size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data == MAP_FAILED) {
+                    close(fd);
+                    return false;
+                }
+                mapped.data = (const uint8_t*)data;
+            }
+            // the mapping keeps the file referenced
+            close(fd);
+            if (!open_archive(mapped)) {
+                if (mapped.data) {
+                    munmap((void*)mapped.data, mapped.size);
+                }
+                return false;
+            }
+#endif
+            return true;
+        }
+
+        inline void unmap_file(mapped_file& mapped)
+        {
+            if (mapped.archive) {
+                close_archive(mapped);
+            }
+#ifdef _WIN32
+            if (mapped.data) {
+                UnmapViewOfFile(mapped.data);
+                CloseHandle(mapped.mapping);
+            }
+            CloseHandle(mapped.file);
+#else
+            if (mapped.data) {
+                munmap((void*)mapped.data, mapped.size);
+            }
+#endif
+            mapped.data = nullptr;
+            mapped.size = 0;
+        }
+
+        // returns the next message from offset on and advances past it, or nullptr at
+        // the end of the mapping or at a record whose length doesn't fit.  Records
+        // whose site or params don't fit within their length are skipped, and
+        // counted in malformed when it's given
+        inline const message* next_message(const mapped_file& mapped, size_t& offset, size_t* malformed = nullptr)
+        {
+            while (offset + sizeof(message) <= mapped.size)
+            {
+                // an archive's block is decoded when its first record is reached
+                if (mapped.archive && !decode_archive_at(mapped, offset)) {
+                    return nullptr;
+                }
+                uint32_t len;
+                ::memcpy(&len, mapped.data + offset, sizeof(len));
+                if (len < sizeof(message) || len > mapped.size - offset) {
+                    return nullptr;
+                }
+                const message* msg = reinterpret_cast<const message*>(mapped.data + offset);
+                offset += len;
+                // archives are only decoded from blocks which were checked
+                if (mapped.archive || validate_record(msg)) {
+                    return msg;
+                }
+                if (malformed) {
+                    ++*malformed;
+                }
+            }
+            return nullptr;
+        }
+
+        // appends each well formed message in the mapping, a truncated trailing message
+        // (from a logger which didn't shut down cleanly) is ignored; returns the
+        // offset where the complete records end
+        inline size_t scan_messages(const mapped_file& mapped, std::vector<const message*>& messages, size_t* malformed = nullptr)
+        {
+#ifndef _WIN32
+            if (mapped.data) {
+                madvise((void*)mapped.data, mapped.size, MADV_SEQUENTIAL);
+            }
+#endif
+
+            size_t offset = 0;
+            while (const message* msg = next_message(mapped, offset, malformed))
+            {
+                messages.push_back(msg);
+            }
+
+#ifndef _WIN32
+            // messages are printed in timestamp order rather than file order
+            if (mapped.data) {
+                madvise((void*)mapped.data, mapped.size, MADV_NORMAL);
+            }
+#endif
+            return offset;
+        }
+
+        // range over the well formed records of a mapping in file order
+        class record_range
+        {
+        public:
+            class iterator
+            {
+            public:
+                iterator(const mapped_file* mapped, size_t offset)
+                : mapped(mapped)
+                , next_offset(offset)
+                , current(mapped ? next_message(*mapped, next_offset) : nullptr)
+                { }
+
+                const message* operator*() const
+                {
+                    return current;
+                }
+
+                iterator& operator++()
+                {
+                    current = next_message(*mapped, next_offset);
+                    return *this;
+                }
+
+                // position of the current record in the file
+                size_t position() const
+                {
+                    return size_t(reinterpret_cast<const uint8_t*>(current) - mapped->data);
+                }
+
+                bool operator!=(const iterator& other) const
+                {
+                    return current != other.current;
+                }
+
+            private:
+                const mapped_file* mapped;
+                size_t next_offset;
+                const message* current;
+            };
+
+            explicit record_range(const mapped_file& mapped, size_t offset = 0)
+            : mapped(mapped)
+            , offset(offset)
+            { }
+
+            iterator begin() const
+            {
+                return iterator(&mapped, offset);
+            }
+
+            iterator end() const
+            {
+                return iterator(nullptr, 0);
+            }
+
+        private:
+            const mapped_file& mapped;
+            size_t offset;
+        };
+
+        inline record_range records(const mapped_file& mapped, size_t offset = 0)
+        {
+            return record_range(mapped, offset);
+        }
+
+        // message buffers have no alignment guarantees, so anything wider than a byte
+        // which points into one is read through load_unaligned
+        template<typename T>
+        inline T load_unaligned(const uint8_t* ptr)
+        {
+            T retval;
+            ::memcpy(&retval, ptr, sizeof(T));
+            return retval;
+        }
+
+        // length in code units of a null terminated string, including the terminator
+        template<typename CharType>
+        size_t string_length(const uint8_t* str)
+        {
+            size_t len = 1;
+            while(load_unaligned<CharType>(str) != (CharType)0) {
+                str += sizeof(CharType);
+                ++len;
+            }
+            return len;
+        }
+
+        // size of a param's value, which follows its type byte, checked against the
+        // bytes available to it; false for an unknown type or a value which doesn't
+        // fit, as in a damaged log or archive
+        inline bool param_size(data_type type, const uint8_t* value, size_t available, size_t& size)
+        {
+            size = 0;
+            switch(type)
+            {
+                case data_type::utf8:
+                {
+                    const void* terminator = memchr(value, 0, available);
+                    size = terminator ? size_t((const uint8_t*)terminator - value) + 1 : 0;
+                    return terminator != nullptr;
+                }
+                case data_type::utf16:
+                case data_type::utf32:
+                {
+                    // strings end at the first null code unit
+                    const size_t unit = type == data_type::utf16 ? sizeof(char16_t) : sizeof(char32_t);
+                    for(size = 0; size + unit <= available; size += unit) {
+                        if ((unit == sizeof(char16_t) ? load_unaligned<char16_t>(value + size)
+                                                      : load_unaligned<char32_t>(value + size)) == 0) {
+                            size += unit;
+                            return true;
+                        }
+                    }
+                    return false;
+                }
+                case data_type::perf:
+                    if (available < sizeof(uint8_t)) {
+                        return false;
+                    }
+                    size = sizeof(uint8_t) + sizeof(uint64_t);
+                    for(size_t k = 0; k < (size_t)serialization::perf_counter::count; ++k) {
+                        if (*value & (1 << k)) {
+                            size += sizeof(uint64_t);
+                        }
+                    }
+                    break;
+                case data_type::metric:
+                    if (available < sizeof(uint8_t)) {
+                        return false;
+                    }
+                    switch((serialization::metric_kind)*value)
+                    {
+                        case serialization::metric_kind::counter:
+                            size = sizeof(uint8_t) + sizeof(int64_t);
+                            break;
+                        case serialization::metric_kind::gauge:
+                            size = sizeof(uint8_t) + 3 * sizeof(double);
+                            break;
+                        case serialization::metric_kind::histogram:
+                        {
+                            const size_t fixed = sizeof(uint8_t) + sizeof(uint64_t) + 3 * sizeof(double);
+                            const size_t bucket_size = sizeof(uint8_t) + sizeof(uint64_t);
+                            if (available < fixed + sizeof(uint8_t)) {
+                                return false;
+                            }
+                            const uint8_t bucket_count = value[fixed];
+                            size = fixed + sizeof(uint8_t) + bucket_count * bucket_size;
+                            if (size > available) {
+                                return false;
+                            }
+                            // bucket numbers index the sample's buckets when decoded
+                            for(uint8_t k = 0; k < bucket_count; ++k) {
+                                if (value[fixed + sizeof(uint8_t) + k * bucket_size] >= serialization::metric_histogram_buckets) {
+                                    return false;
+                                }
+                            }
+                            break;
+                        }
+                        default:
+                            return false;
+                    }
+                    break;
+                case data_type::flow:
+                    if (available < sizeof(uint8_t) || *value > (uint8_t)serialization::flow_phase::end) {
+                        return false;
+                    }
+                    size = sizeof(uint8_t) + sizeof(uint64_t);
+                    break;
+                case data_type::array:
+                {
+                    const size_t header = sizeof(uint8_t) + 2 * sizeof(uint32_t);
+                    const size_t element_size = available < header ? 0 : serialization::scalar_size((data_type)*value);
+                    if (element_size == 0) {
+                        return false;
+                    }
+                    size = header + load_unaligned<uint32_t>(value + 1) * element_size;
+                    break;
+                }
+                case data_type::blob:
+                    if (available < 2 * sizeof(uint32_t)) {
+                        return false;
+                    }
+                    size = 2 * sizeof(uint32_t) + load_unaligned<uint32_t>(value);
+                    break;
+                default:
+                    // every other type is a scalar
+                    size = serialization::scalar_size(type);
+                    if (size == 0) {
+                        return false;
+                    }
+                    break;
+            }
+            return size <= available;
+        }
+
+        // every message starts with its site: function, file, line and format string
+        struct log_site
+        {
+            const char* function;
+            const char* file;
+            uint32_t line;
+            const char* format_string;
+        };
+
+        const data_type SITE_TYPES[4] = {data_type::utf8, data_type::utf8, data_type::u32, data_type::utf8};
+
+        // finds the site at the start of a record, false if the record doesn't start
+        // with a function, file, line and format string which fit within its length
+        inline bool locate_site(const message* msg, log_site& site)
+        {
+            const uint8_t* head = reinterpret_cast<const uint8_t*>(msg) + sizeof(message);
+            const uint8_t* const tail = reinterpret_cast<const uint8_t*>(msg) + msg->length;
+            const uint8_t* values[4];
+            for(size_t k = 0; k < 4; ++k) {
+                size_t size = 0;
+                if (head == tail || (data_type)*head != SITE_TYPES[k] ||
+                    !param_size(SITE_TYPES[k], head + 1, size_t(tail - head) - 1, size)) {
+                    return false;
+                }
+                values[k] = head + 1;
+                head += 1 + size;
+            }
+            site.function = reinterpret_cast<const char*>(values[0]);
+            site.file = reinterpret_cast<const char*>(values[1]);
+            site.line = load_unaligned<uint32_t>(values[2]);
+            site.format_string = reinterpret_cast<const char*>(values[3]);
+            return true;
+        }
+
+        // the site of a record from next_message, which has already been validated
+        inline log_site locate_site(const message* msg)
+        {
+            log_site site = {"", "", 0, ""};
+            locate_site(msg, site);
+            return site;
+        }
+
+        // a record is well formed when it starts with its site and every param after
+        // it has a known type and a value which fits within the record's length
+        inline bool validate_record(const message* msg)
+        {
+            const uint8_t* head = reinterpret_cast<const uint8_t*>(msg) + sizeof(message);
+            const uint8_t* const tail = reinterpret_cast<const uint8_t*>(msg) + msg->length;
+            size_t count = 0;
+            for(; head < tail; ++count) {
+                const data_type type = (data_type)*head++;
+                size_t size = 0;
+                if ((count < 4 && type != SITE_TYPES[count]) ||
+                    !param_size(type, head, size_t(tail - head), size)) {
+                    return false;
+                }
+                head += size;
+            }
+            return count >= 4;
+        }
+
+        // strings, arrays and blobs are views into the message buffer
+        struct param_string
+        {
+            const uint8_t* data;
+            // in code units, without the terminator
+            size_t length;
+        };
+
+        struct param_array
+        {
+            data_type element_type;
+            uint32_t count;
+            uint32_t total;
+            const uint8_t* data;
+        };
+
+        // one decoded param of a record, params 0 to 3 are the site (function,
+        // file, line and format string) and the format string's arguments follow
+        struct param
+        {
+            data_type type;
+            union {
+                // utf8 strings are null terminated in place, so utf8_ is usable as a C string
+                const char* utf8_;
+                param_string utf16_;
+                param_string utf32_;
+                uint32_t  p32_;
+                uint64_t  p64_;
+                int8_t    i8_;
+                uint8_t   u8_;
+                int16_t   i16_;
+                uint16_t  u16_;
+                int32_t   i32_;
+                uint32_t  u32_;
+                int64_t   i64_;
+                uint64_t  u64_;
+                float     f32_;
+                double    f64_;
+                // perf and metric samples are decoded into the decoded_record
+                const serialization::perf_sample* perf_;
+                const serialization::metric_sample* metric_;
+                serialization::flow_marker flow_;
+                param_array array_;
+            } value;
+
+            param()
+            : type(data_type::invalid)
+            , value({0})
+            { }
+        };
+
+        // a record's params, reused from record to record so decoding doesn't allocate
+        struct decoded_record
+        {
+            std::vector<param> params;
+            // a message carries at most one perf sample and one metric sample
+            serialization::perf_sample perf;
+            serialization::metric_sample metric;
+        };
+
+        // decodes a record's params, stopping with false at a param which overruns the
+        // record or isn't a known type
+        inline bool decode_record(const message* msg, decoded_record& record)
+        {
+            const uint8_t* head = reinterpret_cast<const uint8_t*>(msg) + sizeof(message);
+            const uint8_t* const tail = reinterpret_cast<const uint8_t*>(msg) + msg->length;
+
+            auto& params = record.params;
+            params.clear();
+            while (head < tail)
+            {
+                param current;
+                current.type = (data_type)*head++;
+                size_t size = 0;
+                if (!param_size(current.type, head, size_t(tail - head), size)) {
+                    return false;
+                }
+                const uint8_t* value = head;
+                head += size;
+                switch(current.type)
+                {
+                    default:
+                        break;
+                    case data_type::utf8:
+                        current.value.utf8_ = reinterpret_cast<const char*>(value);
+                        break;
+                    case data_type::utf16:
+                        current.value.utf16_ = {value, size / sizeof(char16_t) - 1};
+                        break;
+                    case data_type::utf32:
+                        current.value.utf32_ = {value, size / sizeof(char32_t) - 1};
+                        break;
+                    case data_type::p32:
+                        current.value.p32_ = load_unaligned<uint32_t>(value);
+                        break;
+                    case data_type::p64:
+                        current.value.p64_ = load_unaligned<uint64_t>(value);
+                        break;
+                    case data_type::i8:
+                        current.value.i8_ = load_unaligned<int8_t>(value);
+                        break;
+                    case data_type::u8:
+                        current.value.u8_ = load_unaligned<uint8_t>(value);
+                        break;
+                    case data_type::i16:
+                        current.value.i16_ = load_unaligned<int16_t>(value);
+                        break;
+                    case data_type::u16:
+                        current.value.u16_ = load_unaligned<uint16_t>(value);
+                        break;
+                    case data_type::i32:
+                        current.value.i32_ = load_unaligned<int32_t>(value);
+                        break;
+                    case data_type::u32:
+                        current.value.u32_ = load_unaligned<uint32_t>(value);
+                        break;
+                    case data_type::i64:
+                        current.value.i64_ = load_unaligned<int64_t>(value);
+                        break;
+                    case data_type::u64:
+                        current.value.u64_ = load_unaligned<uint64_t>(value);
+                        break;
+                    case data_type::f32:
+                        current.value.f32_ = load_unaligned<float>(value);
+                        break;
+                    case data_type::f64:
+                        current.value.f64_ = load_unaligned<double>(value);
+                        break;
+                    case data_type::perf:
+                    {
+                        // a message carries at most one perf sample and one metric sample
+                        auto sample = &record.perf;
+                        *sample = serialization::perf_sample();
+                        sample->valid_mask = *value;
+                        value += sizeof(uint8_t);
+                        ::memcpy(&sample->duration, value, sizeof(uint64_t));
+                        value += sizeof(uint64_t);
+                        for(size_t k = 0; k < (size_t)serialization::perf_counter::count; ++k) {
+                            if (sample->valid_mask & (1 << k)) {
+                                ::memcpy(&sample->values[k], value, sizeof(uint64_t));
+                                value += sizeof(uint64_t);
+                            }
+                        }
+                        current.value.perf_ = sample;
+                        break;
+                    }
+                    case data_type::metric:
+                    {
+                        auto sample = &record.metric;
+                        *sample = serialization::metric_sample();
+                        sample->kind = (serialization::metric_kind)*value;
+                        value += sizeof(uint8_t);
+                        switch(sample->kind)
+                        {
+                            case serialization::metric_kind::counter:
+                                ::memcpy(&sample->sum, value, sizeof(int64_t));
+                                break;
+                            case serialization::metric_kind::gauge:
+                                ::memcpy(&sample->last, value, sizeof(double));
+                                ::memcpy(&sample->min, value + sizeof(double), sizeof(double));
+                                ::memcpy(&sample->max, value + 2 * sizeof(double), sizeof(double));
+                                break;
+                            case serialization::metric_kind::histogram:
+                            {
+                                ::memcpy(&sample->count, value, sizeof(uint64_t));
+                                value += sizeof(uint64_t);
+                                ::memcpy(&sample->total, value, sizeof(double));
+                                value += sizeof(double);
+                                ::memcpy(&sample->min, value, sizeof(double));
+                                value += sizeof(double);
+                                ::memcpy(&sample->max, value, sizeof(double));
+                                value += sizeof(double);
+                                // param_size checked every bucket number
+                                const uint8_t bucket_count = *value++;
+                                for(uint8_t k = 0; k < bucket_count; ++k) {
+                                    const uint8_t bucket = *value++;
+                                    ::memcpy(&sample->buckets[bucket], value, sizeof(uint64_t));
+                                    value += sizeof(uint64_t);
+                                }
+                                break;
+                            }
+                        }
+                        current.value.metric_ = sample;
+                        break;
+                    }
+                    case data_type::flow:
+                        current.value.flow_.phase = (serialization::flow_phase)*value;
+                        ::memcpy(&current.value.flow_.id, value + sizeof(uint8_t), sizeof(uint64_t));
+                        break;
+                    case data_type::array:
+                    case data_type::blob:
+                    {
+                        auto& arr = current.value.array_;
+                        arr.element_type = data_type::u8;
+                        if (current.type == data_type::array) {
+                            arr.element_type = (data_type)*value;
+                            value += sizeof(uint8_t);
+                        }
+                        ::memcpy(&arr.count, value, sizeof(uint32_t));
+                        value += sizeof(uint32_t);
+                        ::memcpy(&arr.total, value, sizeof(uint32_t));
+                        value += sizeof(uint32_t);
+                        arr.data = value;
+                        break;
+                    }
+                }
+                params.push_back(current);
+            }
+            return true;
+        }
+
+        // aggregate --repack merges a session's logs into one archive in timestamp
+        // order.  Sites and threads are stored once, and each record as
+        //   varint site, varint timestamp delta (from the previous record in its
+        //   block, or the block's min timestamp), varint thread, varint param count,
+        //   then each param's type byte and value: integers and pointers as varints
+        //   (zigzag for signed ones) and any other value as it was in the log
+        // The file is "TBBARC01", the blocks of records, the footer, the footer's
+        // offset (u64) and "TBBARC01" again.  The footer holds the record count and
+        // decoded size (u64 each), the sites (u32 count, each a varint length and
+        // the function, file, line and format params as they were in the log), the
+        // threads (u32 count, each a u32 process id and thread id) and an index of
+        // the blocks (u32 count, each its offset, size and decoded offset as u64,
+        // record count as u32 and min and max timestamp as u64).
+        const char ARCHIVE_MAGIC[8] = {'T', 'B', 'B', 'A', 'R', 'C', '0', '1'};
+        const size_t ARCHIVE_BLOCK_RECORDS = 65536;
+
+        struct archive_block
+        {
+            uint64_t offset;
+            uint64_t size;
+            // where the block's records start once decoded
+            uint64_t decoded_offset;
+            uint32_t count;
+            uint64_t min_timestamp;
+            uint64_t max_timestamp;
+        };
+
+        struct archive_footer
+        {
+            uint64_t record_count;
+            uint64_t decoded_size;
+            // views into the archive
+            std::vector<param_string> sites;
+            std::vector<std::pair<uint32_t, uint32_t>> threads;
+            std::vector<archive_block> blocks;
+        };
+
+        // bounds checked reads from an archive, any read past the end fails the cursor
+        struct archive_cursor
+        {
+            const uint8_t* head;
+            const uint8_t* end;
+            bool failed;
+
+            template<typename T>
+            T get()
+            {
+                if (size_t(end - head) < sizeof(T)) {
+                    failed = true;
+                    return T();
+                }
+                const T value = load_unaligned<T>(head);
+                head += sizeof(T);
+                return value;
+            }
+
+            uint64_t get_varint()
+            {
+                // most varints in an archive are a single byte
+                if (head != end && *head < 0x80) {
+                    return *head++;
+                }
+                uint64_t value = 0;
+                for(uint32_t shift = 0; shift < 64; shift += 7) {
+                    if (head == end) {
+                        break;
+                    }
+                    const uint8_t byte = *head++;
+                    value |= uint64_t(byte & 0x7f) << shift;
+                    if (!(byte & 0x80)) {
+                        return value;
+                    }
+                }
+                failed = true;
+                return 0;
+            }
+
+            const uint8_t* get_bytes(size_t size)
+            {
+                if (size_t(end - head) < size) {
+                    failed = true;
+                    return nullptr;
+                }
+                const uint8_t* bytes = head;
+                head += size;
+                return bytes;
+            }
+        };
+
+        inline bool read_archive_footer(const uint8_t* data, size_t size, archive_footer& footer)
+        {
+            const size_t trailer = sizeof(uint64_t) + sizeof(ARCHIVE_MAGIC);
+            if (size < sizeof(ARCHIVE_MAGIC) + trailer ||
+                memcmp(data + size - sizeof(ARCHIVE_MAGIC), ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0) {
+                return false;
+            }
+            const uint64_t footer_offset = load_unaligned<uint64_t>(data + size - trailer);
+            if (footer_offset < sizeof(ARCHIVE_MAGIC) || footer_offset > size - trailer) {
+                return false;
+            }
+
+            archive_cursor cursor = {data + footer_offset, data + size - trailer, false};
+            footer.record_count = cursor.get<uint64_t>();
+            footer.decoded_size = cursor.get<uint64_t>();
+            const uint32_t site_count = cursor.get<uint32_t>();
+            for(uint32_t k = 0; k < site_count && !cursor.failed; ++k) {
+                const size_t length = (size_t)cursor.get_varint();
+                footer.sites.push_back({cursor.get_bytes(length), length});
+            }
+            const uint32_t thread_count = cursor.get<uint32_t>();
+            for(uint32_t k = 0; k < thread_count && !cursor.failed; ++k) {
+                const uint32_t process_id = cursor.get<uint32_t>();
+                footer.threads.emplace_back(process_id, cursor.get<uint32_t>());
+            }
+            // blocks decode one after another, each ending where the next one starts
+            uint64_t decoded_offset = 0;
+            const uint32_t block_count = cursor.get<uint32_t>();
+            for(uint32_t k = 0; k < block_count && !cursor.failed; ++k) {
+                archive_block block;
+                block.offset = cursor.get<uint64_t>();
+                block.size = cursor.get<uint64_t>();
+                block.decoded_offset = cursor.get<uint64_t>();
+                block.count = cursor.get<uint32_t>();
+                block.min_timestamp = cursor.get<uint64_t>();
+                block.max_timestamp = cursor.get<uint64_t>();
+                if (block.offset > footer_offset || block.size > footer_offset - block.offset ||
+                    block.decoded_offset > footer.decoded_size ||
+                    (k == 0 ? block.decoded_offset != 0 : block.decoded_offset < decoded_offset)) {
+                    return false;
+                }
+                decoded_offset = block.decoded_offset;
+                footer.blocks.push_back(block);
+            }
+            return !cursor.failed;
+        }
+
+        // writes the k'th block's records to their place in out, which is sized for
+        // the whole archive; the records have to fill the block exactly
+        inline bool decode_archive_block(const uint8_t* data, const archive_footer& footer, size_t k, uint8_t* out)
+        {
+            const archive_block& block = footer.blocks[k];
+            archive_cursor cursor = {data + block.offset, data + block.offset + block.size, false};
+            uint8_t* head = out + block.decoded_offset;
+            uint8_t* const end = out + (k + 1 < footer.blocks.size() ? footer.blocks[k + 1].decoded_offset : footer.decoded_size);
+            uint64_t timestamp = block.min_timestamp;
+            for(uint32_t record = 0; record < block.count; ++record)
+            {
+                const uint64_t site = cursor.get_varint();
+                timestamp += cursor.get_varint();
+                const uint64_t thread = cursor.get_varint();
+                const uint64_t param_count = cursor.get_varint();
+                if (cursor.failed || site >= footer.sites.size() || thread >= footer.threads.size() ||
+                    size_t(end - head) < sizeof(message) + footer.sites[site].length) {
+                    return false;
+                }
+
+                message* msg = reinterpret_cast<message*>(head);
+                uint8_t* tail = head + sizeof(message);
+                ::memcpy(tail, footer.sites[site].data, footer.sites[site].length);
+                tail += footer.sites[site].length;
+                for(uint64_t j = 0; j < param_count; ++j)
+                {
+                    const data_type type = (data_type)cursor.get<uint8_t>();
+                    size_t size = serialization::scalar_size(type);
+                    if (cursor.failed || size_t(end - tail) < sizeof(type) + size) {
+                        return false;
+                    }
+                    *tail++ = (uint8_t)type;
+                    switch(type)
+                    {
+                        case data_type::i8:
+                        case data_type::i16:
+                        case data_type::i32:
+                        case data_type::i64:
+                        {
+                            const uint64_t zigzag = cursor.get_varint();
+                            const uint64_t value = (zigzag >> 1) ^ (0 - (zigzag & 1));
+                            // little endian, the low bytes of the value are the narrower type
+                            ::memcpy(tail, &value, size);
+                            break;
+                        }
+                        case data_type::p32:
+                        case data_type::p64:
+                        case data_type::u8:
+                        case data_type::u16:
+                        case data_type::u32:
+                        case data_type::u64:
+                        {
+                            const uint64_t value = cursor.get_varint();
+                            ::memcpy(tail, &value, size);
+                            break;
+                        }
+                        default:
+                        {
+                            const uint8_t* value = cursor.head;
+                            if (!param_size(type, value, size_t(cursor.end - value), size) ||
+                                size_t(end - tail) < size) {
+                                return false;
+                            }
+                            cursor.head += size;
+                            ::memcpy(tail, value, size);
+                            break;
+                        }
+                    }
+                    tail += size;
+                }
+                if (cursor.failed) {
+                    return false;
+                }
+
+                const uint32_t length = (uint32_t)(tail - head);
+                const auto& ids = footer.threads[thread];
+                ::memcpy(&msg->length, &length, sizeof(length));
+                ::memcpy(&msg->process_id, &ids.first, sizeof(ids.first));
+                ::memcpy(&msg->thread_id, &ids.second, sizeof(ids.second));
+                ::memcpy(&msg->timestamp, &timestamp, sizeof(timestamp));
+                head = tail;
+            }
+            return head == end;
+        }
+
+        // the archive behind a mapping whose data holds its decoded records
+        struct archive_decoder
+        {
+            // the archive file's own mapping
+            const uint8_t* data;
+            size_t size;
+            archive_footer footer;
+            std::vector<bool> decoded;
+            // blocks which failed to decode aren't tried again
+            std::vector<bool> damaged;
+            // the block the last record was read from, records are mostly read in order
+            size_t current;
+        };
+
+        // replaces the mapping of an archive with memory for its decoded records,
+        // which are only decoded when they're read.  Reading in order (as --stream
+        // does, dropping what it has consumed) then needs memory for about one
+        // block at a time.  Anything else is left as it is
+        inline bool open_archive(mapped_file& mapped)
+        {
+            if (mapped.size < sizeof(ARCHIVE_MAGIC) || memcmp(mapped.data, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0) {
+                return true;
+            }
+            std::unique_ptr<archive_decoder> decoder(new archive_decoder());
+            if (!read_archive_footer(mapped.data, mapped.size, decoder->footer)) {
+                return false;
+            }
+            decoder->data = mapped.data;
+            decoder->size = mapped.size;
+            decoder->decoded.resize(decoder->footer.blocks.size(), false);
+            decoder->damaged.resize(decoder->footer.blocks.size(), false);
+            decoder->current = 0;
+
+            const size_t decoded_size = (size_t)decoder->footer.decoded_size;
+            uint8_t* decoded = nullptr;
+            // pages are only backed once a block is decoded into them
+            if (decoded_size != 0) {
+#ifdef _WIN32
+                decoded = (uint8_t*)VirtualAlloc(nullptr, decoded_size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+                if (decoded == nullptr) {
+                    return false;
+                }
+#else
+                void* memory = mmap(nullptr, decoded_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+                if (memory == MAP_FAILED) {
+                    return false;
+                }
+#ifdef MADV_HUGEPAGE
+                // every page is written once, faulting them in is a good part of decoding
+                madvise(memory, decoded_size, MADV_HUGEPAGE);
+#endif
+                decoded = (uint8_t*)memory;
+#endif
+            }
+
+            mapped.data = decoded;
+            mapped.size = decoded_size;
+            mapped.archive = true;
+            mapped.decoder = decoder.release();
+            // the first block is decoded now so an archive which is damaged from
+            // the start fails to open
+            if (decoded_size != 0 && !decode_archive_at(mapped, 0)) {
+                close_archive(mapped);
+                return false;
+            }
+            return true;
+        }
+
+        // frees the decoded records and puts back the mapping of the archive itself
+        inline void close_archive(mapped_file& mapped)
+        {
+            if (mapped.data) {
+#ifdef _WIN32
+                VirtualFree((void*)mapped.data, 0, MEM_RELEASE);
+#else
+                munmap((void*)mapped.data, mapped.size);
+#endif
+            }
+            mapped.data = mapped.decoder->data;
+            mapped.size = mapped.decoder->size;
+            mapped.archive = false;
+            delete mapped.decoder;
+            mapped.decoder = nullptr;
+        }
+
+        // decodes the block holding offset unless it has been already, false if
+        // the block is damaged.  A mapping's blocks are decoded by whichever thread
+        // reads them, so one mapping is only read from one thread at a time
+        inline bool decode_archive_at(const mapped_file& mapped, size_t offset)
+        {
+            archive_decoder& decoder = *mapped.decoder;
+            const auto& blocks = decoder.footer.blocks;
+            size_t k = decoder.current;
+            const bool in_current = k < blocks.size() && offset >= blocks[k].decoded_offset &&
+                (k + 1 == blocks.size() || offset < blocks[k + 1].decoded_offset);
+            if (!in_current) {
+                // the last block starting at or before offset, past any empty ones
+                auto block = std::upper_bound(blocks.begin(), blocks.end(), (uint64_t)offset,
+                    [](uint64_t value, const archive_block& b) { return value < b.decoded_offset; });
+                if (block == blocks.begin()) {
+                    return false;
+                }
+                k = size_t(block - blocks.begin()) - 1;
+                decoder.current = k;
+            }
+            if (!decoder.decoded[k]) {
+                if (decoder.damaged[k] ||
+                    !decode_archive_block(decoder.data, decoder.footer, k, const_cast<uint8_t*>(mapped.data))) {
+                    decoder.damaged[k] = true;
+                    return false;
+                }
+                decoder.decoded[k] = true;
+#ifndef _WIN32
+                // the block isn't read again, so its whole pages of the archive are dropped
+                const uintptr_t page_size = uintptr_t(sysconf(_SC_PAGESIZE));
+                const uintptr_t begin = (uintptr_t(decoder.data + blocks[k].offset) + page_size - 1) & ~(page_size - 1);
+                const uintptr_t end = uintptr_t(decoder.data + blocks[k].offset + blocks[k].size) & ~(page_size - 1);
+                if (end > begin) {
+                    madvise((void*)begin, end - begin, MADV_DONTNEED);
+                }
+#endif
+            }
+            return true;
+        }
+
+        // k-way merge of log files into timestamp order; each file is nearly time
+        // ordered already, so only its next reorder_window messages need to be
+        // considered at once.  The order matches a stable sort of the files'
+        // messages (ties going to the earlier file) as long as no message is
+        // written more than reorder_window messages behind a later timestamp in
+        // the same file, and out_of_order() counts the messages which were.
+        // malformed() counts the records skipped by next_message
+        class merged_reader
+        {
+        public:
+            merged_reader(const std::vector<mapped_file>& files, size_t reorder_window)
+            : streams(files.size())
+            , heads(stream_after(this))
+            , reorder_window(reorder_window)
+            , last_timestamp(0)
+            , out_of_order_count(0)
+            , malformed_count(0)
+            {
+                for (size_t k = 0; k < files.size(); ++k)
+                {
+                    auto& stream = streams[k];
+                    stream.mapped = &files[k];
+                    stream.offset = 0;
+                    stream.sequence = 0;
+                    stream.window.reserve(reorder_window);
+#ifndef _WIN32
+                    if (stream.mapped->data) {
+                        madvise((void*)stream.mapped->data, stream.mapped->size, MADV_SEQUENTIAL);
+                    }
+#endif
+                    fill_window(stream);
+                    if (!stream.window.empty()) {
+                        heads.push(k);
+                    }
+                }
+            }
+
+            // the heads' comparison points back at the reader
+            merged_reader(const merged_reader&) = delete;
+            merged_reader& operator=(const merged_reader&) = delete;
+
+            // the next message in timestamp order without consuming it, or nullptr
+            const message* peek() const
+            {
+                return heads.empty() ? nullptr : streams[heads.top()].window.front().msg;
+            }
+
+            // the next message in timestamp order and the index of its file, or nullptr
+            const message* next(size_t* file = nullptr)
+            {
+                if (heads.empty()) {
+                    return nullptr;
+                }
+                const size_t k = heads.top();
+                heads.pop();
+
+                auto& stream = streams[k];
+                std::pop_heap(stream.window.begin(), stream.window.end(), windowed_message_after);
+                const message* msg = stream.window.back().msg;
+                stream.window.pop_back();
+                if (msg->timestamp < last_timestamp) {
+                    ++out_of_order_count;
+                } else {
+                    last_timestamp = msg->timestamp;
+                }
+
+                fill_window(stream);
+                if (!stream.window.empty()) {
+                    heads.push(k);
+                }
+                if (file) {
+                    *file = k;
+                }
+                return msg;
+            }
+
+            size_t out_of_order() const
+            {
+                return out_of_order_count;
+            }
+
+            size_t malformed() const
+            {
+                return malformed_count;
+            }
+
+            // how far into the file has been read
+            size_t read_offset(size_t file) const
+            {
+                return streams[file].offset;
+            }
+
+            // every message of the file before this offset has been returned by next()
+            size_t consumed_offset(size_t file) const
+            {
+                const auto& stream = streams[file];
+                size_t lowest = stream.offset;
+                for (const auto& entry : stream.window)
+                {
+                    lowest = std::min(lowest, size_t(reinterpret_cast<const uint8_t*>(entry.msg) - stream.mapped->data));
+                }
+                return lowest;
+            }
+
+        private:
+            // each file's next few messages are held in a small min-heap so
+            // enqueues which raced between threads still come out in order
+            struct windowed_message
+            {
+                uint64_t timestamp;
+                uint64_t sequence;
+                const message* msg;
+            };
+
+            struct stream
+            {
+                const mapped_file* mapped;
+                size_t offset;
+                uint64_t sequence;
+                std::vector<windowed_message> window;
+            };
+
+            // ties go to the earlier file, same as the stable sort
+            struct stream_after
+            {
+                explicit stream_after(const merged_reader* reader)
+                : reader(reader)
+                { }
+
+                bool operator()(size_t a, size_t b) const
+                {
+                    const auto& head_a = reader->streams[a].window.front();
+                    const auto& head_b = reader->streams[b].window.front();
+                    if (head_a.timestamp != head_b.timestamp) {
+                        return head_a.timestamp > head_b.timestamp;
+                    }
+                    return a > b;
+                }
+
+                const merged_reader* reader;
+            };
+
+            static bool windowed_message_after(const windowed_message& a, const windowed_message& b)
+            {
+                if (a.timestamp != b.timestamp) {
+                    return a.timestamp > b.timestamp;
+                }
+                return a.sequence > b.sequence;
+            }
+
+            // tops the stream's window back up to reorder_window messages
+            void fill_window(stream& stream)
+            {
+                while (stream.window.size() < reorder_window)
+                {
+                    const message* msg = next_message(*stream.mapped, stream.offset, &malformed_count);
+                    if (msg == nullptr) {
+                        break;
+                    }
+                    stream.window.push_back({msg->timestamp, stream.sequence++, msg});
+                    std::push_heap(stream.window.begin(), stream.window.end(), windowed_message_after);
+                }
+            }
+
+            std::vector<stream> streams;
+            std::priority_queue<size_t, std::vector<size_t>, stream_after> heads;
+            size_t reorder_window;
+            uint64_t last_timestamp;
+            size_t out_of_order_count;
+            size_t malformed_count;
+        };
+    }
+}
+
+#endif // TBB_READER_H
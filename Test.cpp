@@ -10,11 +10,37 @@
 
 void logging()
 {
+    TBB_PERF_SCOPE("logging");
+    // two scopes expanded onto one line
+    TBB_SCOPE("outer"); TBB_PERF_SCOPE("inner");
     TBB_LOG("string test: '{}' '{}' '{}' '{}'", u8"utf8", u"utf16", U"utf32", L"wide");
+    // characters outside the BMP are 4 bytes of UTF-8 for one UTF-32 unit, and an
+    // unpaired surrogate becomes U+FFFD
+    TBB_LOG("non-BMP: {} {:>4}", U"\U0001F600\U0001F600\U0001F600\U0001F600\U0001F600\U0001F600\U0001F600\U0001F600\U0001F600", U"\U0001F600");
+    const char16_t unpaired[] = {u'a', 0xD800, u'b', 0xDC00, 0};
+    TBB_LOG("unpaired surrogates: {}", unpaired);
     TBB_LOG("null pointer: {}", nullptr);
     int local;
     TBB_LOG("stack ptr: {}", &local);
     TBB_LOG("hex : {0:#x} dec : {0} bin : {0:#016b}", (uint16_t)128);
+    TBB_COUNTER("logging calls", 1);
+    TBB_HISTOGRAM("local address", (double)((uintptr_t)&local & 0xFFFF));
+    TBB_GAUGE("braces {} in {name}", 1.0);
+
+    std::vector<int32_t> sizes = {1, 2, 3};
+    const double weights[] = {0.5, 0.25};
+    TBB_LOG("span: {:#x} {}", tbb::span(sizes), tbb::span(weights, 2));
+    const uint8_t packet[] = {0xde, 0xad, 0xbe, 0xef, 0x00, 0x01};
+    TBB_LOG("blob: {}", tbb::blob(packet, sizeof(packet), 4));
+
+    const uint64_t flow_id = tbb::new_flow_id();
+    TBB_FLOW_BEGIN(flow_id, "flow begin {}", 1);
+    {
+        TBB_FLOW_CONTEXT(flow_id);
+        TBB_LOG("in flow context");
+    }
+    TBB_FLOW_STEP(flow_id, "flow step");
+    TBB_FLOW_END(flow_id, "flow end");
 }
 
 void logging2();